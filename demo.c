@@ -26,12 +26,90 @@
  *
  *   - handoff signal from identity, again not much done except printing
  *
+ *   - Multiple cameras, each in its own pipeline, controlled through
+ *     asynchronous operations (stream_connect_async() and friends) that are
+ *     driven by the bus. All of them run from the one GTK main loop
+ *
+ *   - Optional hugepage backed, prefaulted buffer pool for the decoded frames
+ *     (HugePageAllocator), offered to the decoder in the allocation query
+ *
+ *   - Accounting of the memory each stream holds per stage, with caps that
+ *     drop data and flush to live instead of growing (stream_get_memory)
+ *
+ *   - Startup of large camera sets: the pipelines are built on a thread pool
+ *     and the RTSP handshakes are limited, in total and per camera host
+ *     (startup_schedule)
+ *
+ *   - Live timeshift: the last minutes of encoded video are kept per stream,
+ *     the slider replays from them while the RTSP session stays live
+ *     (TimeShift)
+ *
+ *   - Replay of the camera's own recording through ONVIF replay, faster than
+ *     real time (stream_replay_seek)
+ *
+ *   - Capture of the received RTP/RTCP with arrival times, and replay of such
+ *     a capture file into the same chain (capture_write, CaptureReplay)
+ *
+ *   - Decode capacity benchmark on capture files, 1..N parallel pipelines
+ *     (decode_bench)
+ *
+ *   - Audio (AAC, G.711, Opus) on its own low latency branch that never
+ *     makes the video wait (stream_add_audio)
+ *
+ *   - ONVIF analytics metadata, parsed and drawn on a worker thread and
+ *     attached to the frames as overlay composition (metadata_worker)
+ *
+ *   - CPU time per stream and role (receive, depay, decode, render) from the
+ *     named streaming threads (stream_report_cpu)
+ *
+ *   - CPU budget governor: lower priority streams step down to cheaper modes
+ *     first, the focused one never (governor_step)
+ *
+ *   - LL-HLS output for browsers: the depayloaded H.264 muxed to CMAF parts
+ *     without re-encoding, served with blocking playlist reload (hls_serve)
+ *
+ *   - WebRTC output with WHEP signaling, keyframes only under congestion, and
+ *     SEI timestamps for measuring the end-to-end latency (whep_viewer_add)
+ *
+ *   - whep:// URLs: WebRTC ingest into the same decoder chain, with NACK and
+ *     PLI instead of RTSP's loss handling (whep_ingest_setup)
+ *
+ *   - srt:// URLs: MPEG-TS over SRT, its latency window derived from the RTT
+ *     and --srt-budget (srt_derive_latency)
+ *
+ *   - Re-encode relay: downscaled x264 zerolatency of the decoded video,
+ *     shared by all remote viewers through an RTSP server (stream_add_relay)
+ *
+ *   - Intra refresh streams: recovery point SEIs as keyframes, display from a
+ *     complete picture at the start and after loss (refresh_track)
+ *
+ *   - --concealment: after loss conceal, freeze on the last good frame or
+ *     drop until recovered, with artifact counts (refresh_loss)
+ *
+ *   - Camera clock skew by regression of RTP time on arrival time, compensated
+ *     with the jitterbuffers' ts-offset (latency_control)
+ *
+ *   - Catching up on latency by playing up to 5% faster rather than flushing,
+ *     through the jitterbuffers' max-ts-offset-adjustment (latency_control)
+ *
+ *   - --stats-file: per stream snapshots every second in a memory mapped,
+ *     fixed size ring that survives a crash, read with statsdump
+ *     (stats_file_write)
+ *
+ *   - Latency SLO per stream (--slo), with events to the log, a UNIX socket
+ *     and a command on violation and recovery (slo_evaluate)
+ *
+ *   - Live stats per stream in the text view next to the video: latency,
+ *     frame rate, drops, bitrate, decode time and CPU (panel_update)
+ *
+ *   - Fast startup build (-DDEMO_STATIC_PLUGINS): the few plugins needed are
+ *     linked in statically and registered without a registry
+ *
  *   - Latency is quite decent, observed 100..190ms end-to-end for a 5 megapixel
  *     30 fps stream. The 100 (actually 96) only once :) 150..160 more common.
  *     Tested on AMD Ryzen 5 2600/NVIDIA GeForce GTX 1060
  *
  * Todo:
- *   - Active supervision of the latency
  *   - Investigate whether this:
  *     http://gstreamer-devel.966125.n4.nabble.com/rtspsrc-jitterbuffer-stats-td4680812.html
  *     offers an optimization (partly done)
@@ -47,10 +125,33 @@
  * 2021, Erik
  */
 
+#define _GNU_SOURCE                     /* pthread_setname_np() */
 #include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 
 #include <gtk/gtk.h>
+#include <gio/gio.h>
 #include <gst/gst.h>
+#include <gst/app/gstappsrc.h>
+#include <gst/app/gstappsink.h>
+#include <gst/rtp/gstrtpbuffer.h>
+#include <gst/rtp/gstrtcpbuffer.h>
+#include <gst/rtp/gstrtphdrext.h>
+#include <gst/sdp/sdp.h>
+#include <gst/rtsp-server/rtsp-server.h>
+#include <gst/webrtc/webrtc.h>
+#include <gst/video/video.h>
+#include <gst/video/gstvideodecoder.h>
 #include <gst/video/videooverlay.h>
 
 #include <gdk/gdk.h>
@@ -62,309 +163,7432 @@
 #include <gdk/gdkquartz.h>
 #endif
 
-/* 
- * Structure to contain all our information, so we can pass it around 
- */
+#include "statsfile.h"
 
-typedef struct _CustomData 
-{
-  GstElement*  pipeline;           /* Our one and only pipeline */
+#ifdef DEMO_STATIC_PLUGINS
+/*
+ * Fast startup build. Only the plugins create_pipeline needs are linked in
+ * (gst-full style) and registered directly, so gst_init doesn't load or scan
+ * a registry. Snapshots additionally need videoconvertscale and png.
+ *
+ * Not registered either, so those features fail with their usual warning:
+ * x264enc (the relay's transcoded variants), srtsrc (srt:// URLs),
+ * webrtcbin (WHEP viewers and whep:// URLs), cmafmux (LL-HLS) and the audio
+ * elements. The relay itself only needs the rtsp-server library
+ */
 
-  gboolean     is_live;
-  GtkWidget*   slider;              /* Slider widget to keep track of current position */
-  GtkWidget*   streams_list;        /* Text widget to display info about the streams */
-  gulong       slider_update_signal_id; /* Signal ID for the slider update signal */
+GST_PLUGIN_STATIC_DECLARE(coreelements);
+GST_PLUGIN_STATIC_DECLARE(app);
+GST_PLUGIN_STATIC_DECLARE(udp);
+GST_PLUGIN_STATIC_DECLARE(rtsp);
+GST_PLUGIN_STATIC_DECLARE(rtp);
+GST_PLUGIN_STATIC_DECLARE(rtpmanager);
+GST_PLUGIN_STATIC_DECLARE(libav);
+GST_PLUGIN_STATIC_DECLARE(xvimagesink);
+GST_PLUGIN_STATIC_DECLARE(overlaycomposition);
 
-  GstState     state;                 /* Current state of the pipeline */
-  gint64       duration;                /* Duration of the clip, in nanoseconds */
-  guintptr     window_handle;
-  GstClockTime last_pts;
-} 
-CustomData;
+static void register_static_plugins(void)
+{
+   GST_PLUGIN_STATIC_REGISTER(coreelements);
+   GST_PLUGIN_STATIC_REGISTER(app);
+   GST_PLUGIN_STATIC_REGISTER(udp);
+   GST_PLUGIN_STATIC_REGISTER(rtsp);
+   GST_PLUGIN_STATIC_REGISTER(rtp);
+   GST_PLUGIN_STATIC_REGISTER(rtpmanager);
+   GST_PLUGIN_STATIC_REGISTER(libav);
+   GST_PLUGIN_STATIC_REGISTER(xvimagesink);
+   GST_PLUGIN_STATIC_REGISTER(overlaycomposition);
+}
+#endif
 
-/* This function is called when the GUI toolkit creates the physical window
- * that will hold the video.  At this point we can retrieve its handler (which
- * has a different meaning depending on the windowing system) and pass it to
- * GStreamer through the VideoOverlay interface. 
+/*
+ * Command line options
  */
 
-static void realize_cb (GtkWidget *widget, CustomData *data) 
+static gint   opt_timeout = 10;
+static gboolean opt_verbose = FALSE;
+static gint   opt_latency = 20;
+static gchar* opt_user = "root";
+static gchar* opt_password = "pass";
+static gboolean opt_hugepages = FALSE;
+static gboolean opt_hugepages_explicit = FALSE;
+static gboolean opt_mlock = FALSE;
+static gint   opt_prealloc_frames = 4;
+static gchar* opt_prealloc_resolution = "2592x1944";
+static gint   opt_mem_cap = 0;
+static gint   opt_jitterbuffer_cap = 0;
+static gint   opt_latency_resync = 500;
+static gint   opt_catchup_threshold = 50;
+static gdouble opt_catchup_rate = 1.05;
+static gdouble opt_catchup_accel = 0.01;
+static gint   opt_bench_rss = 0;
+static gboolean opt_exit_when_started = FALSE;
+static gint   opt_build_threads = 0;
+static gint   opt_max_handshakes = 8;
+static gint   opt_max_host_handshakes = 2;
+static gint   opt_timeshift = 0;
+static gchar* opt_replay_start = NULL;
+static gchar* opt_replay_end = NULL;
+static gdouble opt_replay_rate = 1.0;
+static gboolean opt_replay_keyframes = FALSE;
+static gchar* opt_capture = NULL;
+static gboolean opt_capture_fast = FALSE;
+static gint   opt_decode_bench = 0;
+static gint   opt_audio_buffer = 40;
+static gboolean opt_metadata = TRUE;
+static gint   opt_cpu_budget = 0;
+static gchar* opt_tiers = NULL;
+static gchar* opt_substream = NULL;
+static gchar* opt_concealment = NULL;
+static gint   opt_hls_port = 0;
+static gint   opt_hls_part = 200;
+static gint   opt_whep_port = 0;
+static gchar* opt_whep_test = NULL;
+static gint   opt_srt_budget = 500;
+static gint   opt_relay_port = 0;
+static gint   opt_relay_width = 960;
+static gint   opt_relay_bitrate = 1000;
+static gchar* opt_stats_file = NULL;
+static gint   opt_stats_hours = 24;
+static gchar* opt_slo = NULL;
+static gchar* opt_slo_socket = NULL;
+static gchar* opt_slo_exec = NULL;
+static gint   opt_panel_interval = 1000;
+
+static GOptionEntry opt_entries[] =
 {
-  GdkWindow *window = gtk_widget_get_window (widget);
-  guintptr window_handle;
+   { "timeout", 't', 0, G_OPTION_ARG_INT, &opt_timeout, "Seconds to wait for connect, first frame and snapshots (0 = no limit)", "S" },
+   { "verbose", 'v', 0, G_OPTION_ARG_NONE, &opt_verbose, "Print the memory, CPU, A/V, HLS, SRT and relay figures of each stream every second", NULL },
+   { "latency", 'l', 0, G_OPTION_ARG_INT, &opt_latency, "Jitterbuffer latency of rtspsrc and WebRTC ingest (default 20)", "MS" },
+   { "user", 'u', 0, G_OPTION_ARG_STRING, &opt_user, "RTSP user name", "NAME" },
+   { "password", 'p', 0, G_OPTION_ARG_STRING, &opt_password, "RTSP password", "PW" },
+   { "hugepages", 0, 0, G_OPTION_ARG_NONE, &opt_hugepages, "Decode into a prefaulted, hugepage backed buffer pool", NULL },
+   { "hugepages-explicit", 0, 0, G_OPTION_ARG_NONE, &opt_hugepages_explicit, "Use reserved (MAP_HUGETLB) instead of transparent hugepages", NULL },
+   { "mlock", 0, 0, G_OPTION_ARG_NONE, &opt_mlock, "Lock the decoded frame buffers in memory", NULL },
+   { "prealloc-frames", 0, 0, G_OPTION_ARG_INT, &opt_prealloc_frames, "Frame buffers to prefault at pipeline creation (default 4)", "N" },
+   { "prealloc-resolution", 0, 0, G_OPTION_ARG_STRING, &opt_prealloc_resolution, "Expected I420 resolution for the prefaulted buffers (default 2592x1944)", "WxH" },
+   { "mem-cap", 0, 0, G_OPTION_ARG_INT, &opt_mem_cap, "Drop packets and flush to live when a stream's backlog is more than this (0 = no cap)", "KB" },
+   { "jitterbuffer-cap", 0, 0, G_OPTION_ARG_INT, &opt_jitterbuffer_cap, "Drop packets and flush to live when the jitterbuffer holds more than this (0 = no cap)", "KB" },
+   { "latency-resync", 0, 0, G_OPTION_ARG_INT, &opt_latency_resync, "Jump back to the initial latency when it moved more than this (default 500, 0 = never)", "MS" },
+   { "catchup-threshold", 0, 0, G_OPTION_ARG_INT, &opt_catchup_threshold, "Play faster or slower when the latency moved more than this (default 50)", "MS" },
+   { "catchup-rate", 0, 0, G_OPTION_ARG_DOUBLE, &opt_catchup_rate, "Maximum rate to catch up at (default 1.05)", "R" },
+   { "catchup-accel", 0, 0, G_OPTION_ARG_DOUBLE, &opt_catchup_accel, "Change of the rate per second (default 0.01)", "R" },
+   { "bench-rss", 0, 0, G_OPTION_ARG_INT, &opt_bench_rss, "Report the steady state RSS per stream, S seconds after all streams started, then quit", "S" },
+   { "exit-when-started", 0, 0, G_OPTION_ARG_NONE, &opt_exit_when_started, "Quit as soon as all streams show video, to measure startup time", NULL },
+   { "build-threads", 0, 0, G_OPTION_ARG_INT, &opt_build_threads, "Threads that build the pipelines (0 = one per CPU)", "N" },
+   { "max-handshakes", 0, 0, G_OPTION_ARG_INT, &opt_max_handshakes, "RTSP handshakes in progress at the same time (0 = no limit, default 8)", "N" },
+   { "max-host-handshakes", 0, 0, G_OPTION_ARG_INT, &opt_max_host_handshakes, "Idem, per camera host (0 = no limit, default 2)", "N" },
+   { "timeshift", 0, 0, G_OPTION_ARG_INT, &opt_timeshift, "Keep the last S seconds of video for replay with the slider (0 = off)", "S" },
+   { "replay-start", 0, 0, G_OPTION_ARG_STRING, &opt_replay_start, "Replay the camera's recording from this time (ISO 8601, e.g. 2024-05-01T12:00:00Z) with ONVIF replay", "TIME" },
+   { "replay-end", 0, 0, G_OPTION_ARG_STRING, &opt_replay_end, "End of the replay (default end of the recording)", "TIME" },
+   { "replay-rate", 0, 0, G_OPTION_ARG_DOUBLE, &opt_replay_rate, "Replay rate, negative is backwards (default 1). Data is pulled as fast as the camera sends it", "R" },
+   { "replay-keyframes", 0, 0, G_OPTION_ARG_NONE, &opt_replay_keyframes, "Replay keyframes only", NULL },
+   { "capture", 0, 0, G_OPTION_ARG_STRING, &opt_capture, "Write the RTP and RTCP packets each camera sends to input<N>-NAME, for replay", "NAME" },
+   { "capture-fast", 0, 0, G_OPTION_ARG_NONE, &opt_capture_fast, "Replay capture files as fast as possible instead of with the original timing", NULL },
+   { "decode-bench", 0, 0, G_OPTION_ARG_INT, &opt_decode_bench, "Decode the capture files given as URLs on 1..N parallel pipelines, as fast as possible, and report the throughput", "N" },
+   { "audio-buffer", 0, 0, G_OPTION_ARG_INT, &opt_audio_buffer, "Audio sink buffer (default 40, 0 = no audio)", "MS" },
+   { "no-metadata", 0, G_OPTION_FLAG_REVERSE, G_OPTION_ARG_NONE, &opt_metadata, "Don't show the ONVIF analytics metadata", NULL },
+   { "cpu-budget", 0, 0, G_OPTION_ARG_INT, &opt_cpu_budget, "CPU budget of the process in % of one core, e.g. 400 for four cores (0 = no governor)", "PERCENT" },
+   { "tiers", 0, 0, G_OPTION_ARG_STRING, &opt_tiers, "Priority of each stream, in order: focused, visible or background (default visible)", "LIST" },
+   { "concealment", 0, 0, G_OPTION_ARG_STRING, &opt_concealment, "After packet loss, per stream in order: conceal, freeze, drop or auto (default auto: freeze for intra refresh, else conceal)", "LIST" },
+   { "substream", 0, 0, G_OPTION_ARG_STRING, &opt_substream, "URL parameters selecting the camera's sub-stream, for the governor (e.g. resolution=640x360)", "PARAMS" },
+   { "hls-port", 0, 0, G_OPTION_ARG_INT, &opt_hls_port, "Serve each stream as LL-HLS on this port, http://host:PORT/input<N>/index.m3u8 (0 = off)", "PORT" },
+   { "hls-part", 0, 0, G_OPTION_ARG_INT, &opt_hls_part, "LL-HLS part duration (default 200)", "MS" },
+   { "whep-port", 0, 0, G_OPTION_ARG_INT, &opt_whep_port, "WebRTC viewers, WHEP endpoint http://host:PORT/input<N>/whep (0 = off)", "PORT" },
+   { "whep-test", 0, 0, G_OPTION_ARG_STRING, &opt_whep_test, "Play this WHEP endpoint in-process and report the end-to-end latency", "URL" },
+   { "srt-budget", 0, 0, G_OPTION_ARG_INT, &opt_srt_budget, "End-to-end latency budget of srt:// streams, sets their SRT latency with the RTT (default 500)", "MS" },
+   { "relay-port", 0, 0, G_OPTION_ARG_INT, &opt_relay_port, "Re-encode each stream for remote viewers, rtsp://host:PORT/input<N> (0 = off)", "PORT" },
+   { "relay-width", 0, 0, G_OPTION_ARG_INT, &opt_relay_width, "Width of the re-encoded video (default 960)", "PIXELS" },
+   { "relay-bitrate", 0, 0, G_OPTION_ARG_INT, &opt_relay_bitrate, "Bitrate of the re-encoded video (default 1000)", "KBPS" },
+   { "stats-file", 0, 0, G_OPTION_ARG_FILENAME, &opt_stats_file, "Write the statistics of each stream every second to this file, see statsdump", "FILE" },
+   { "stats-hours", 0, 0, G_OPTION_ARG_INT, &opt_stats_hours, "Hours the stats file holds before it wraps (default 24, at most a year)", "H" },
+   { "slo", 0, 0, G_OPTION_ARG_STRING, &opt_slo, "End-to-end latency objective per stream, in order: pQUANTILE:MS[:WINDOW_S[:MAX_DROP_PERCENT]], e.g. p99:200:10:1, or none", "LIST" },
+   { "slo-socket", 0, 0, G_OPTION_ARG_FILENAME, &opt_slo_socket, "Send SLO events as JSON datagrams to this UNIX socket", "PATH" },
+   { "slo-exec", 0, 0, G_OPTION_ARG_STRING, &opt_slo_exec, "Run this command on SLO events, with SLO_STREAM, SLO_EVENT, SLO_SEVERITY etc. in the environment", "CMD" },
+   { "panel-interval", 0, 0, G_OPTION_ARG_INT, &opt_panel_interval, "Refresh of the stats next to the video (default 1000, 0 = off)", "MS" },
+   { NULL }
+};
 
-  if (!gdk_window_ensure_native (window))
-  {
-    g_error ("Couldn't create native window needed for GstVideoOverlay!");
-  }
+/* 
+ * Structure to contain all our information, so we can pass it around 
+ */
 
-  /* Retrieve window handler from GDK */
-#if defined (GDK_WINDOWING_WIN32)
-  data->window_handle = (guintptr)GDK_WINDOW_HWND (window);
-#elif defined (GDK_WINDOWING_QUARTZ)
-  data->window_handle = gdk_quartz_window_get_nsview (window);
-#elif defined (GDK_WINDOWING_X11)
-  data->window_handle = GDK_WINDOW_XID (window);
-#endif
-}
+typedef struct _CustomData CustomData;
 
-/* 
- * Handlers for various button presses
+/*
+ * Counters of a stream. They are updated from the streaming threads and read
+ * from the main loop, always through the stat_xxx() functions
  */
-static void play_cb(GtkButton *button, CustomData *data) 
+
+typedef struct
 {
-  gst_element_set_state(data->pipeline, GST_STATE_PLAYING);
+   gssize       jitterbuffer_in_bytes;
+   gssize       jitterbuffer_in_packets;
+   gssize       jitterbuffer_out_packets;
+   gssize       jitterbuffer_gone_packets;  /* Late and duplicate packets, from the jitterbuffer's stats */
+   gssize       depay_bytes;                /* Access unit being assembled */
+   gssize       decoder_in_frames;
+   gssize       decoder_in_bytes;
+   gssize       decoder_out_frames;
+   gssize       decoder_gone_frames;        /* Dropped by QoS or flushed */
+   gssize       frame_bytes;                /* Size of one decoded frame */
+   gssize       cap_dropped_packets;        /* Dropped to stay below --jitterbuffer-cap or --mem-cap */
+   gssize       flushes;
+   gssize       latency_resyncs;            /* See latency_control() */
+   gssize       held_frames;                /* Decoded but not shown, picture incomplete or corrupted */
+   gssize       loss_events;                /* DISCONT from the depayloader, see refresh_loss() */
+   gssize       corrupted_frames_shown;     /* Shown before recovery, or CORRUPTED from the decoder */
+   gssize       recovery_time_us;           /* Sum over the recoveries, loss to complete picture */
+   gssize       recoveries;
+   gssize       srt_rtt_us;                 /* SRT link, see srt_report() */
+   gssize       srt_retransmitted_packets;
+   gssize       srt_lost_packets;
+   gssize       srt_dropped_packets;        /* Too late, even with retransmission */
 }
+StreamStats;
 
-static void pause_cb(GtkButton *button, CustomData *data) 
+static inline void stat_add(gssize* stat, gssize value)
 {
-  gst_element_set_state(data->pipeline, GST_STATE_PAUSED);
+   g_atomic_pointer_add(stat, value);
 }
 
-static void stop_cb (GtkButton *button, CustomData *data) 
+static inline void stat_set(gssize* stat, gssize value)
 {
-  gst_element_set_state(data->pipeline, GST_STATE_READY);
+   g_atomic_pointer_set(stat, value);
 }
 
-/* 
- * This function is called when the main window is closed 
- */
-
-static void delete_event_cb(GtkWidget *widget, GdkEvent *event, CustomData *data) 
+static inline gssize stat_get(gssize* stat)
 {
-  stop_cb (NULL, data);
-  gtk_main_quit ();
+   return (gssize)g_atomic_pointer_get(stat);
 }
 
-/* This function is called everytime the video window needs to be redrawn (due
- * to damage/exposure, rescaling, etc). GStreamer takes care of this in the
- * PAUSED and PLAYING states, otherwise, we simply draw a black rectangle to
- * avoid garbage showing up. 
+/*
+ * Timeshift buffer of a stream, see timeshift_record_probe(). Protected by
+ * the stream's lock
  */
 
-static gboolean draw_cb(GtkWidget *widget, cairo_t *cr, CustomData *data) 
+typedef struct
 {
-	if (data->state < GST_STATE_PAUSED)
-	{
-		GtkAllocation allocation;
+   GstBuffer**  units;               /* Ring of access units, oldest at head */
+   guint        capacity;
+   guint        head;
+   guint        count;
+   guint64      first_seq;           /* Sequence number of the unit at head */
+   GArray*      keyframes;           /* Sequence numbers (guint64) of the keyframes in the ring */
+   gsize        bytes;
 
-		/* Cairo is a 2D graphics library which we use here to clean the video window.
-		 * It is used by GStreamer for other reasons, so it will always be available to us. */
-		gtk_widget_get_allocation (widget, &allocation);
-		cairo_set_source_rgb (cr, 0, 0, 0);
-		cairo_rectangle (cr, 0, 0, allocation.width, allocation.height);
-		cairo_fill (cr);
-	}
-	return FALSE;
+   gboolean     replaying;           /* The selector is on the replay appsrc */
+   gboolean     paused;              /* Replay holds at cursor */
+   gboolean     rebase;              /* Compute offset from the next unit replayed */
+   guint64      cursor;              /* Sequence number of the next unit to replay */
+   GstClockTimeDiff offset;          /* Added to the timestamps of the replayed units */
+   gint         wanted;              /* Atomic, between appsrc's need-data and enough-data */
 }
+TimeShift;
 
-/* 
- * This function is called when the slider changes its position. We perform a
- * seek to the new position here. 
- */
+#define TIMESHIFT_MAX_FPS 120
 
-static void slider_cb (GtkRange *range, CustomData *data) 
+static inline GstBuffer* timeshift_unit(TimeShift* ts, guint64 seq)
 {
-  gdouble value = gtk_range_get_value (GTK_RANGE (data->slider));
-  gst_element_seek_simple (data->pipeline, GST_FORMAT_TIME, GST_SEEK_FLAG_FLUSH | GST_SEEK_FLAG_KEY_UNIT,
-      (gint64)(value * GST_SECOND));
+   return ts->units[(ts->head + (seq - ts->first_seq)) % ts->capacity];
 }
 
-/* 
- * This creates all the GTK+ widgets that compose our application, and registers the callbacks 
- */
+static void timeshift_init(TimeShift* ts, guint seconds)
+{
+   ts->capacity = seconds * TIMESHIFT_MAX_FPS;
+   ts->units = g_new0(GstBuffer*, ts->capacity);
+   ts->keyframes = g_array_new(FALSE, FALSE, sizeof(guint64));
+}
 
-static void create_ui (CustomData *data) 
+static void timeshift_clear(TimeShift* ts)
 {
-  GtkWidget *main_window;  /* The uppermost window, containing all other windows */
-  GtkWidget *video_window; /* The drawing area where the video will be shown */
-  GtkWidget *main_box;     /* VBox to hold main_hbox and the controls */
-  GtkWidget *main_hbox;    /* HBox to hold the video_window and the stream info text widget */
-  GtkWidget *controls;     /* HBox to hold the buttons and the slider */
-  GtkWidget *play_button, *pause_button, *stop_button; /* Buttons */
+   for (guint i = 0; i < ts->count; i++)
+   {
+      gst_buffer_unref(ts->units[(ts->head + i) % ts->capacity]);
+   }
+   g_free(ts->units);
+   if (ts->keyframes)
+   {
+      g_array_free(ts->keyframes, TRUE);
+   }
+}
 
-  main_window = gtk_window_new (GTK_WINDOW_TOPLEVEL);
-  g_signal_connect (G_OBJECT (main_window), "delete-event", G_CALLBACK (delete_event_cb), data);
+/*
+ * Capture file, see capture_write()
+ *
+ * A header followed by records, each a CaptureRecord and its data padded to
+ * 8 bytes, so the file can be mmap'ed and walked without copying. Native
+ * byte order, it's meant to be replayed on the same kind of machine
+ */
 
-  video_window = gtk_drawing_area_new ();
-  gtk_widget_set_double_buffered (video_window, FALSE);
-  g_signal_connect (video_window, "realize", G_CALLBACK (realize_cb), data);
-  g_signal_connect (video_window, "draw", G_CALLBACK (draw_cb), data);
+#define CAPTURE_MAGIC "RTPCAP1"
+#define CAPTURE_HEADER_SIZE 8
+#define CAPTURE_ALIGN(len) (((len) + 7) & ~(gsize)7)
 
-  play_button = gtk_button_new_from_icon_name ("media-playback-start", GTK_ICON_SIZE_SMALL_TOOLBAR);
-  g_signal_connect (G_OBJECT (play_button), "clicked", G_CALLBACK (play_cb), data);
+typedef enum
+{
+   CAPTURE_RTP,
+   CAPTURE_RTCP,
+   CAPTURE_CAPS,          /* Caps string of the session, NUL terminated */
+}
+CaptureKind;
 
-  pause_button = gtk_button_new_from_icon_name ("media-playback-pause", GTK_ICON_SIZE_SMALL_TOOLBAR);
-  g_signal_connect (G_OBJECT (pause_button), "clicked", G_CALLBACK (pause_cb), data);
+typedef struct
+{
+   guint64      arrival;             /* ns since the first record */
+   guint32      length;              /* Of the data that follows, without padding */
+   guint8       kind;                /* CaptureKind */
+   guint8       session;             /* rtpbin session */
+   guint16      reserved;
+}
+CaptureRecord;
 
-  stop_button = gtk_button_new_from_icon_name ("media-playback-stop", GTK_ICON_SIZE_SMALL_TOOLBAR);
-  g_signal_connect (G_OBJECT (stop_button), "clicked", G_CALLBACK (stop_cb), data);
+/*
+ * Replay of a capture file into rtpbin, see capture_replay_thread()
+ */
 
-  data->slider = gtk_scale_new_with_range (GTK_ORIENTATION_HORIZONTAL, 0, 100, 1);
-  gtk_scale_set_draw_value (GTK_SCALE (data->slider), 0);
-  data->slider_update_signal_id = g_signal_connect (G_OBJECT (data->slider), "value-changed", G_CALLBACK (slider_cb), data);
+typedef struct
+{
+   GMappedFile* file;
+   guint        session;             /* The video session, only that one is replayed */
+   GstElement*  rtp_src;             /* appsrc's */
+   GstElement*  rtcp_src;
+   GThread*     thread;
+   GMutex       lock;
+   GCond        cond;
+   gboolean     stop;
+}
+CaptureReplay;
 
-  data->streams_list = gtk_text_view_new ();
-  gtk_text_view_set_editable (GTK_TEXT_VIEW (data->streams_list), FALSE);
+/*
+ * What a streaming thread does, see cpu_thread_enter()
+ */
 
-  controls = gtk_box_new (GTK_ORIENTATION_HORIZONTAL, 0);
-  gtk_box_pack_start (GTK_BOX (controls), play_button, FALSE, FALSE, 2);
-  gtk_box_pack_start (GTK_BOX (controls), pause_button, FALSE, FALSE, 2);
-  gtk_box_pack_start (GTK_BOX (controls), stop_button, FALSE, FALSE, 2);
-  gtk_box_pack_start (GTK_BOX (controls), data->slider, TRUE, TRUE, 2);
+typedef enum
+{
+   CPU_RECEIVE,
+   CPU_DEPAY,
+   CPU_DECODE,
+   CPU_RENDER,
+   CPU_ENCODE,
+   CPU_ROLES
+}
+CpuRole;
 
-  main_hbox = gtk_box_new (GTK_ORIENTATION_HORIZONTAL, 0);
-  gtk_box_pack_start (GTK_BOX (main_hbox), video_window, TRUE, TRUE, 0);
-  gtk_box_pack_start (GTK_BOX (main_hbox), data->streams_list, FALSE, FALSE, 2);
+static const gchar* cpu_role_names[CPU_ROLES] = { "receive", "depay", "decode", "render", "encode" };
+static const gchar* cpu_role_thread_names[CPU_ROLES] = { "recv", "depay", "dec", "render", "enc" };
 
-  main_box = gtk_box_new (GTK_ORIENTATION_VERTICAL, 0);
-  gtk_box_pack_start (GTK_BOX (main_box), main_hbox, TRUE, TRUE, 0);
-  gtk_box_pack_start (GTK_BOX (main_box), controls, FALSE, FALSE, 0);
-  gtk_container_add (GTK_CONTAINER (main_window), main_box);
-  gtk_window_set_default_size (GTK_WINDOW (main_window), 640, 480);
+/*
+ * Priority of a stream for the governor, see --tiers
+ */
 
-  gtk_widget_show_all (main_window);
+typedef enum
+{
+   TIER_FOCUSED,
+   TIER_VISIBLE,
+   TIER_BACKGROUND
 }
+StreamTier;
 
-/* 
- * Called every second to print some time info
+/*
+ * What is shown after lost packets, see --concealment and refresh_loss()
  */
 
-static gboolean update_timeinfo(CustomData *data) 
+typedef enum
 {
-  gint64 current = -1;
+   CONCEAL_AUTO,          /* Freeze for intra refresh streams, conceal for others */
+   CONCEAL_SHOW,          /* The decoder's concealment, smeared until the next IDR frame */
+   CONCEAL_FREEZE,        /* Keep decoding, show the last good frame until recovered */
+   CONCEAL_DROP           /* Don't decode until the next IDR frame or recovery point */
+}
+ConcealPolicy;
 
-  /* We do not want to update anything unless we are in the PAUSED or PLAYING states */
-  if (data->state < GST_STATE_PAUSED)
-  {
-    return TRUE;
-  }
+static const gchar* conceal_policy_names[] = { "auto", "conceal", "freeze", "drop" };
 
-  if (gst_element_query_position(data->pipeline, GST_FORMAT_TIME, &current)) 
-  {
+/*
+ * The cheaper modes the governor steps a stream through, see governor_apply()
+ */
 
-     GstClockTimeDiff diff = GST_CLOCK_DIFF(current, data->last_pts);
-     g_print("Last PTS: %" GST_TIME_FORMAT ", current: %" GST_TIME_FORMAT ", Diff with current: %li.%03lims\n", GST_TIME_ARGS(data->last_pts), GST_TIME_ARGS(current), diff / 1000000, (labs(diff) / 1000) % 1000);
-  }
-  return TRUE;
+typedef enum
+{
+   GOVERNOR_FULL,
+   GOVERNOR_REDUCED_FPS,
+   GOVERNOR_KEYFRAMES,
+   GOVERNOR_SUBSTREAM,
+   GOVERNOR_PAUSED,
+   GOVERNOR_LEVELS
 }
+GovernorLevel;
 
-/* 
- * An error message was posted on the bus 
+static const gchar* governor_level_names[GOVERNOR_LEVELS] = { "full", "reduced fps", "keyframes only", "sub-stream", "paused" };
+
+/*
+ * One streaming thread of a stream, between its stream-status enter and leave
  */
 
-static void error_cb(GstBus *bus, GstMessage *msg, CustomData *data) 
+typedef struct
 {
-  GError *err;
-  gchar *debug_info;
-
-  /* Print error details on the screen */
-  gst_message_parse_error (msg, &err, &debug_info);
-  g_printerr ("Error received from element %s: %s\n", GST_OBJECT_NAME (msg->src), err->message);
-  g_printerr ("Debugging information: %s\n", debug_info ? debug_info : "none");
-  g_clear_error (&err);
-  g_free (debug_info);
-
-  /* Set the pipeline to READY (which stops playback) */
-  gst_element_set_state (data->pipeline, GST_STATE_READY);
+   struct _StreamData* stream;
+   clockid_t    clock;               /* The thread's CPU clock */
+   CpuRole      role;
+   guint64      enter_ns;            /* Its CPU time when it entered */
+   CpuRole      stage;               /* Element the thread is in now, see cpu_stage() */
+   guint64      stage_ns;            /* Its CPU time when it went there */
+   guint64      staged[CPU_ROLES];   /* Time spent in the stages it left */
 }
+CpuThread;
 
-/* 
- * This function is called when an End-Of-Stream message is posted on the bus.
- * We just set the pipeline to READY (which stops playback) 
+/*
+ * Clock skew of a stream's camera, see skew_add()
  */
 
-static void eos_cb (GstBus *bus, GstMessage *msg, CustomData *data) {
-  g_print ("End-Of-Stream reached.\n");
-  gst_element_set_state (data->pipeline, GST_STATE_READY);
-}
+#define SKEW_WINDOW 120              /* Seconds in the regression */
+#define SKEW_ARRIVALS 64             /* Arrivals of the last frames */
+#define HOLD_BUCKETS 1000            /* 1ms each, for the quantiles in the stats file */
 
-static void handoff_cb(GstElement* identity, GstBuffer* buffer, CustomData *data)
+typedef struct
 {
-  data->last_pts = GST_BUFFER_PTS(buffer);
+   GMutex       lock;
+   GstElement*  jitterbuffer;        /* The video's */
+   gint         clock_rate;
+   gboolean     started;
+   gboolean     restarted;           /* For latency_control() */
+   GstClockTime origin_arrival;
+   guint64      origin_rtp;
+   guint32      last_rtp;
+   guint64      ext_rtp;             /* Extended RTP timestamp */
+   gdouble      x[SKEW_WINDOW];      /* Arrival (s), least delayed frame of each second */
+   gdouble      y[SKEW_WINDOW];      /* Its RTP time (s) */
+   guint        head;
+   guint        count;
+   gint64       bucket;              /* The second being collected */
+   gdouble      bucket_x;
+   gdouble      bucket_y;
+   gboolean     bucket_valid;
+   guint32      arrival_rtp[SKEW_ARRIVALS];
+   GstClockTime arrival[SKEW_ARRIVALS];
+   guint        arrival_next;
+   GstClockTimeDiff hold_min;        /* Least PTS - arrival since the previous latency_control() */
+   gboolean     hold_valid;
+   guint        hold_histogram[HOLD_BUCKETS]; /* All of them since the previous stats_file_write() */
+   guint        hold_count;
+   GstClockTimeDiff hold_max;
 }
+SkewEstimator;
 
-/* 
- * This function is called when the pipeline changes states. We use it to
- * keep track of the current state. 
+/*
+ * Latency SLO of a stream, see slo_evaluate()
  */
 
-static void state_changed_cb(GstBus *bus, GstMessage *msg, CustomData *data) 
+#define SLO_MAX_WINDOW 300           /* Seconds */
+
+typedef enum
 {
-   GstState old_state, new_state, pending_state;
-   gst_message_parse_state_changed (msg, &old_state, &new_state, &pending_state);
+   SLO_OK,
+   SLO_WARNING,
+   SLO_CRITICAL
+}
+SloSeverity;
 
-   data->state = new_state;
-   g_print ("State set to %s\n", gst_element_state_get_name (new_state));
-   if (old_state == GST_STATE_READY && new_state == GST_STATE_PAUSED) 
-   {
-      /* Refresh the GUI as soon as we reach the PAUSED state */
-      update_timeinfo(data);
-   }
+typedef struct
+{
+   guint        held;                /* Frames whose hold time was measured */
+   guint        over;                /* Idem, end-to-end longer than the SLO's latency */
+   guint        over_twice;
+   guint        frames;              /* Decoded */
+   guint        dropped;
+}
+SloSecond;
+
+typedef struct
+{
+   gdouble      quantile;            /* 0.99 for p99, 0 = no SLO */
+   guint        latency;             /* ms */
+   guint        window;              /* Seconds */
+   gdouble      max_drops;           /* % of the frames, 0 = not checked */
+   SloSecond    seconds[SLO_MAX_WINDOW]; /* Ring of the window */
+   guint        head;
+   guint        count;
+   SloSeverity  severity;
+   SloSeverity  worst;
+   gint64       violation_start;     /* Monotonic */
+   gint64       violated_time;       /* us, all violations that ended */
+   guint        violations;
 }
+SloState;
 
 /*
- * See GstBusSyncHandler documentation
- *
- * Note: user_data must be valid pointer to CustomData
+ * What a stream did in the last second, see stream_stats_sample()
  */
 
-static GstBusSyncReply tell_window(GstBus * bus, GstMessage * message, CustomData* data)
+typedef struct
 {
-   // ignore anything but 'prepare-window-handle' element messages
-   if (!gst_is_video_overlay_prepare_window_handle_message(message))
-   {
-      return GST_BUS_PASS;
-   }
-
-   gst_video_overlay_set_window_handle(GST_VIDEO_OVERLAY (GST_MESSAGE_SRC (message)), data->window_handle);
-   gst_message_unref (message);
-   return GST_BUS_DROP;
+   StatsRecord  record;              /* As written to the stats file */
+   guint        held_frames;         /* In the hold time histogram */
+   guint        slo_over;            /* Idem, end-to-end longer than the SLO's latency */
+   guint        slo_over_twice;
 }
+StreamSample;
 
-/* 
- * This function is called when an "application" message is posted on the bus.
- * Here we retrieve the message posted by the tags_cb callback 
+typedef struct _HlsOutput HlsOutput;
+typedef struct _WhepViewer WhepViewer;
+
+static void whep_viewer_free(WhepViewer* viewer);
+static void whep_delete(const gchar* resource);
+
+#define RELAY_PENDING 16             /* Frames in the encoder, see relay_encoder_sink_probe() */
+
+/*
+ * Metadata drawn for one point in time, see metadata_worker()
  */
 
-static void application_cb(GstBus *bus, GstMessage *msg, CustomData *data) 
+typedef struct
 {
-	if (g_strcmp0 (gst_structure_get_name (gst_message_get_structure (msg)), "tags-changed") == 0) 
-	{
-		/* removed */
-	}
+   GstClockTime pts;
+   GstVideoOverlayComposition* composition;    /* NULL when there's nothing to show */
+}
+MetadataOverlay;
+
+static void metadata_overlay_free(MetadataOverlay* overlay)
+{
+   if (overlay->composition)
+   {
+      gst_video_overlay_composition_unref(overlay->composition);
+   }
+   g_free(overlay);
 }
 
 /*
- * QOS message sent on the bus. For now we don't do much, just print.
- *
- * But it's a starting point for more specific handling...
+ * Everything that belongs to one camera. Each camera has its own pipeline,
+ * bus and video window
  */
 
-static void qos_cb(GstBus *bus, GstMessage *msg, CustomData *data) 
+typedef struct _StreamData
 {
-   guint64 running_time;
-   guint64 stream_time;
-   guint64 timestamp;
-   guint64 duration;
-   gboolean live;
+   CustomData*  app;
+   guint        index;
+   gchar*       prefix;              /* Element name prefix, "input1-" etc. */
+   gchar*       url;
+   gchar*       host;                /* Camera host, for --max-host-handshakes */
 
-   GstFormat format;
-   guint64 processed;
-   guint64 dropped;
+   GstElement*  pipeline;
+   GstElement*  built_pipeline;      /* Handed from the build thread to stream_built_idle() */
+   GstAllocator* frame_allocator;    /* HugePageAllocator for decoded frames, or NULL */
+   GtkWidget*   video_window;
+   guintptr     window_handle;
+   gboolean     is_live;
+   GstState     state;               /* Current state of the pipeline */
+   GstClockTime last_pts;
+   GstClockTime first_pts;           /* Of the first frame shown, for the replay report */
 
-   gint64 jitter;
-   gdouble proportion;
-   gint quality;
+   GList*       ops;                 /* Pending StreamOp's, see stream_op_start() */
+   gint         frame_wanted;        /* Atomic, set when handoff_cb must post "frame-ready" */
+   gint         packet_wanted;       /* Atomic, set when depay_sink_probe must post "packet-ready" */
 
-   gst_message_parse_qos(msg, &live, &running_time, &stream_time, &timestamp, &duration);
-   gst_message_parse_qos_stats (msg, &format, &processed, &dropped);
-   gst_message_parse_qos_values (msg, &jitter, &proportion, &quality);
+   gboolean     handshaking;         /* Holds a handshake slot, see startup_schedule() */
+   gint64       built_time;          /* Monotonic times of the startup steps */
+   gint64       handshake_time;
+   gint64       packet_time;
 
-   g_print(
-         "QOS! running_time: %" GST_TIME_FORMAT ", stream_time: %" GST_TIME_FORMAT 
+   StreamStats  stats;
+   GMutex       lock;                /* Protects the element list and the timeshift below */
+   GPtrArray*   jitterbuffers;       /* The rtpjitterbuffers rtpbin created */
+   TimeShift    timeshift;
+   GstElement*  selector;            /* With --timeshift, switches the decoder input */
+   GstElement*  replay;              /* Idem, appsrc that replays from the timeshift */
+   GstPad*      live_pad;            /* The selector's pads */
+   GstPad*      replay_pad;
+   gint         flush_pending;       /* Atomic, see stream_request_flush() */
+   gint         mem_capped;          /* Atomic, over --mem-cap, see stream_check_memory() */
+   SkewEstimator skew;
+   gdouble      skew_ppm;            /* Main loop only, see latency_control() */
+   guint        skew_reports;
+   gdouble      ts_offset;           /* ns, of the jitterbuffers */
+   gint64       latency_start;
+   GstClockTimeDiff latency_baseline;
+   gboolean     latency_baseline_valid;
+   gdouble      catchup_speed;       /* Playing at 1 +- this, see latency_control() */
+   gssize       catchup_frames_last; /* For the frame rate */
+   guint        catchup_reports;
+   guint64      decoder_qos_dropped; /* Last dropped count of the decoder's QoS messages */
+   gboolean     wait_keyframe;       /* Only used on the depayloader's streaming thread */
+   gboolean     local_flush;         /* Idem, flush is not to go beyond the decoder */
+   gboolean     intra_refresh;       /* Idem, seen a recovery point SEI, see refresh_track() */
+   gint         refresh_avc;         /* Idem, depayloader output is length prefixed, -1 = don't know yet */
+   gboolean     refresh_broken;      /* Idem, waiting for an IDR frame or recovery point */
+   guint        refresh_frames;      /* Idem, until the cycle is complete */
+   gboolean     refresh_pending;     /* Idem, decoded frames before refresh_show_pts are incomplete */
+   gboolean     refresh_hide;        /* Idem, and are dropped */
+   GstClockTime refresh_show_pts;
+   gint64       refresh_loss_time;   /* Idem, of the loss being recovered from, or 0 */
+   ConcealPolicy concealment;
+   gssize       loss_last_events;    /* Main loop, at the previous stream_report_loss() */
+   gssize       loss_last_corrupted;
+
+   FILE*        capture_file;        /* With --capture */
+   GThreadPool* capture_writer;      /* Idem, one thread writing the records, see capture_write() */
+   GMutex       capture_lock;        /* RTP and RTCP arrive on different threads */
+   GstClockTime capture_start;
+   gint         capture_stopped;     /* Atomic, after a failed write or when the disk can't keep up */
+   CaptureReplay* capture_replay;    /* When the URL is a capture file */
+
+   GstElement*  audio_sink;          /* When the camera sends audio */
+   GstClockTime audio_last_pts;      /* Last audio that reached the sink */
+
+   GstElement*  overlay;             /* overlaycomposition, unless --no-metadata */
+   GByteArray*  metadata_doc;        /* XML being assembled, metadata streaming thread only */
+   GstClockTime metadata_pts;
+   GMutex       metadata_lock;       /* Protects the list of overlays */
+   GQueue       metadata_overlays;   /* MetadataOverlay's, by pts */
+   gint         video_width;         /* Atomic, for the worker */
+   gint         video_height;
+
+   GMutex       cpu_lock;            /* Protects the CPU accounting */
+   GPtrArray*   cpu_threads;         /* CpuThread's of the streaming threads */
+   guint64      cpu_gone[CPU_ROLES]; /* CPU time of the threads that left */
+   guint64      cpu_last[CPU_ROLES]; /* Totals at the previous stream_report_cpu() */
+   gdouble      cpu_percent;         /* Idem, all roles together */
+   gdouble      cpu_decode_percent;  /* Idem, decoding only */
+
+   gchar*       main_url;            /* The camera's main stream, url may be the sub-stream */
+   StreamTier   tier;
+   gint         governor_level;      /* Atomic, GovernorLevel */
+   gdouble      governor_cost[GOVERNOR_LEVELS]; /* CPU use seen at each level when leaving it */
+   guint        governor_frames;     /* Decoded frames, streaming thread only */
+   gboolean     governor_substream;  /* Applied: url is the sub-stream */
+   gboolean     governor_paused;     /* Applied: pipeline paused */
+   gboolean     governor_switching;
+   guint        qos_events;          /* Since the previous governor_step() */
+
+   HlsOutput*   hls;                 /* With --hls-port */
+   GstElement*  tee;                 /* Atomic, after the depayloader for LL-HLS and WebRTC */
+   GList*       whep_viewers;        /* WhepViewer's, protected by lock */
+   GstElement*  whep_source;         /* webrtcbin of a whep:// URL */
+   gint         whep_negotiating;    /* Atomic */
+   GThread*     whep_thread;         /* See whep_ingest_thread(), joined by stream_free() */
+   GstElement*  whep_offerer;        /* Idem, the webrtcbin it negotiates for, with a ref */
+   gchar*       whep_resource;       /* Session at the sender, protected by lock */
+
+   GstElement*  srt_source;          /* srtsrc of an srt:// URL */
+   GstElement*  srt_demux;
+   gboolean     srt_adaptive;        /* Latency derived from the RTT, not in the URL */
+   gdouble      srt_rtt;             /* ms, main loop only */
+   gint64       srt_adapt_time;      /* Last reconnect for another latency */
+
+   GstElement*  relay_encoder;       /* With --relay-port */
+   GstElement*  relay_src;           /* The RTSP media's appsrc while there are viewers, protected by relay_lock */
+   GMutex       relay_lock;          /* Protects relay_src and the encoder statistics */
+   gint64       relay_pending[RELAY_PENDING]; /* Times frames entered the encoder */
+   guint        relay_pending_head;
+   guint        relay_pending_count;
+   gint64       relay_latency_sum;   /* Since the previous relay_report() */
+   gint64       relay_latency_max;
+   gint64       relay_bytes;
+   guint        relay_frames;
+
+   gssize       stats_last_bytes;    /* At the previous stats_file_write() */
+   gssize       stats_last_frames;
+   gssize       stats_last_dropped;
+   gssize       stats_last_corrupted;
+   gssize       stats_last_flushes;
+   gssize       stats_last_lost;
+   SloState     slo;
+
+   StreamSample panel_sample;        /* The last second's, main loop only, see panel_update() */
+   GstClockTime video_latency;       /* Of the video path, see latency_cb() */
+   gssize       panel_last_frames;   /* At the previous panel_update() */
+   gssize       panel_last_dropped;
+   gssize       panel_last_bytes;
+}
+StreamData;
+
+struct _CustomData 
+{
+  GPtrArray*   streams;             /* StreamData, one per camera */
+  GCancellable* cancellable;        /* Cancels all pending stream operations on exit */
+  gint64       start_time;          /* Monotonic time at which the streams were started */
+  guint        streams_started;     /* Number of streams that have shown their first frame */
+  GThreadPool* build_pool;          /* Runs create_pipeline(), see startup_start() */
+  guint        streams_built;
+  GQueue       connect_queue;       /* Built streams waiting for a handshake slot */
+  guint        handshakes;          /* Handshakes in progress */
+  GHashTable*  host_handshakes;     /* Idem per host, host -> count */
+  GThreadPool* metadata_pool;       /* Parses and draws the metadata, see metadata_worker() */
+  gint64       cpu_sample_time;     /* For stream_report_cpu() */
+  gdouble      cpu_process_last;
+  gdouble      cpu_unattributed_last;
+  gint64       governor_hold;       /* No governor steps before this time */
+  GSocketService* hls_service;      /* With --hls-port, see hls_serve() */
+  GSocketService* whep_service;     /* With --whep-port, see whep_serve() */
+  GstRTSPServer* relay_server;      /* With --relay-port, see relay_start() */
+  StatsFileHeader* stats_file;      /* With --stats-file, the mapping, see stats_file_open() */
+  gsize        stats_file_size;
+  int          slo_socket;          /* With --slo-socket, see slo_start() */
+  gint64       panel_time;          /* Of the previous panel_update() */
+  GMutex       http_lock;
+  GCond        http_idle;
+  guint        http_connections;    /* Being served, protected by http_lock */
+  gsize        base_rss;            /* RSS before any pipeline was created */
+  gsize        rss_sum;             /* For --bench-rss */
+  guint        rss_samples;
+
+  GtkWidget*   slider;              /* Slider widget to keep track of current position */
+  GtkWidget*   streams_list;        /* Text widget to display info about the streams */
+  gulong       slider_update_signal_id; /* Signal ID for the slider update signal */
+
+  gint64       duration;                /* Duration of the clip, in nanoseconds */
+};
+
+/*
+ * LL-HLS output of a stream, see hls_new_sample_cb(). Filled on the muxer's
+ * streaming thread, read by the HTTP threads
+ */
+
+#define HLS_SEGMENTS 4                  /* Complete segments in the playlist */
+#define HLS_INPUT_RING 64
+
+typedef struct
+{
+   GBytes*      data;
+   gdouble      duration;
+   gboolean     independent;            /* Starts with a keyframe */
+}
+HlsPart;
+
+typedef struct
+{
+   guint        msn;                    /* Media sequence number */
+   GPtrArray*   parts;                  /* HlsPart's */
+   gdouble      duration;
+   gboolean     complete;
+}
+HlsSegment;
+
+struct _HlsOutput
+{
+   GMutex       lock;
+   GCond        cond;                   /* Broadcast for every new part */
+   GBytes*      init;                   /* Initialization segment (moov) */
+   GQueue       segments;               /* HlsSegment's, oldest first, the last one may be in progress */
+   guint        next_msn;
+   gboolean     stopped;
+   gdouble      max_duration;           /* Longest segment, for EXT-X-TARGETDURATION */
+
+   GstClockTime input_pts[HLS_INPUT_RING];    /* When frames went into the muxer, for the publish latency */
+   gint64       input_time[HLS_INPUT_RING];
+   guint        input_head;
+   gint64       latency_sum;            /* Publish latency since the previous hls_report() */
+   gint64       latency_max;
+   guint        latency_count;
+   guint        requests;
+};
+
+static void hls_part_free(HlsPart* part)
+{
+   g_bytes_unref(part->data);
+   g_free(part);
+}
+
+static void hls_segment_free(HlsSegment* segment)
+{
+   g_ptr_array_unref(segment->parts);
+   g_free(segment);
+}
+
+static HlsOutput* hls_output_new(void)
+{
+   HlsOutput* hls = g_new0(HlsOutput, 1);
+
+   g_mutex_init(&hls->lock);
+   g_cond_init(&hls->cond);
+   return hls;
+}
+
+static void hls_output_free(HlsOutput* hls)
+{
+   g_queue_clear_full(&hls->segments, (GDestroyNotify)hls_segment_free);
+   if (hls->init)
+   {
+      g_bytes_unref(hls->init);
+   }
+   g_cond_clear(&hls->cond);
+   g_mutex_clear(&hls->lock);
+   g_free(hls);
+}
+
+static StreamTier stream_tier_from_options(guint index)
+{
+   gchar** tiers = g_strsplit(opt_tiers ? opt_tiers : "", ",", -1);
+   StreamTier tier = TIER_VISIBLE;
+
+   if (index < g_strv_length(tiers))
+   {
+      if (strcmp(tiers[index], "focused") == 0)
+      {
+         tier = TIER_FOCUSED;
+      }
+      else if (strcmp(tiers[index], "background") == 0)
+      {
+         tier = TIER_BACKGROUND;
+      }
+   }
+   g_strfreev(tiers);
+   return tier;
+}
+
+static ConcealPolicy stream_concealment_from_options(guint index)
+{
+   gchar** policies = g_strsplit(opt_concealment ? opt_concealment : "", ",", -1);
+   ConcealPolicy policy = CONCEAL_AUTO;
+
+   for (guint i = 0; index < g_strv_length(policies) && i < G_N_ELEMENTS(conceal_policy_names); i++)
+   {
+      if (strcmp(policies[index], conceal_policy_names[i]) == 0)
+      {
+         policy = i;
+      }
+   }
+   g_strfreev(policies);
+   return policy;
+}
+
+/*
+ * See slo_evaluate()
+ */
+
+static void stream_slo_from_options(StreamData* stream)
+{
+   gchar** specs = g_strsplit(opt_slo ? opt_slo : "", ",", -1);
+   gchar** fields;
+   SloState* slo = &stream->slo;
+
+   if (stream->index < g_strv_length(specs) && specs[stream->index][0] && strcmp(specs[stream->index], "none") != 0)
+   {
+      fields = g_strsplit(specs[stream->index], ":", -1);
+      if (g_strv_length(fields) >= 2 && fields[0][0] == 'p')
+      {
+         slo->quantile = g_ascii_strtod(fields[0] + 1, NULL) / 100;
+         slo->latency = atoi(fields[1]);
+         slo->window = fields[2] ? atoi(fields[2]) : 10;
+         slo->max_drops = fields[2] && fields[3] ? g_ascii_strtod(fields[3], NULL) : 0;
+      }
+      if (slo->quantile <= 0 || slo->quantile >= 1 || slo->latency == 0 || slo->latency >= HOLD_BUCKETS ||
+          slo->window == 0 || slo->window > SLO_MAX_WINDOW || slo->max_drops < 0)
+      {
+         g_printerr("%sInvalid SLO '%s', expected e.g. p99:200:10:1 (latency below %dms, window up to %us)\n", stream->prefix,
+               specs[stream->index], HOLD_BUCKETS, SLO_MAX_WINDOW);
+         memset(slo, 0, sizeof(*slo));
+      }
+      g_strfreev(fields);
+   }
+   g_strfreev(specs);
+}
+
+static StreamData* stream_new(CustomData* app, guint index, const gchar* url)
+{
+   StreamData* stream = g_new0(StreamData, 1);
+   GstUri* uri;
+
+   stream->app = app;
+   stream->index = index;
+   stream->prefix = g_strdup_printf("input%u-", index + 1);
+   stream->first_pts = GST_CLOCK_TIME_NONE;
+   stream->audio_last_pts = GST_CLOCK_TIME_NONE;
+   stream->refresh_avc = -1;
+   stream->refresh_broken = TRUE;
+   stream->refresh_hide = TRUE;
+   stream->refresh_show_pts = GST_CLOCK_TIME_NONE;
+   stream->video_latency = GST_CLOCK_TIME_NONE;
+   g_mutex_init(&stream->metadata_lock);
+   g_mutex_init(&stream->cpu_lock);
+   g_mutex_init(&stream->relay_lock);
+   g_mutex_init(&stream->skew.lock);
+   stream->cpu_threads = g_ptr_array_new_with_free_func(g_free);
+   stream->capture_start = GST_CLOCK_TIME_NONE;
+   g_mutex_init(&stream->capture_lock);
+   stream->url = g_strdup(url);
+   stream->main_url = g_strdup(url);
+   stream->tier = stream_tier_from_options(index);
+   stream->concealment = stream_concealment_from_options(index);
+   stream_slo_from_options(stream);
+   if (opt_hls_port > 0)
+   {
+      stream->hls = hls_output_new();
+   }
+   uri = gst_uri_from_string(url);
+   stream->host = g_strdup(uri && gst_uri_get_host(uri) ? gst_uri_get_host(uri) : url);
+   if (uri)
+   {
+      gst_uri_unref(uri);
+   }
+   g_mutex_init(&stream->lock);
+   stream->jitterbuffers = g_ptr_array_new_with_free_func(gst_object_unref);
+   return stream;
+}
+
+/*
+ * Look up one of the elements that create_pipeline made for this stream, by
+ * its name without prefix. Returns a new reference or NULL
+ */
+
+static GstElement* stream_get_element(StreamData* stream, const gchar* name)
+{
+   gchar* full_name = g_strconcat(stream->prefix, name, NULL);
+   GstElement* element = gst_bin_get_by_name(GST_BIN(stream->pipeline), full_name);
+
+   g_free(full_name);
+   return element;
+}
+
+/*
+ * Asynchronous stream operations
+ *
+ * Connect, wait-for-first-frame, switch camera and snapshot follow the GIO
+ * async pattern: stream_xxx_async() starts the operation and the callback
+ * calls stream_finish() for the result. Pending operations are kept in a list
+ * on the stream and completed from the bus handlers (state_changed_cb,
+ * application_cb, error_cb), so everything happens on the main loop and many
+ * cameras can be handled concurrently without blocking the UI.
+ *
+ * Every operation takes a timeout in ms (0 is no timeout) and an optional
+ * GCancellable
+ */
+
+typedef enum
+{
+   STREAM_OP_CONNECT,     /* Completes when the pipeline reaches PLAYING */
+   STREAM_OP_FRAME,       /* Completes when the next decoded frame passes identity */
+   STREAM_OP_PACKET,      /* Completes when the next RTP packet reaches the depayloader */
+}
+StreamOpKind;
+
+typedef struct _StreamOp
+{
+   StreamData*  stream;
+   StreamOpKind kind;
+   GTask*       task;
+   guint        timeout_id;
+   gulong       cancelled_id;
+}
+StreamOp;
+
+static void stream_op_free(StreamOp* op)
+{
+   if (op->timeout_id)
+   {
+      g_source_remove(op->timeout_id);
+   }
+   if (op->cancelled_id)
+   {
+      g_cancellable_disconnect(g_task_get_cancellable(op->task), op->cancelled_id);
+   }
+   g_object_unref(op->task);
+   g_free(op);
+}
+
+/*
+ * Remove the operation from its stream and complete the task. With error
+ * NULL the operation succeeded
+ */
+
+static void stream_op_return(StreamOp* op, const GError* error)
+{
+   op->stream->ops = g_list_remove(op->stream->ops, op);
+   if (error)
+   {
+      g_task_return_error(op->task, g_error_copy(error));
+   }
+   else
+   {
+      g_task_return_boolean(op->task, TRUE);
+   }
+   stream_op_free(op);
+}
+
+/*
+ * Complete all pending operations of a kind
+ */
+
+static void stream_ops_return(StreamData* stream, StreamOpKind kind, const GError* error)
+{
+   GList* ops = NULL;
+
+   for (GList* l = stream->ops; l; l = l->next)
+   {
+      if (((StreamOp*)l->data)->kind == kind)
+      {
+         ops = g_list_prepend(ops, l->data);
+      }
+   }
+   ops = g_list_reverse(ops);
+   for (GList* l = ops; l; l = l->next)
+   {
+      stream_op_return(l->data, error);
+   }
+   g_list_free(ops);
+}
+
+static gboolean stream_op_timeout_cb(StreamOp* op)
+{
+   GError* error = g_error_new(G_IO_ERROR, G_IO_ERROR_TIMED_OUT, "%s: operation timed out", op->stream->prefix);
+
+   op->timeout_id = 0;
+   stream_op_return(op, error);
+   g_error_free(error);
+   return G_SOURCE_REMOVE;
+}
+
+/*
+ * The cancellable may be cancelled from any thread, so the actual completion
+ * is deferred to the main loop. The operation may have completed in between,
+ * hence the lookup
+ */
+
+static gboolean stream_op_cancelled_idle(GTask* task)
+{
+   StreamData* stream = g_task_get_task_data(task);
+
+   for (GList* l = stream->ops; l; l = l->next)
+   {
+      StreamOp* op = l->data;
+      if (op->task == task)
+      {
+         GError* error = NULL;
+         g_cancellable_set_error_if_cancelled(g_task_get_cancellable(task), &error);
+         stream_op_return(op, error);
+         g_clear_error(&error);
+         break;
+      }
+   }
+   return G_SOURCE_REMOVE;
+}
+
+static void stream_op_cancelled_cb(GCancellable* cancellable, GTask* task)
+{
+   g_idle_add_full(G_PRIORITY_DEFAULT, (GSourceFunc)stream_op_cancelled_idle, g_object_ref(task), g_object_unref);
+}
+
+/*
+ * Register a pending operation. Takes ownership of task
+ */
+
+static void stream_op_start(StreamData* stream, StreamOpKind kind, GTask* task, guint timeout_ms)
+{
+   StreamOp* op = g_new0(StreamOp, 1);
+   GCancellable* cancellable = g_task_get_cancellable(task);
+
+   op->stream = stream;
+   op->kind = kind;
+   op->task = task;
+   g_task_set_task_data(task, stream, NULL);
+   stream->ops = g_list_append(stream->ops, op);
+
+   if (timeout_ms > 0)
+   {
+      op->timeout_id = g_timeout_add(timeout_ms, (GSourceFunc)stream_op_timeout_cb, op);
+   }
+   if (cancellable)
+   {
+      op->cancelled_id = g_cancellable_connect(cancellable, G_CALLBACK(stream_op_cancelled_cb), g_object_ref(task), g_object_unref);
+   }
+}
+
+/*
+ * Finish any of the stream_xxx_async() operations below
+ */
+
+static gboolean stream_finish(GAsyncResult* result, GError** error)
+{
+   g_return_val_if_fail(g_task_is_valid(result, NULL), FALSE);
+   return g_task_propagate_boolean(G_TASK(result), error);
+}
+
+/*
+ * Bring the pipeline to PLAYING. For rtspsrc this includes the RTSP
+ * handshake with the camera
+ */
+
+static void stream_connect_async(StreamData* stream, guint timeout_ms, GCancellable* cancellable, GAsyncReadyCallback callback, gpointer user_data)
+{
+   GTask* task = g_task_new(NULL, cancellable, callback, user_data);
+
+   g_task_set_source_tag(task, stream_connect_async);
+   if (stream->state == GST_STATE_PLAYING)
+   {
+      g_task_return_boolean(task, TRUE);
+      g_object_unref(task);
+      return;
+   }
+
+   stream_op_start(stream, STREAM_OP_CONNECT, task, timeout_ms);
+   switch (gst_element_set_state(stream->pipeline, GST_STATE_PLAYING))
+   {
+   case GST_STATE_CHANGE_FAILURE:
+      {
+         GError* error = g_error_new(GST_CORE_ERROR, GST_CORE_ERROR_STATE_CHANGE, "%s: unable to set the pipeline to the playing state", stream->prefix);
+         stream_ops_return(stream, STREAM_OP_CONNECT, error);
+         g_error_free(error);
+         break;
+      }
+   case GST_STATE_CHANGE_NO_PREROLL:
+      /* Got this from basic-tutorial-12 but it doesn't seem to work */
+      stream->is_live = TRUE;
+      break;
+   default:
+      break;
+   }
+}
+
+/*
+ * Wait for the next decoded frame. Right after connect or switch that is the
+ * first frame of the camera
+ */
+
+static void stream_first_frame_async(StreamData* stream, guint timeout_ms, GCancellable* cancellable, GAsyncReadyCallback callback, gpointer user_data)
+{
+   GTask* task = g_task_new(NULL, cancellable, callback, user_data);
+
+   g_task_set_source_tag(task, stream_first_frame_async);
+   stream_op_start(stream, STREAM_OP_FRAME, task, timeout_ms);
+   g_atomic_int_set(&stream->frame_wanted, 1);
+}
+
+/*
+ * Wait for the next RTP packet. Right after connect that tells the RTSP
+ * handshake is over, long before the pipeline reaches PLAYING with the first
+ * keyframe
+ */
+
+static void stream_first_packet_async(StreamData* stream, guint timeout_ms, GCancellable* cancellable, GAsyncReadyCallback callback, gpointer user_data)
+{
+   GTask* task = g_task_new(NULL, cancellable, callback, user_data);
+
+   g_task_set_source_tag(task, stream_first_packet_async);
+   stream_op_start(stream, STREAM_OP_PACKET, task, timeout_ms);
+   g_atomic_int_set(&stream->packet_wanted, 1);
+}
+
+/*
+ * Runs on a GStreamer thread, because taking down the RTSP session blocks.
+ * Going through NULL also flushes the bus, so no "frame-ready" of the old
+ * camera can complete the operation
+ */
+
+static void stream_switch_func(GstElement* pipeline, StreamData* stream)
+{
+   GstElement* source = stream_get_element(stream, "source");
+
+   gst_element_set_state(pipeline, GST_STATE_NULL);
+   g_object_set(G_OBJECT(source), "location", stream->url, NULL);
+   gst_object_unref(source);
+   g_atomic_int_set(&stream->frame_wanted, 1);
+   if (gst_element_set_state(pipeline, GST_STATE_PLAYING) == GST_STATE_CHANGE_FAILURE)
+   {
+      GST_ELEMENT_ERROR(pipeline, CORE, STATE_CHANGE, ("Failed to restart after switching camera"), (NULL));
+   }
+}
+
+/*
+ * Point the stream at another camera. Completes when the first frame of the
+ * new camera is decoded
+ */
+
+static void stream_switch_async(StreamData* stream, const gchar* url, guint timeout_ms, GCancellable* cancellable, GAsyncReadyCallback callback, gpointer user_data)
+{
+   GTask* task = g_task_new(NULL, cancellable, callback, user_data);
+
+   g_task_set_source_tag(task, stream_switch_async);
+   g_free(stream->url);
+   stream->url = g_strdup(url);
+   stream_op_start(stream, STREAM_OP_FRAME, task, timeout_ms);
+   gst_element_call_async(stream->pipeline, (GstElementCallAsyncFunc)stream_switch_func, stream, NULL);
+}
+
+typedef struct
+{
+   StreamData*  stream;
+   gchar*       filename;
+   GstSample*   sample;
+}
+SnapshotData;
+
+static void snapshot_data_free(SnapshotData* snapshot)
+{
+   if (snapshot->sample)
+   {
+      gst_sample_unref(snapshot->sample);
+   }
+   g_free(snapshot->filename);
+   g_free(snapshot);
+}
+
+/*
+ * PNG conversion and writing are done on a worker thread
+ */
+
+static void stream_snapshot_thread(GTask* task, gpointer source_object, SnapshotData* snapshot, GCancellable* cancellable)
+{
+   GError* error = NULL;
+   GstCaps* caps = gst_caps_new_empty_simple("image/png");
+   GstSample* png = gst_video_convert_sample(snapshot->sample, caps, 5 * GST_SECOND, &error);
+
+   gst_caps_unref(caps);
+   if (png)
+   {
+      GstBuffer* buffer = gst_sample_get_buffer(png);
+      GstMapInfo map;
+
+      if (gst_buffer_map(buffer, &map, GST_MAP_READ))
+      {
+         g_file_set_contents(snapshot->filename, (const gchar*)map.data, map.size, &error);
+         gst_buffer_unmap(buffer, &map);
+      }
+      gst_sample_unref(png);
+   }
+
+   if (error)
+   {
+      g_task_return_error(task, error);
+   }
+   else
+   {
+      g_task_return_boolean(task, TRUE);
+   }
+}
+
+static void stream_snapshot_frame_cb(GObject* source, GAsyncResult* result, GTask* task)
+{
+   SnapshotData* snapshot = g_task_get_task_data(task);
+   GstElement* sink;
+   GError* error = NULL;
+
+   if (!stream_finish(result, &error))
+   {
+      g_task_return_error(task, error);
+      g_object_unref(task);
+      return;
+   }
+
+   sink = stream_get_element(snapshot->stream, "sink");
+   g_object_get(G_OBJECT(sink), "last-sample", &snapshot->sample, NULL);
+   gst_object_unref(sink);
+   if (!snapshot->sample)
+   {
+      g_task_return_new_error(task, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "%s: no frame rendered", snapshot->stream->prefix);
+   }
+   else
+   {
+      g_task_run_in_thread(task, (GTaskThreadFunc)stream_snapshot_thread);
+   }
+   g_object_unref(task);
+}
+
+/*
+ * Save the next frame the sink renders as PNG
+ */
+
+static void stream_snapshot_async(StreamData* stream, const gchar* filename, guint timeout_ms, GCancellable* cancellable, GAsyncReadyCallback callback, gpointer user_data)
+{
+   GTask* task = g_task_new(NULL, cancellable, callback, user_data);
+   SnapshotData* snapshot = g_new0(SnapshotData, 1);
+
+   g_task_set_source_tag(task, stream_snapshot_async);
+   snapshot->stream = stream;
+   snapshot->filename = g_strdup(filename);
+   g_task_set_task_data(task, snapshot, (GDestroyNotify)snapshot_data_free);
+   stream_first_frame_async(stream, timeout_ms, cancellable, (GAsyncReadyCallback)stream_snapshot_frame_cb, task);
+}
+
+/*
+ * Stops the pipeline and whatever feeds it, after which none of the stream's
+ * threads run anymore. Again from stream_free() is fine
+ */
+
+static void stream_stop(StreamData* stream)
+{
+   if (stream->capture_replay)
+   {
+      g_mutex_lock(&stream->capture_replay->lock);
+      stream->capture_replay->stop = TRUE;
+      g_cond_signal(&stream->capture_replay->cond);
+      g_mutex_unlock(&stream->capture_replay->lock);
+   }
+   if (stream->whep_thread)
+   {
+      /* Still POSTing the offer maybe, webrtcbin must be alive to finish */
+      g_cancellable_cancel(stream->app->cancellable);
+      g_thread_join(stream->whep_thread);
+      gst_object_unref(stream->whep_offerer);
+      stream->whep_thread = NULL;
+   }
+   if (stream->pipeline)
+   {
+      gst_element_set_state(stream->pipeline, GST_STATE_NULL);
+   }
+}
+
+static void stream_free(StreamData* stream)
+{
+   GError* error = g_error_new_literal(G_IO_ERROR, G_IO_ERROR_CANCELLED, "Stream closed");
+
+   stream_ops_return(stream, STREAM_OP_CONNECT, error);
+   stream_ops_return(stream, STREAM_OP_FRAME, error);
+   stream_ops_return(stream, STREAM_OP_PACKET, error);
+   g_error_free(error);
+   stream_stop(stream);
+   if (stream->pipeline)
+   {
+      gst_object_unref(stream->pipeline);
+   }
+   if (stream->capture_replay)
+   {
+      /* Going to NULL unblocked its push */
+      if (stream->capture_replay->thread)
+      {
+         g_thread_join(stream->capture_replay->thread);
+      }
+      if (stream->capture_replay->file)
+      {
+         g_mapped_file_unref(stream->capture_replay->file);
+      }
+      g_mutex_clear(&stream->capture_replay->lock);
+      g_cond_clear(&stream->capture_replay->cond);
+      g_free(stream->capture_replay);
+   }
+   if (stream->capture_writer)
+   {
+      /* Writes what was queued */
+      g_thread_pool_free(stream->capture_writer, FALSE, TRUE);
+   }
+   if (stream->capture_file && fclose(stream->capture_file) != 0 && !stream->capture_stopped)
+   {
+      g_printerr("%s: capture incomplete, %s\n", stream->prefix, g_strerror(errno));
+   }
+   g_mutex_clear(&stream->capture_lock);
+   if (stream->metadata_doc)
+   {
+      g_byte_array_unref(stream->metadata_doc);
+   }
+   g_queue_clear_full(&stream->metadata_overlays, (GDestroyNotify)metadata_overlay_free);
+   g_mutex_clear(&stream->metadata_lock);
+   g_ptr_array_unref(stream->cpu_threads);
+   g_mutex_clear(&stream->cpu_lock);
+   g_clear_object(&stream->relay_src);
+   g_mutex_clear(&stream->relay_lock);
+   g_mutex_clear(&stream->skew.lock);
+   if (stream->built_pipeline)
+   {
+      gst_object_unref(stream->built_pipeline);
+   }
+   if (stream->frame_allocator)
+   {
+      gst_object_unref(stream->frame_allocator);
+   }
+   g_ptr_array_free(stream->jitterbuffers, TRUE);
+   timeshift_clear(&stream->timeshift);
+   if (stream->live_pad)
+   {
+      gst_object_unref(stream->live_pad);
+      gst_object_unref(stream->replay_pad);
+   }
+   g_list_free_full(stream->whep_viewers, (GDestroyNotify)whep_viewer_free);
+   if (stream->whep_resource)
+   {
+      whep_delete(stream->whep_resource);
+      g_free(stream->whep_resource);
+   }
+   g_mutex_clear(&stream->lock);
+   g_free(stream->prefix);
+   g_free(stream->url);
+   g_free(stream->main_url);
+   if (stream->hls)
+   {
+      hls_output_free(stream->hls);
+   }
+   g_free(stream->host);
+   g_free(stream);
+}
+
+/*
+ * Allocator for decoded frames
+ *
+ * A 5MP I420 frame is ~7.5MB. With the default allocator each new buffer is
+ * fresh anonymous memory, so the decoder takes ~1900 page faults on its first
+ * write to it, and pools that get resized after a caps change munmap and mmap
+ * it all again. This allocator hands out memory that is:
+ *
+ *   - backed by hugepages: reserved ones (MAP_HUGETLB, needs vm.nr_hugepages)
+ *     when asked for, transparent ones (MADV_HUGEPAGE) otherwise
+ *   - prefaulted, and optionally mlocked, when the block is created
+ *   - kept in a cache when freed, so it is reused instead of unmapped
+ *
+ * Blocks for the expected resolution are created at pipeline creation
+ * (huge_page_allocator_prealloc), so the first frames don't fault either
+ */
+
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+typedef struct
+{
+   gpointer     data;
+   gsize        length;
+}
+HugePageBlock;
+
+typedef struct
+{
+   GstMemory      mem;
+   HugePageBlock* block;
+}
+HugePageMemory;
+
+typedef struct
+{
+   GstAllocator parent;
+
+   GMutex       lock;
+   GSList*      cache;              /* Free HugePageBlock's, protected by lock */
+   gboolean     explicit_pages;
+   gboolean     lock_pages;
+   gssize       mapped_bytes;       /* Atomic, total size of all blocks */
+}
+HugePageAllocator;
+
+typedef struct
+{
+   GstAllocatorClass parent_class;
+}
+HugePageAllocatorClass;
+
+G_DEFINE_TYPE(HugePageAllocator, huge_page_allocator, GST_TYPE_ALLOCATOR);
+
+static HugePageBlock* huge_page_block_new(HugePageAllocator* self, gsize size)
+{
+   gsize length = GST_ROUND_UP_N(size, HUGE_PAGE_SIZE);
+   guint8* data = MAP_FAILED;
+   HugePageBlock* block;
+
+   if (self->explicit_pages)
+   {
+      data = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+      if (data == MAP_FAILED)
+      {
+         g_warning("No reserved hugepages available, falling back to transparent hugepages");
+         self->explicit_pages = FALSE;
+      }
+   }
+   if (data == MAP_FAILED)
+   {
+      /* Transparent hugepages are only used for aligned 2MB ranges, so map
+       * one extra and trim the unaligned head and tail */
+      guint8* raw = mmap(NULL, length + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      gsize head;
+
+      if (raw == MAP_FAILED)
+      {
+         return NULL;
+      }
+      data = (guint8*)GST_ROUND_UP_N((guintptr)raw, HUGE_PAGE_SIZE);
+      head = data - raw;
+      if (head)
+      {
+         munmap(raw, head);
+      }
+      munmap(data + length, HUGE_PAGE_SIZE - head);
+      madvise(data, length, MADV_HUGEPAGE);
+   }
+
+   /* Prefault, one write per (small) page is enough */
+   for (gsize offs = 0; offs < length; offs += 4096)
+   {
+      ((volatile guint8*)data)[offs] = 0;
+   }
+   if (self->lock_pages && mlock(data, length) != 0)
+   {
+      g_warning("mlock of %zu bytes failed, check RLIMIT_MEMLOCK", length);
+      self->lock_pages = FALSE;
+   }
+
+   block = g_new0(HugePageBlock, 1);
+   block->data = data;
+   block->length = length;
+   g_atomic_pointer_add(&self->mapped_bytes, length);
+   return block;
+}
+
+static void huge_page_block_free(HugePageAllocator* self, HugePageBlock* block)
+{
+   g_atomic_pointer_add(&self->mapped_bytes, -(gssize)block->length);
+   munmap(block->data, block->length);
+   g_free(block);
+}
+
+/*
+ * Take the smallest cached block that fits. On a miss the frames got bigger
+ * (caps change), so smaller blocks are of no use anymore and get unmapped
+ */
+
+static HugePageBlock* huge_page_block_get(HugePageAllocator* self, gsize size)
+{
+   HugePageBlock* block = NULL;
+   GSList* best = NULL;
+   GSList* unused = NULL;
+
+   g_mutex_lock(&self->lock);
+   for (GSList* l = self->cache; l; l = l->next)
+   {
+      HugePageBlock* candidate = l->data;
+      if (candidate->length >= size && (!best || candidate->length < ((HugePageBlock*)best->data)->length))
+      {
+         best = l;
+      }
+   }
+   if (best)
+   {
+      block = best->data;
+      self->cache = g_slist_delete_link(self->cache, best);
+   }
+   else
+   {
+      unused = self->cache;
+      self->cache = NULL;
+   }
+   g_mutex_unlock(&self->lock);
+
+   for (GSList* l = unused; l; l = l->next)
+   {
+      huge_page_block_free(self, l->data);
+   }
+   g_slist_free(unused);
+   return block ? block : huge_page_block_new(self, size);
+}
+
+static void huge_page_block_put(HugePageAllocator* self, HugePageBlock* block)
+{
+   g_mutex_lock(&self->lock);
+   self->cache = g_slist_prepend(self->cache, block);
+   g_mutex_unlock(&self->lock);
+}
+
+static GstMemory* huge_page_allocator_alloc(GstAllocator* allocator, gsize size, GstAllocationParams* params)
+{
+   HugePageAllocator* self = (HugePageAllocator*)allocator;
+   gsize maxsize = size + params->prefix + params->padding;
+   HugePageBlock* block;
+   HugePageMemory* mem;
+
+   /* mmap gives page alignment, more is never asked for video */
+   g_return_val_if_fail(params->align < 4096, NULL);
+   block = huge_page_block_get(self, maxsize);
+   if (!block)
+   {
+      return NULL;
+   }
+
+   mem = g_new0(HugePageMemory, 1);
+   gst_memory_init(GST_MEMORY_CAST(mem), params->flags, allocator, NULL, block->length, params->align, params->prefix, size);
+   mem->block = block;
+   if ((params->flags & GST_MEMORY_FLAG_ZERO_PREFIXED) && params->prefix)
+   {
+      memset(block->data, 0, params->prefix);
+   }
+   if ((params->flags & GST_MEMORY_FLAG_ZERO_PADDED) && params->padding)
+   {
+      memset((guint8*)block->data + params->prefix + size, 0, params->padding);
+   }
+   return GST_MEMORY_CAST(mem);
+}
+
+static void huge_page_allocator_free(GstAllocator* allocator, GstMemory* memory)
+{
+   HugePageMemory* mem = (HugePageMemory*)memory;
+
+   /* Shared sub-memories don't own the block */
+   if (!memory->parent)
+   {
+      huge_page_block_put((HugePageAllocator*)allocator, mem->block);
+   }
+   g_free(mem);
+}
+
+static gpointer huge_page_mem_map(HugePageMemory* mem, gsize maxsize, GstMapFlags flags)
+{
+   return mem->block->data;
+}
+
+static void huge_page_mem_unmap(HugePageMemory* mem)
+{
+}
+
+static HugePageMemory* huge_page_mem_share(HugePageMemory* mem, gssize offset, gssize size)
+{
+   GstMemory* parent = mem->mem.parent ? mem->mem.parent : GST_MEMORY_CAST(mem);
+   HugePageMemory* sub;
+
+   if (size == -1)
+   {
+      size = mem->mem.size - offset;
+   }
+   sub = g_new0(HugePageMemory, 1);
+   gst_memory_init(GST_MEMORY_CAST(sub), GST_MINI_OBJECT_FLAGS(parent) | GST_MINI_OBJECT_FLAG_LOCK_READONLY,
+         mem->mem.allocator, parent, mem->mem.maxsize, mem->mem.align, mem->mem.offset + offset, size);
+   sub->block = mem->block;
+   return sub;
+}
+
+static void huge_page_allocator_finalize(GObject* object)
+{
+   HugePageAllocator* self = (HugePageAllocator*)object;
+
+   for (GSList* l = self->cache; l; l = l->next)
+   {
+      huge_page_block_free(self, l->data);
+   }
+   g_slist_free(self->cache);
+   g_mutex_clear(&self->lock);
+   G_OBJECT_CLASS(huge_page_allocator_parent_class)->finalize(object);
+}
+
+static void huge_page_allocator_class_init(HugePageAllocatorClass* klass)
+{
+   GstAllocatorClass* allocator_class = GST_ALLOCATOR_CLASS(klass);
+
+   allocator_class->alloc = huge_page_allocator_alloc;
+   allocator_class->free = huge_page_allocator_free;
+   G_OBJECT_CLASS(klass)->finalize = huge_page_allocator_finalize;
+}
+
+static void huge_page_allocator_init(HugePageAllocator* self)
+{
+   GstAllocator* allocator = GST_ALLOCATOR_CAST(self);
+
+   allocator->mem_type = "HugePageMemory";
+   allocator->mem_map = (GstMemoryMapFunction)huge_page_mem_map;
+   allocator->mem_unmap = (GstMemoryUnmapFunction)huge_page_mem_unmap;
+   allocator->mem_share = (GstMemoryShareFunction)huge_page_mem_share;
+   g_mutex_init(&self->lock);
+}
+
+static GstAllocator* huge_page_allocator_new(gboolean explicit_pages, gboolean lock_pages)
+{
+   HugePageAllocator* self = g_object_new(huge_page_allocator_get_type(), NULL);
+
+   /* Not floating, the stream holds the only reference */
+   gst_object_ref_sink(self);
+   self->explicit_pages = explicit_pages;
+   self->lock_pages = lock_pages;
+   return GST_ALLOCATOR_CAST(self);
+}
+
+/*
+ * Create and fault in count blocks of size bytes up front
+ */
+
+static void huge_page_allocator_prealloc(GstAllocator* allocator, gsize size, guint count)
+{
+   HugePageAllocator* self = (HugePageAllocator*)allocator;
+
+   for (guint i = 0; i < count; i++)
+   {
+      HugePageBlock* block = huge_page_block_new(self, size);
+      if (!block)
+      {
+         break;
+      }
+      huge_page_block_put(self, block);
+   }
+}
+
+/*
+ * Gives the cached blocks back, when the decoder doesn't use the allocator
+ */
+
+static void huge_page_allocator_trim(GstAllocator* allocator)
+{
+   HugePageAllocator* self = (HugePageAllocator*)allocator;
+   GSList* unused;
+
+   g_mutex_lock(&self->lock);
+   unused = self->cache;
+   self->cache = NULL;
+   g_mutex_unlock(&self->lock);
+   for (GSList* l = unused; l; l = l->next)
+   {
+      huge_page_block_free(self, l->data);
+   }
+   g_slist_free(unused);
+}
+
+/*
+ * True when the pool downstream proposed is its own kind of memory (an
+ * XvImage, GL, DMABuf) rather than plain system memory
+ */
+
+static gboolean pool_is_special(GstBufferPool* pool)
+{
+   GstStructure* config;
+   GstAllocator* allocator = NULL;
+   gboolean special;
+
+   if (!pool)
+   {
+      return FALSE;
+   }
+   special = G_OBJECT_TYPE(pool) != GST_TYPE_BUFFER_POOL && G_OBJECT_TYPE(pool) != GST_TYPE_VIDEO_BUFFER_POOL;
+   config = gst_buffer_pool_get_config(pool);
+   if (gst_buffer_pool_config_get_allocator(config, &allocator, NULL) && allocator && allocator->mem_type &&
+       strcmp(allocator->mem_type, GST_ALLOCATOR_SYSMEM) != 0)
+   {
+      special = TRUE;
+   }
+   gst_structure_free(config);
+   return special;
+}
+
+/*
+ * Offer the decoder a pool on the hugepage allocator. This runs after
+ * downstream (identity, sink) answered the allocation query, so the minimum
+ * number of buffers the sink asked for is kept; the decoder adds what it
+ * needs for its reference frames, and no maximum is set, so the pool never
+ * shrinks and gives memory back just to map it again
+ *
+ * When the sink proposed a pool of its own memory, like xvimagesink's
+ * XvImages, that pool stays: replacing it would make the sink copy every
+ * frame. It only gets a minimum of --prealloc-frames buffers, which the pool
+ * allocates, and so faults in, when it is activated rather than on the
+ * first frames, and the hugepage blocks preallocated for the decoder are
+ * given back
+ */
+
+static GstPadProbeReturn decoder_allocation_probe(GstPad* pad, GstPadProbeInfo* info, StreamData* stream)
+{
+   GstQuery* query = GST_PAD_PROBE_INFO_QUERY(info);
+   GstAllocationParams params;
+   GstBufferPool* pool;
+   GstStructure* config;
+   GstVideoInfo vinfo;
+   GstCaps* caps;
+   gboolean need_pool;
+   guint size = 0, min = 0, max = 0;
+
+   if (GST_QUERY_TYPE(query) != GST_QUERY_ALLOCATION)
+   {
+      return GST_PAD_PROBE_OK;
+   }
+   gst_query_parse_allocation(query, &caps, &need_pool);
+   if (!caps || !gst_video_info_from_caps(&vinfo, caps))
+   {
+      return GST_PAD_PROBE_OK;
+   }
+   if (gst_query_get_n_allocation_pools(query) > 0)
+   {
+      GstBufferPool* proposed = NULL;
+
+      gst_query_parse_nth_allocation_pool(query, 0, &proposed, &size, &min, &max);
+      if (pool_is_special(proposed))
+      {
+         min = MAX(min, (guint)opt_prealloc_frames);
+         if (max != 0)
+         {
+            max = MAX(max, min);
+         }
+         gst_query_set_nth_allocation_pool(query, 0, proposed, size, min, max);
+         g_print("%sDecoding into the sink's %s, min %u buffers\n", stream->prefix, G_OBJECT_TYPE_NAME(proposed), min);
+         huge_page_allocator_trim(stream->frame_allocator);
+         gst_object_unref(proposed);
+         return GST_PAD_PROBE_OK;
+      }
+      if (proposed)
+      {
+         gst_object_unref(proposed);
+      }
+   }
+   size = MAX(size, GST_VIDEO_INFO_SIZE(&vinfo));
+
+   gst_allocation_params_init(&params);
+   pool = gst_video_buffer_pool_new();
+   config = gst_buffer_pool_get_config(pool);
+   gst_buffer_pool_config_set_params(config, caps, size, min, 0);
+   gst_buffer_pool_config_set_allocator(config, stream->frame_allocator, &params);
+   gst_buffer_pool_config_add_option(config, GST_BUFFER_POOL_OPTION_VIDEO_META);
+   gst_buffer_pool_set_config(pool, config);
+
+   if (gst_query_get_n_allocation_pools(query) > 0)
+   {
+      gst_query_set_nth_allocation_pool(query, 0, pool, size, min, 0);
+   }
+   else
+   {
+      gst_query_add_allocation_pool(query, pool, size, min, 0);
+   }
+   if (gst_query_get_n_allocation_params(query) > 0)
+   {
+      gst_query_set_nth_allocation_param(query, 0, stream->frame_allocator, &params);
+   }
+   else
+   {
+      gst_query_add_allocation_param(query, stream->frame_allocator, &params);
+   }
+   gst_object_unref(pool);
+   g_print("%sDecoding into hugepage pool, %u bytes per frame, min %u buffers\n", stream->prefix, size, min);
+   return GST_PAD_PROBE_OK;
+}
+
+/*
+ * Memory accounting
+ *
+ * What each stage of a stream holds is derived from pad probes:
+ *
+ *   - jitterbuffer: packets in minus packets pushed out or dropped by it,
+ *     times the average packet size
+ *   - depayloader: the access unit it is assembling
+ *   - queues: their current level
+ *   - decoder: the encoded frames it holds (frame threads, reordering) plus
+ *     its output pool
+ *   - sink: the frame being rendered and the one kept as last-sample
+ *
+ * With --jitterbuffer-cap and --mem-cap the stream is not allowed to grow.
+ * Packets beyond the jitterbuffer cap are dropped on arrival and the
+ * jitterbuffer is switched to drop-on-latency. In both cases the stream is
+ * flushed to live: the decoder throws away what it holds and everything up to
+ * the next keyframe is dropped, see depay_src_probe
+ */
+
+typedef struct
+{
+   gsize        jitterbuffer;
+   gsize        depay;
+   gsize        queues;
+   gsize        decoder;
+   gsize        sink;
+   gsize        total;
+   gsize        backlog;             /* What grows when the stream falls behind, for --mem-cap */
+   gsize        timeshift;           /* Not in total, it's meant to be kept */
+}
+StreamMemory;
+
+/*
+ * Can be called from any thread
+ */
+
+static void stream_request_flush(StreamData* stream, const gchar* reason)
+{
+   if (g_atomic_int_compare_and_exchange(&stream->flush_pending, 0, 1))
+   {
+      g_print("%sFlushing to live: %s\n", stream->prefix, reason);
+   }
+}
+
+static gboolean add_queue_level(const GValue* item, gsize* bytes)
+{
+   GstElement* element = g_value_get_object(item);
+   GstElementFactory* factory = gst_element_get_factory(element);
+
+   if (factory && g_strcmp0(GST_OBJECT_NAME(factory), "queue") == 0)
+   {
+      guint level = 0;
+      g_object_get(G_OBJECT(element), "current-level-bytes", &level, NULL);
+      *bytes += level;
+   }
+   return TRUE;
+}
+
+static void stream_get_memory(StreamData* stream, StreamMemory* mem)
+{
+   StreamStats* stats = &stream->stats;
+   gssize packets, gone_packets = 0, held_packets, held_frames;
+   GstElement* decoder;
+   GstIterator* it;
+
+   memset(mem, 0, sizeof(*mem));
+
+   /* Let the jitterbuffers tell what they dropped themselves */
+   g_mutex_lock(&stream->lock);
+   for (guint i = 0; i < stream->jitterbuffers->len; i++)
+   {
+      GstStructure* jb_stats = NULL;
+      guint64 late = 0, duplicates = 0;
+
+      g_object_get(G_OBJECT(g_ptr_array_index(stream->jitterbuffers, i)), "stats", &jb_stats, NULL);
+      if (jb_stats)
+      {
+         gst_structure_get_uint64(jb_stats, "num-late", &late);
+         gst_structure_get_uint64(jb_stats, "num-duplicates", &duplicates);
+         gst_structure_free(jb_stats);
+      }
+      gone_packets += late + duplicates;
+   }
+   g_mutex_unlock(&stream->lock);
+   stat_set(&stats->jitterbuffer_gone_packets, gone_packets);
+
+   packets = stat_get(&stats->jitterbuffer_in_packets);
+   held_packets = packets - stat_get(&stats->jitterbuffer_out_packets) - stat_get(&stats->jitterbuffer_gone_packets);
+   if (packets > 0 && held_packets > 0)
+   {
+      mem->jitterbuffer = held_packets * (stat_get(&stats->jitterbuffer_in_bytes) / packets);
+   }
+
+   mem->depay = stat_get(&stats->depay_bytes);
+
+   it = gst_bin_iterate_recurse(GST_BIN(stream->pipeline));
+   gst_iterator_foreach(it, (GstIteratorForeachFunction)add_queue_level, &mem->queues);
+   gst_iterator_free(it);
+
+   held_frames = stat_get(&stats->decoder_in_frames) - stat_get(&stats->decoder_out_frames) - stat_get(&stats->decoder_gone_frames);
+   if (held_frames > 0)
+   {
+      mem->decoder = held_frames * (stat_get(&stats->decoder_in_bytes) / stat_get(&stats->decoder_in_frames));
+   }
+   /* Not the frame pool, that doesn't shrink when the stream catches up */
+   mem->backlog = mem->jitterbuffer + mem->depay + mem->queues + mem->decoder;
+   if (stream->frame_allocator)
+   {
+      mem->decoder += g_atomic_pointer_get(&((HugePageAllocator*)stream->frame_allocator)->mapped_bytes);
+   }
+   else if ((decoder = stream_get_element(stream, "decoder")) != NULL)
+   {
+      GstBufferPool* pool = gst_video_decoder_get_buffer_pool(GST_VIDEO_DECODER(decoder));
+      if (pool)
+      {
+         GstStructure* config = gst_buffer_pool_get_config(pool);
+         guint size = 0, min = 0, max = 0;
+
+         gst_buffer_pool_config_get_params(config, NULL, &size, &min, &max);
+         mem->decoder += (gsize)size * min;
+         gst_structure_free(config);
+         gst_object_unref(pool);
+      }
+      gst_object_unref(decoder);
+   }
+
+   mem->sink = 2 * stat_get(&stats->frame_bytes);
+   mem->total = mem->jitterbuffer + mem->depay + mem->queues + mem->decoder + mem->sink;
+
+   g_mutex_lock(&stream->lock);
+   mem->timeshift = stream->timeshift.bytes;
+   g_mutex_unlock(&stream->lock);
+}
+
+static gboolean set_queue_leaky(const GValue* item, gpointer unused)
+{
+   GstElement* element = g_value_get_object(item);
+   GstElementFactory* factory = gst_element_get_factory(element);
+
+   if (factory && g_strcmp0(GST_OBJECT_NAME(factory), "queue") == 0)
+   {
+      gst_util_set_object_arg(G_OBJECT(element), "leaky", "downstream");
+   }
+   return TRUE;
+}
+
+/*
+ * Print the memory use and cap the backlog at --mem-cap. Called every second.
+ *
+ * Like --jitterbuffer-cap, the cap works where the backlog grows: above it
+ * the jitterbuffers drop incoming packets (jitterbuffer_sink_probe) and from
+ * then on keep no more than their latency, queues drop their oldest buffers
+ * instead of growing, and the decoder is flushed once. Below three quarters
+ * of the cap packets are let through again
+ */
+
+static void stream_check_memory(StreamData* stream)
+{
+   StreamMemory mem;
+   gsize cap = (gsize)opt_mem_cap * 1024;
+   gboolean capped = FALSE;
+
+   stream_get_memory(stream, &mem);
+   if (opt_mem_cap > 0 && mem.backlog > cap && !g_atomic_int_get(&stream->mem_capped))
+   {
+      GstIterator* it;
+
+      g_mutex_lock(&stream->lock);
+      for (guint i = 0; i < stream->jitterbuffers->len; i++)
+      {
+         g_object_set(G_OBJECT(g_ptr_array_index(stream->jitterbuffers, i)), "drop-on-latency", TRUE, NULL);
+      }
+      g_mutex_unlock(&stream->lock);
+      it = gst_bin_iterate_recurse(GST_BIN(stream->pipeline));
+      gst_iterator_foreach(it, (GstIteratorForeachFunction)set_queue_leaky, NULL);
+      gst_iterator_free(it);
+      g_atomic_int_set(&stream->mem_capped, 1);
+      stream_request_flush(stream, "memory cap exceeded");
+      capped = TRUE;
+   }
+   else if (mem.backlog < cap / 4 * 3 && g_atomic_int_get(&stream->mem_capped))
+   {
+      g_atomic_int_set(&stream->mem_capped, 0);
+   }
+   if (opt_verbose || capped)
+   {
+      g_print("%sMemory: jitterbuffer %zukB, depay %zukB, queues %zukB, decoder %zukB, sink %zukB, total %zukB, timeshift %zukB, flushes %zi\n",
+            stream->prefix, mem.jitterbuffer / 1024, mem.depay / 1024, mem.queues / 1024, mem.decoder / 1024, mem.sink / 1024, mem.total / 1024,
+            mem.timeshift / 1024, stat_get(&stream->stats.flushes));
+   }
+}
+
+/*
+ * CPU accounting
+ *
+ * Streaming threads announce themselves with a stream-status message, posted
+ * from the thread itself. tell_window() catches it there, so the thread can
+ * be named after its stream and role ("in3-recv", visible in top -H) and
+ * registered with the stream. The role follows from the element owning it:
+ * sources receive, sinks render (the audio ring buffer), anything else (the
+ * jitterbuffers) depayloads.
+ *
+ * There are no queues, so the jitterbuffer's thread also runs the decoder and
+ * the video sink. Its time is split by the stages it passes: the probes on
+ * the depayloader and decoder and the identity's handoff charge the CPU time
+ * since the previous stage to that stage. Whatever the jitterbuffer does
+ * between two packets ends up with the render stage that preceded it.
+ *
+ * libav's slice threads don't post stream-status. Their time, with the UI's,
+ * is what's left of the process total: "unattributed"
+ */
+
+static GPrivate cpu_current_thread;       /* The CpuThread of the calling thread, if any */
+
+static guint64 cpu_clock_ns(clockid_t clock)
+{
+   struct timespec ts;
+
+   clock_gettime(clock, &ts);
+   return ts.tv_sec * G_GUINT64_CONSTANT(1000000000) + ts.tv_nsec;
+}
+
+static gdouble process_cpu_seconds(void)
+{
+   struct rusage usage;
+
+   getrusage(RUSAGE_SELF, &usage);
+   return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+/*
+ * Adds the thread's time per role to totals. With the stream's cpu_lock held,
+ * which also keeps the thread from leaving
+ */
+
+static void cpu_thread_add_locked(CpuThread* thread, guint64 now, guint64* totals)
+{
+   guint64 left = now - thread->enter_ns;
+
+   for (guint i = 0; i < CPU_ROLES; i++)
+   {
+      totals[i] += thread->staged[i];
+      left -= thread->staged[i];
+   }
+   totals[thread->stage] += left;
+}
+
+static void cpu_thread_enter(StreamData* stream, GstElement* owner)
+{
+   CpuThread* thread = g_new0(CpuThread, 1);
+   gchar name[16];
+
+   if (GST_OBJECT_FLAG_IS_SET(owner, GST_ELEMENT_FLAG_SINK))
+   {
+      thread->role = CPU_RENDER;
+   }
+   else if (GST_OBJECT_FLAG_IS_SET(owner, GST_ELEMENT_FLAG_SOURCE) && owner != stream->replay)
+   {
+      thread->role = CPU_RECEIVE;
+   }
+   else
+   {
+      thread->role = CPU_DEPAY;
+   }
+   thread->stream = stream;
+   thread->stage = thread->role;
+   pthread_getcpuclockid(pthread_self(), &thread->clock);
+   thread->enter_ns = thread->stage_ns = cpu_clock_ns(CLOCK_THREAD_CPUTIME_ID);
+
+   g_snprintf(name, sizeof(name), "in%u-%s", stream->index + 1, cpu_role_thread_names[thread->role]);
+   pthread_setname_np(pthread_self(), name);
+
+   g_mutex_lock(&stream->cpu_lock);
+   g_ptr_array_add(stream->cpu_threads, thread);
+   g_mutex_unlock(&stream->cpu_lock);
+   g_private_set(&cpu_current_thread, thread);
+}
+
+static void cpu_thread_leave(StreamData* stream)
+{
+   CpuThread* thread = g_private_get(&cpu_current_thread);
+
+   if (!thread || thread->stream != stream)
+   {
+      return;
+   }
+   g_private_set(&cpu_current_thread, NULL);
+   g_mutex_lock(&stream->cpu_lock);
+   cpu_thread_add_locked(thread, cpu_clock_ns(CLOCK_THREAD_CPUTIME_ID), stream->cpu_gone);
+   g_ptr_array_remove_fast(stream->cpu_threads, thread);
+   g_mutex_unlock(&stream->cpu_lock);
+}
+
+/*
+ * On a streaming thread: it now works for the given stage
+ */
+
+static void cpu_stage(StreamData* stream, CpuRole stage)
+{
+   CpuThread* thread = g_private_get(&cpu_current_thread);
+   guint64 now;
+
+   if (!thread || thread->stream != stream || thread->stage == stage)
+   {
+      return;
+   }
+   now = cpu_clock_ns(CLOCK_THREAD_CPUTIME_ID);
+   g_mutex_lock(&stream->cpu_lock);
+   thread->staged[thread->stage] += now - thread->stage_ns;
+   thread->stage = stage;
+   thread->stage_ns = now;
+   g_mutex_unlock(&stream->cpu_lock);
+}
+
+/*
+ * Prints the CPU use per role since the previous call, in % of one core.
+ * Returns the stream's total in seconds
+ */
+
+static gdouble stream_report_cpu(StreamData* stream, gdouble interval)
+{
+   guint64 totals[CPU_ROLES];
+   gdouble percent[CPU_ROLES], sum = 0;
+
+   g_mutex_lock(&stream->cpu_lock);
+   memcpy(totals, stream->cpu_gone, sizeof(totals));
+   for (guint i = 0; i < stream->cpu_threads->len; i++)
+   {
+      CpuThread* thread = g_ptr_array_index(stream->cpu_threads, i);
+      cpu_thread_add_locked(thread, cpu_clock_ns(thread->clock), totals);
+   }
+   g_mutex_unlock(&stream->cpu_lock);
+
+   for (guint i = 0; i < CPU_ROLES; i++)
+   {
+      percent[i] = interval > 0 ? (totals[i] - stream->cpu_last[i]) / 1e7 / interval : 0;
+      stream->cpu_last[i] = totals[i];
+      sum += totals[i] / 1e9;
+   }
+   stream->cpu_percent = percent[CPU_RECEIVE] + percent[CPU_DEPAY] + percent[CPU_DECODE] + percent[CPU_RENDER] + percent[CPU_ENCODE];
+   stream->cpu_decode_percent = percent[CPU_DECODE];
+   if (opt_verbose)
+   {
+      g_print("%sCPU: %s %.1f%%, %s %.1f%%, %s %.1f%%, %s %.1f%%, %s %.1f%%\n", stream->prefix,
+            cpu_role_names[CPU_RECEIVE], percent[CPU_RECEIVE], cpu_role_names[CPU_DEPAY], percent[CPU_DEPAY],
+            cpu_role_names[CPU_DECODE], percent[CPU_DECODE], cpu_role_names[CPU_RENDER], percent[CPU_RENDER],
+            cpu_role_names[CPU_ENCODE], percent[CPU_ENCODE]);
+   }
+   return sum;
+}
+
+/*
+ * CPU budget governor
+ *
+ * Once a second, with the CPU figures, governor_step() looks at the process
+ * total and at the QoS messages. Over --cpu-budget, or when a focused or
+ * visible stream lost frames, it steps one stream a level down: the most
+ * expensive one of the lowest tier that still can. Background streams go all
+ * the way to paused, visible ones no further than the sub-stream (keyframes
+ * without --substream), the focused stream is never touched. With room again
+ * the highest tier comes back first, one level at a time, and only when what
+ * it used at that level before still fits. After each step the governor
+ * waits for the figures to settle
+ */
+
+#define GOVERNOR_SETTLE (3 * G_USEC_PER_SEC)
+#define GOVERNOR_HEADROOM 0.9
+
+static GovernorLevel governor_max_level(StreamData* stream)
+{
+   switch (stream->tier)
+   {
+   case TIER_FOCUSED:
+      return GOVERNOR_FULL;
+   case TIER_VISIBLE:
+      return opt_substream ? GOVERNOR_SUBSTREAM : GOVERNOR_KEYFRAMES;
+   default:
+      return GOVERNOR_PAUSED;
+   }
+}
+
+static GovernorLevel governor_next_level(GovernorLevel level, gint step)
+{
+   level += step;
+   if (level == GOVERNOR_SUBSTREAM && !opt_substream)
+   {
+      level += step;
+   }
+   return level;
+}
+
+static void governor_apply(StreamData* stream);
+
+static void governor_switch_cb(GObject* source, GAsyncResult* result, StreamData* stream)
+{
+   GError* error = NULL;
+
+   if (!stream_finish(result, &error))
+   {
+      g_printerr("%sGovernor: switch failed: %s\n", stream->prefix, error->message);
+      g_error_free(error);
+   }
+   stream->governor_switching = FALSE;
+   /* The level may have changed meanwhile */
+   governor_apply(stream);
+}
+
+/*
+ * Reduced fps and keyframes only are done by the probes (decoder_src_probe,
+ * depay_src_probe), the sub-stream and pausing here
+ */
+
+static void governor_apply(StreamData* stream)
+{
+   GovernorLevel level = g_atomic_int_get(&stream->governor_level);
+   gboolean substream = level >= GOVERNOR_SUBSTREAM, paused = level == GOVERNOR_PAUSED;
+
+   if (stream->governor_switching || !stream->pipeline)
+   {
+      return;
+   }
+   if (substream != stream->governor_substream)
+   {
+      gchar* url = substream ? g_strconcat(stream->main_url, strchr(stream->main_url, '?') ? "&" : "?", opt_substream, NULL) : g_strdup(stream->main_url);
+
+      stream->governor_substream = substream;
+      stream->governor_switching = TRUE;
+      stream_switch_async(stream, url, opt_timeout * 1000, stream->app->cancellable, (GAsyncReadyCallback)governor_switch_cb, stream);
+      g_free(url);
+      return;
+   }
+   if (paused != stream->governor_paused)
+   {
+      /* For rtspsrc an RTSP PAUSE, the camera stops sending */
+      stream->governor_paused = paused;
+      gst_element_set_state(stream->pipeline, paused ? GST_STATE_PAUSED : GST_STATE_PLAYING);
+   }
+}
+
+static void governor_set_level(StreamData* stream, GovernorLevel level, gdouble process_percent)
+{
+   g_print("%sGovernor: %s -> %s (process %.0f%% of %d%%)\n", stream->prefix,
+         governor_level_names[stream->governor_level], governor_level_names[level], process_percent, opt_cpu_budget);
+   g_atomic_int_set(&stream->governor_level, level);
+   governor_apply(stream);
+}
+
+static void governor_step(CustomData* app, gdouble process_percent)
+{
+   gint64 now = g_get_monotonic_time();
+   gboolean losing = FALSE;
+   StreamData* down = NULL;
+   StreamData* up = NULL;
+
+   for (guint i = 0; i < app->streams->len; i++)
+   {
+      StreamData* stream = g_ptr_array_index(app->streams, i);
+
+      if (stream->tier != TIER_BACKGROUND && stream->qos_events > 0)
+      {
+         losing = TRUE;
+      }
+      stream->qos_events = 0;
+   }
+   if (now < app->governor_hold)
+   {
+      return;
+   }
+
+   if (process_percent > opt_cpu_budget || losing)
+   {
+      for (guint i = 0; i < app->streams->len; i++)
+      {
+         StreamData* stream = g_ptr_array_index(app->streams, i);
+
+         if (stream->governor_level < governor_max_level(stream) &&
+             (!down || stream->tier > down->tier || (stream->tier == down->tier && stream->cpu_percent > down->cpu_percent)))
+         {
+            down = stream;
+         }
+      }
+      if (down)
+      {
+         down->governor_cost[down->governor_level] = down->cpu_percent;
+         governor_set_level(down, governor_next_level(down->governor_level, 1), process_percent);
+         app->governor_hold = now + GOVERNOR_SETTLE;
+      }
+      return;
+   }
+
+   for (guint i = 0; i < app->streams->len; i++)
+   {
+      StreamData* stream = g_ptr_array_index(app->streams, i);
+
+      if (stream->governor_level > GOVERNOR_FULL &&
+          (!up || stream->tier < up->tier || (stream->tier == up->tier && stream->governor_level > up->governor_level)))
+      {
+         up = stream;
+      }
+   }
+   if (up)
+   {
+      GovernorLevel level = governor_next_level(up->governor_level, -1);
+
+      if (process_percent + up->governor_cost[level] - up->cpu_percent < opt_cpu_budget * GOVERNOR_HEADROOM)
+      {
+         governor_set_level(up, level, process_percent);
+         /* Coming back is less urgent than backing off */
+         app->governor_hold = now + 2 * GOVERNOR_SETTLE;
+      }
+   }
+}
+
+/*
+ * Clock skew and the latency controller
+ *
+ * The jitterbuffer's video pad feeds skew_add(): the RTP timestamp of the
+ * last packet of each frame against its arrival, the DTS udpsrc stamped it
+ * with when it came from the socket. Per second only the sample with the
+ * least network delay is kept, and a linear regression over the last
+ * SKEW_WINDOW of those gives the camera's clock rate relative to ours. The
+ * difference is the drift in ppm: at +100 ppm the camera's timestamps, and
+ * so the time we hold its frames, gain 360ms per hour.
+ *
+ * The jitterbuffer's src pad tells how long frames are held: their PTS
+ * against their arrival. latency_control() takes the lowest of each second,
+ * the first seconds set the baseline. It moves the jitterbuffers' ts-offset
+ * against the estimated drift every second, microseconds at a time, so the
+ * hold time doesn't change. When it changed anyway (another camera clock
+ * step, the network) it is brought back by playing slightly faster or
+ * slower, and only by more than --latency-resync the ts-offset jumps back
+ * to the baseline
+ */
+
+#define SKEW_MIN_SAMPLES 20          /* Before the estimate is used */
+#define SKEW_MIN_PPM 2.0             /* Smaller drift is left alone */
+#define SKEW_REPORT_INTERVAL 10      /* Seconds */
+#define LATENCY_SETTLE 5             /* Seconds before the baseline is taken */
+
+/*
+ * A new jitterbuffer: start over
+ */
+
+static void skew_restart(StreamData* stream)
+{
+   SkewEstimator* skew = &stream->skew;
+
+   g_mutex_lock(&skew->lock);
+   skew->jitterbuffer = NULL;
+   skew->started = skew->bucket_valid = skew->hold_valid = FALSE;
+   skew->head = skew->count = 0;
+   skew->restarted = TRUE;
+   g_mutex_unlock(&skew->lock);
+}
+
+static void skew_add_sample_locked(SkewEstimator* skew, GstClockTime arrival, guint64 rtp)
+{
+   gdouble x, y;
+   gint64 second;
+
+   if (!skew->started)
+   {
+      skew->origin_arrival = arrival;
+      skew->origin_rtp = rtp;
+      skew->started = TRUE;
+   }
+   x = (gdouble)GST_CLOCK_DIFF(skew->origin_arrival, arrival) / GST_SECOND;
+   y = (gdouble)((gint64)(rtp - skew->origin_rtp)) / skew->clock_rate;
+   second = (gint64)x;
+
+   if (skew->bucket_valid && second != skew->bucket)
+   {
+      guint i = (skew->head + skew->count) % SKEW_WINDOW;
+
+      skew->x[i] = skew->bucket_x;
+      skew->y[i] = skew->bucket_y;
+      if (skew->count < SKEW_WINDOW)
+      {
+         skew->count++;
+      }
+      else
+      {
+         skew->head = (skew->head + 1) % SKEW_WINDOW;
+      }
+      skew->bucket_valid = FALSE;
+   }
+   /* Lowest delay: arrival the least behind the sender's time */
+   if (!skew->bucket_valid || x - y < skew->bucket_x - skew->bucket_y)
+   {
+      skew->bucket = second;
+      skew->bucket_x = x;
+      skew->bucket_y = y;
+      skew->bucket_valid = TRUE;
+   }
+}
+
+/*
+ * Sender seconds per receiver second, minus one, in ppm. FALSE while there
+ * are too few samples
+ */
+
+static gboolean skew_estimate_locked(SkewEstimator* skew, gdouble* ppm)
+{
+   gdouble mean_x = 0, mean_y = 0, sxx = 0, sxy = 0;
+
+   if (skew->count < SKEW_MIN_SAMPLES)
+   {
+      return FALSE;
+   }
+   for (guint i = 0; i < skew->count; i++)
+   {
+      mean_x += skew->x[(skew->head + i) % SKEW_WINDOW];
+      mean_y += skew->y[(skew->head + i) % SKEW_WINDOW];
+   }
+   mean_x /= skew->count;
+   mean_y /= skew->count;
+   for (guint i = 0; i < skew->count; i++)
+   {
+      gdouble dx = skew->x[(skew->head + i) % SKEW_WINDOW] - mean_x;
+
+      sxx += dx * dx;
+      sxy += dx * (skew->y[(skew->head + i) % SKEW_WINDOW] - mean_y);
+   }
+   if (sxx <= 0)
+   {
+      return FALSE;
+   }
+   *ppm = (sxy / sxx - 1) * 1e6;
+   return TRUE;
+}
+
+/*
+ * On the jitterbuffer's sink pad: which one is the video's, and its frames'
+ * arrivals
+ */
+
+static void skew_add(StreamData* stream, GstPad* pad, GstBuffer* buffer)
+{
+   SkewEstimator* skew = &stream->skew;
+   GstElement* jitterbuffer = GST_PAD_PARENT(pad);
+   GstRTPBuffer rtp = GST_RTP_BUFFER_INIT;
+   guint32 timestamp;
+   gboolean marker;
+
+   if (skew->jitterbuffer != jitterbuffer)
+   {
+      GstCaps* caps;
+      GstStructure* s;
+
+      if (skew->jitterbuffer || (caps = gst_pad_get_current_caps(pad)) == NULL)
+      {
+         return;
+      }
+      s = gst_caps_get_structure(caps, 0);
+      if (g_strcmp0(gst_structure_get_string(s, "media"), "video") == 0 && gst_structure_get_int(s, "clock-rate", &skew->clock_rate) && skew->clock_rate > 0)
+      {
+         skew->jitterbuffer = jitterbuffer;
+      }
+      gst_caps_unref(caps);
+      if (skew->jitterbuffer != jitterbuffer)
+      {
+         return;
+      }
+   }
+   if (!GST_BUFFER_DTS_IS_VALID(buffer) || !gst_rtp_buffer_map(buffer, GST_MAP_READ, &rtp))
+   {
+      return;
+   }
+   timestamp = gst_rtp_buffer_get_timestamp(&rtp);
+   marker = gst_rtp_buffer_get_marker(&rtp);
+   gst_rtp_buffer_unmap(&rtp);
+   if (!marker)
+   {
+      return;
+   }
+
+   g_mutex_lock(&skew->lock);
+   skew->ext_rtp = skew->started ? skew->ext_rtp + (gint32)(timestamp - skew->last_rtp) : timestamp;
+   skew->last_rtp = timestamp;
+   skew_add_sample_locked(skew, GST_BUFFER_DTS(buffer), skew->ext_rtp);
+   skew->arrival_rtp[skew->arrival_next] = timestamp;
+   skew->arrival[skew->arrival_next] = GST_BUFFER_DTS(buffer);
+   skew->arrival_next = (skew->arrival_next + 1) % SKEW_ARRIVALS;
+   g_mutex_unlock(&skew->lock);
+}
+
+/*
+ * On the jitterbuffer's src pad: how long the frame is held, PTS against
+ * arrival
+ */
+
+static void skew_add_hold(StreamData* stream, GstPad* pad, GstBuffer* buffer)
+{
+   SkewEstimator* skew = &stream->skew;
+   GstRTPBuffer rtp = GST_RTP_BUFFER_INIT;
+   guint32 timestamp;
+   gboolean marker;
+
+   if (skew->jitterbuffer != GST_PAD_PARENT(pad) || !GST_BUFFER_PTS_IS_VALID(buffer) || !gst_rtp_buffer_map(buffer, GST_MAP_READ, &rtp))
+   {
+      return;
+   }
+   timestamp = gst_rtp_buffer_get_timestamp(&rtp);
+   marker = gst_rtp_buffer_get_marker(&rtp);
+   gst_rtp_buffer_unmap(&rtp);
+   if (!marker)
+   {
+      return;
+   }
+
+   g_mutex_lock(&skew->lock);
+   for (guint i = 0; i < SKEW_ARRIVALS; i++)
+   {
+      if (skew->arrival_rtp[i] == timestamp && GST_CLOCK_TIME_IS_VALID(skew->arrival[i]))
+      {
+         GstClockTimeDiff hold = GST_CLOCK_DIFF(skew->arrival[i], GST_BUFFER_PTS(buffer));
+
+         if (!skew->hold_valid || hold < skew->hold_min)
+         {
+            skew->hold_min = hold;
+            skew->hold_valid = TRUE;
+         }
+         skew->hold_histogram[CLAMP(hold / GST_MSECOND, 0, HOLD_BUCKETS - 1)]++;
+         skew->hold_count++;
+         skew->hold_max = MAX(skew->hold_max, hold);
+         break;
+      }
+   }
+   g_mutex_unlock(&skew->lock);
+}
+
+/*
+ * A limit makes the jitterbuffers apply a change gradually, frame by frame
+ */
+
+static void stream_set_ts_offset(StreamData* stream, gint64 offset, gint64 max_adjustment)
+{
+   g_mutex_lock(&stream->lock);
+   for (guint i = 0; i < stream->jitterbuffers->len; i++)
+   {
+      g_object_set(G_OBJECT(g_ptr_array_index(stream->jitterbuffers, i)), "max-ts-offset-adjustment", max_adjustment, "ts-offset", offset, NULL);
+   }
+   g_mutex_unlock(&stream->lock);
+}
+
+/*
+ * Once a second, from the main loop
+ */
+
+static void latency_control(StreamData* stream, gdouble interval)
+{
+   SkewEstimator* skew = &stream->skew;
+   gint64 now = g_get_monotonic_time();
+   GstClockTimeDiff hold = 0, error;
+   gboolean have_ppm, have_hold, behind;
+   gdouble ppm = 0, fps, step;
+   gssize frames = stat_get(&stream->stats.decoder_out_frames);
+   gint64 max_adjustment = 0;
+
+   g_mutex_lock(&skew->lock);
+   if (skew->restarted)
+   {
+      /* Another session, maybe another camera */
+      skew->restarted = FALSE;
+      stream->latency_start = 0;
+      stream->latency_baseline_valid = FALSE;
+   }
+   have_ppm = skew_estimate_locked(skew, &ppm);
+   have_hold = skew->hold_valid;
+   hold = skew->hold_min;
+   skew->hold_valid = FALSE;
+   g_mutex_unlock(&skew->lock);
+   fps = (frames - stream->catchup_frames_last) / interval;
+   stream->catchup_frames_last = frames;
+   if (!have_hold || interval <= 0)
+   {
+      return;
+   }
+
+   if (!stream->latency_start)
+   {
+      stream->latency_start = now;
+   }
+   if (!stream->latency_baseline_valid)
+   {
+      if (now - stream->latency_start >= LATENCY_SETTLE * G_TIME_SPAN_SECOND)
+      {
+         stream->latency_baseline = hold;
+         stream->latency_baseline_valid = TRUE;
+      }
+      return;
+   }
+
+   /* Feed forward: what the drift adds in the next second, taken off before it shows */
+   if (have_ppm && ABS(ppm) >= SKEW_MIN_PPM)
+   {
+      stream->ts_offset -= ppm * 1e3 * interval;
+   }
+   /* Feedback: what got through anyway. Far off, jump back */
+   error = hold - stream->latency_baseline;
+   if (opt_latency_resync > 0 && ABS(error) > opt_latency_resync * GST_MSECOND)
+   {
+      g_print("%sLatency: hold time %+.0fms off, resync\n", stream->prefix, error / 1e6);
+      stream->ts_offset -= error;
+      stream->catchup_speed = 0;
+      stat_add(&stream->stats.latency_resyncs, 1);
+   }
+   else
+   {
+      /*
+       * Otherwise catch up gently: the ts-offset moves by up to catchup_speed
+       * seconds per second, which is playing at 1 + catchup_speed (or 1 -
+       * catchup_speed when the hold time shrank). The speed ramps up by
+       * --catchup-accel per second and back down near the target
+       */
+      behind = ABS(error) > (stream->catchup_speed > 0 ? opt_catchup_threshold / 2 : opt_catchup_threshold) * GST_MSECOND;
+      if (behind)
+      {
+         stream->catchup_speed = MIN(stream->catchup_speed + opt_catchup_accel * interval, opt_catchup_rate - 1);
+      }
+      else
+      {
+         stream->catchup_speed = MAX(stream->catchup_speed - opt_catchup_accel * interval, 0);
+      }
+      step = MIN(stream->catchup_speed * interval * GST_SECOND, ABS(error));
+      stream->ts_offset -= error > 0 ? step : -step;
+      if (fps > 0)
+      {
+         max_adjustment = MAX((opt_catchup_rate - 1) * GST_SECOND / fps, 1);
+      }
+      if (step > 0 && ++stream->catchup_reports % SKEW_REPORT_INTERVAL == 1)
+      {
+         g_print("%sLatency: hold time %+.0fms off, catching up at %.3fx\n", stream->prefix, error / 1e6, 1 + (error > 0 ? stream->catchup_speed : -stream->catchup_speed));
+      }
+   }
+   stream_set_ts_offset(stream, (gint64)stream->ts_offset, max_adjustment);
+
+   stream->skew_ppm = ppm;
+   if (have_ppm && ++stream->skew_reports % SKEW_REPORT_INTERVAL == 0)
+   {
+      g_print("%sSkew: %+.1f ppm, %+.0fms per hour uncorrected, hold %.0fms (%+.1fms), ts-offset %+.1fms\n", stream->prefix,
+            ppm, ppm * 3.6, hold / 1e6, (hold - stream->latency_baseline) / 1e6, stream->ts_offset / 1e6);
+   }
+}
+
+static GstPadProbeReturn jitterbuffer_sink_probe(GstPad* pad, GstPadProbeInfo* info, StreamData* stream)
+{
+   StreamStats* stats = &stream->stats;
+   GstBuffer* buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+
+   if (g_atomic_int_get(&stream->mem_capped))
+   {
+      stat_add(&stats->cap_dropped_packets, 1);
+      return GST_PAD_PROBE_DROP;
+   }
+   if (opt_jitterbuffer_cap > 0)
+   {
+      gssize packets = stat_get(&stats->jitterbuffer_in_packets);
+      gssize held = packets - stat_get(&stats->jitterbuffer_out_packets) - stat_get(&stats->jitterbuffer_gone_packets);
+
+      if (packets > 0 && held * (stat_get(&stats->jitterbuffer_in_bytes) / packets) > (gssize)opt_jitterbuffer_cap * 1024)
+      {
+         GstElement* jitterbuffer = gst_pad_get_parent_element(pad);
+
+         /* From now on it keeps no more than its latency */
+         g_object_set(G_OBJECT(jitterbuffer), "drop-on-latency", TRUE, NULL);
+         gst_object_unref(jitterbuffer);
+         stat_add(&stats->cap_dropped_packets, 1);
+         stream_request_flush(stream, "jitterbuffer cap exceeded");
+         return GST_PAD_PROBE_DROP;
+      }
+   }
+   stat_add(&stats->jitterbuffer_in_packets, 1);
+   stat_add(&stats->jitterbuffer_in_bytes, gst_buffer_get_size(buffer));
+   skew_add(stream, pad, buffer);
+   return GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn jitterbuffer_src_probe(GstPad* pad, GstPadProbeInfo* info, StreamData* stream)
+{
+   stat_add(&stream->stats.jitterbuffer_out_packets, 1);
+   skew_add_hold(stream, pad, GST_PAD_PROBE_INFO_BUFFER(info));
+   return GST_PAD_PROBE_OK;
+}
+
+static void new_jitterbuffer_cb(GstElement* rtpbin, GstElement* jitterbuffer, guint session, guint ssrc, StreamData* stream)
+{
+   GstPad* pad;
+
+   pad = gst_element_get_static_pad(jitterbuffer, "sink");
+   gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, (GstPadProbeCallback)jitterbuffer_sink_probe, stream, NULL);
+   gst_object_unref(pad);
+   pad = gst_element_get_static_pad(jitterbuffer, "src");
+   gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, (GstPadProbeCallback)jitterbuffer_src_probe, stream, NULL);
+   gst_object_unref(pad);
+
+   g_mutex_lock(&stream->lock);
+   g_ptr_array_add(stream->jitterbuffers, gst_object_ref(jitterbuffer));
+   g_mutex_unlock(&stream->lock);
+   g_object_set(G_OBJECT(jitterbuffer), "ts-offset", (gint64)stream->ts_offset, NULL);
+   skew_restart(stream);
+}
+
+static void capture_pad_added_cb(GstElement* manager, GstPad* pad, StreamData* stream);
+
+static void new_manager_cb(GstElement* rtspsrc, GstElement* manager, StreamData* stream)
+{
+   g_signal_connect(manager, "new-jitterbuffer", G_CALLBACK(new_jitterbuffer_cb), stream);
+   if (stream->capture_file)
+   {
+      g_signal_connect(manager, "pad-added", G_CALLBACK(capture_pad_added_cb), stream);
+   }
+}
+
+/*
+ * Intra refresh
+ *
+ * Cameras set up for intra refresh send no IDR frames, or only the first:
+ * every frame refreshes a band of macroblocks and a recovery point SEI marks
+ * the start of each cycle, with the number of frames until the picture is
+ * complete. That frame is where decoding can start, so refresh_track()
+ * clears its delta unit flag. Waiting for a keyframe after a flush, the
+ * timeshift index, the LL-HLS segments and the WebRTC viewers then treat it
+ * like an IDR frame.
+ *
+ * Until a cycle is complete the picture is partly gray (avdec_h264 outputs
+ * corrupt frames), so decoder_src_probe drops the decoded frames until the
+ * one that completes it, at the start and after a flush. For other streams
+ * the same holds until the first IDR frame.
+ *
+ * Lost packets (a DISCONT from the depayloader) damage the picture up to the
+ * next IDR frame or complete cycle, and --concealment decides what is shown
+ * meanwhile: the decoder's concealment, the last good frame while decoding
+ * goes on, or nothing decoded at all until then. Frames that the decoder
+ * flags CORRUPTED are handled the same way. Loss events, the corrupted
+ * frames that were shown, the frames held back and the time to recover are
+ * counted (stream_report_loss), to weigh latency against integrity
+ */
+
+static gint h264_read_ue(const guint8* data, gsize size)
+{
+   gsize bits = size * 8, bit = 0;
+   guint zeros = 0, value = 0;
+
+   while (bit < bits && !((data[bit / 8] >> (7 - bit % 8)) & 1))
+   {
+      zeros++;
+      bit++;
+   }
+   if (bit + zeros >= bits || zeros > 16)
+   {
+      return -1;
+   }
+   bit++;
+   for (guint i = 0; i < zeros; i++, bit++)
+   {
+      value = (value << 1) | ((data[bit / 8] >> (7 - bit % 8)) & 1);
+   }
+   return (1 << zeros) - 1 + value;
+}
+
+/*
+ * recovery_frame_cnt of the SEI NAL unit's recovery point, or -1
+ */
+
+static gint h264_sei_recovery_frames(const guint8* data, gsize size)
+{
+   guint8 rbsp[256];
+   gsize length = 0, pos = 0;
+   guint zeros = 0;
+
+   /* Without the emulation prevention bytes. The recovery point comes first in practice */
+   for (gsize i = 0; i < size && length < sizeof(rbsp); i++)
+   {
+      if (zeros >= 2 && data[i] == 3)
+      {
+         zeros = 0;
+         continue;
+      }
+      rbsp[length++] = data[i];
+      zeros = data[i] == 0 ? zeros + 1 : 0;
+   }
+   while (pos + 1 < length)
+   {
+      guint type = 0, payload = 0;
+
+      while (pos < length && rbsp[pos] == 0xff)
+      {
+         type += rbsp[pos++];
+      }
+      type += pos < length ? rbsp[pos++] : 0;
+      while (pos < length && rbsp[pos] == 0xff)
+      {
+         payload += rbsp[pos++];
+      }
+      payload += pos < length ? rbsp[pos++] : 0;
+      if (pos >= length)
+      {
+         break;
+      }
+      if (type == 6)
+      {
+         return h264_read_ue(rbsp + pos, MIN(payload, length - pos));
+      }
+      pos += payload;
+   }
+   return -1;
+}
+
+/*
+ * Looks at the NAL units before the first slice of an access unit, either
+ * format
+ */
+
+static gint h264_recovery_point(const guint8* data, gsize size, gboolean avc)
+{
+   gsize offset = 0, start, end;
+
+   while (offset + 4 < size)
+   {
+      if (avc)
+      {
+         start = offset + 4;
+         end = MIN(start + GST_READ_UINT32_BE(data + offset), size);
+      }
+      else if (data[offset] == 0 && data[offset + 1] == 0 && data[offset + 2] == 1)
+      {
+         start = offset + 3;
+         for (end = start; end + 2 < size && !(data[end] == 0 && data[end + 1] == 0 && data[end + 2] <= 1); end++)
+         {
+         }
+         if (end + 2 >= size)
+         {
+            end = size;
+         }
+      }
+      else
+      {
+         offset++;
+         continue;
+      }
+      offset = end;
+      if (start >= end)
+      {
+         continue;
+      }
+      switch (data[start] & 0x1f)
+      {
+      case 1: case 2: case 3: case 4: case 5:
+         return -1;
+      case 6:
+         {
+            gint frames = h264_sei_recovery_frames(data + start + 1, end - start - 1);
+
+            if (frames >= 0)
+            {
+               return frames;
+            }
+         }
+         break;
+      }
+   }
+   return -1;
+}
+
+static ConcealPolicy stream_conceal_policy(StreamData* stream)
+{
+   if (stream->concealment == CONCEAL_AUTO)
+   {
+      return stream->intra_refresh ? CONCEAL_FREEZE : CONCEAL_SHOW;
+   }
+   return stream->concealment;
+}
+
+/*
+ * Lost packets: the picture is damaged until the next IDR frame or complete
+ * refresh cycle, on screen or not depending on the policy
+ */
+
+static void refresh_loss(StreamData* stream, GstPad* pad)
+{
+   ConcealPolicy policy = stream_conceal_policy(stream);
+
+   stat_add(&stream->stats.loss_events, 1);
+   stream->refresh_broken = TRUE;
+   stream->refresh_hide = policy != CONCEAL_SHOW;
+   stream->refresh_loss_time = g_get_monotonic_time();
+   if (policy != CONCEAL_SHOW)
+   {
+      GstPad* sinkpad = gst_element_get_static_pad(GST_ELEMENT(GST_OBJECT_PARENT(pad)), "sink");
+
+      /* Not showing anything until then, so ask for it (PLI) */
+      gst_pad_push_event(sinkpad, gst_video_event_new_upstream_force_key_unit(GST_CLOCK_TIME_NONE, TRUE, 0));
+      gst_object_unref(sinkpad);
+      stream->wait_keyframe = policy == CONCEAL_DROP;
+   }
+}
+
+/*
+ * On the depayloader's src pad, before anything else looks at the flags
+ */
+
+static void refresh_track(StreamData* stream, GstPad* pad, GstPadProbeInfo* info)
+{
+   GstBuffer* buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+   gint recovery = -1;
+
+   if (GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT))
+   {
+      GstMapInfo map;
+
+      if (stream->refresh_avc < 0)
+      {
+         GstCaps* caps = gst_pad_get_current_caps(pad);
+
+         stream->refresh_avc = caps && g_strcmp0(gst_structure_get_string(gst_caps_get_structure(caps, 0), "stream-format"), "avc") == 0;
+         if (caps)
+         {
+            gst_caps_unref(caps);
+         }
+      }
+      if (GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DISCONT) && !stream->refresh_broken)
+      {
+         refresh_loss(stream, pad);
+      }
+      if (gst_buffer_map(buffer, &map, GST_MAP_READ))
+      {
+         recovery = h264_recovery_point(map.data, map.size, stream->refresh_avc);
+         gst_buffer_unmap(buffer, &map);
+      }
+      if (recovery >= 0)
+      {
+         /*
+          * Open GOP encoders put a recovery point with a count of 0 on their
+          * non-IDR I-frames. Those are random access points too, but only a
+          * cycle of more than one frame makes this an intra refresh stream
+          */
+         if (recovery > 0 && !stream->intra_refresh)
+         {
+            g_print("%sIntra refresh stream, cycle of %d frames\n", stream->prefix, recovery + 1);
+            stream->intra_refresh = TRUE;
+         }
+         buffer = gst_buffer_make_writable(buffer);
+         GST_BUFFER_FLAG_UNSET(buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+         GST_PAD_PROBE_INFO_DATA(info) = buffer;
+      }
+   }
+   else
+   {
+      recovery = 0;
+   }
+
+   if (stream->refresh_broken)
+   {
+      stream->refresh_pending = TRUE;
+      stream->refresh_show_pts = GST_CLOCK_TIME_NONE;
+      if (recovery < 0)
+      {
+         return;
+      }
+      stream->refresh_broken = FALSE;
+      stream->refresh_frames = recovery + 1;
+   }
+   /* Counting this one, the picture is complete with the last of the cycle */
+   if (stream->refresh_frames > 0 && --stream->refresh_frames == 0)
+   {
+      stream->refresh_show_pts = GST_BUFFER_PTS(buffer);
+   }
+}
+
+/*
+ * Once a second when there was loss: what it cost in integrity (corrupted
+ * frames shown) and in latency (time to a complete picture)
+ */
+
+static void stream_report_loss(StreamData* stream)
+{
+   StreamStats* stats = &stream->stats;
+   gssize events = stat_get(&stats->loss_events), corrupted = stat_get(&stats->corrupted_frames_shown);
+   gssize recoveries = stat_get(&stats->recoveries);
+
+   if (events == stream->loss_last_events && corrupted == stream->loss_last_corrupted)
+   {
+      return;
+   }
+   stream->loss_last_events = events;
+   stream->loss_last_corrupted = corrupted;
+   g_print("%sLoss (%s): %zi events, %zi corrupted frames shown, %zi held back, recovery avg %.0fms\n", stream->prefix,
+         conceal_policy_names[stream_conceal_policy(stream)], events, corrupted, stat_get(&stats->held_frames),
+         recoveries > 0 ? stat_get(&stats->recovery_time_us) / 1e3 / recoveries : 0.0);
+}
+
+static GstPadProbeReturn depay_sink_probe(GstPad* pad, GstPadProbeInfo* info, StreamData* stream)
+{
+   cpu_stage(stream, CPU_DEPAY);
+   stat_add(&stream->stats.depay_bytes, gst_buffer_get_size(GST_PAD_PROBE_INFO_BUFFER(info)));
+
+   /* Somebody waits for a packet (stream_first_packet_async), tell application_cb */
+   if (g_atomic_int_compare_and_exchange(&stream->packet_wanted, 1, 0))
+   {
+      GstElement* depay = GST_PAD_PARENT(pad);
+      gst_element_post_message(depay, gst_message_new_application(GST_OBJECT(depay), gst_structure_new_empty("packet-ready")));
+   }
+   return GST_PAD_PROBE_OK;
+}
+
+/*
+ * Runs on the jitterbuffer's streaming thread, which also drives the decoder.
+ * That makes it the place to flush the decoder: nothing else pushes into it
+ * while we do. The flush is stopped at the decoder's src pad, see
+ * decoder_src_event_probe. The sink holds no more than a frame and would
+ * lose its state (and the pipeline its running time) when flushed
+ */
+
+static GstPadProbeReturn depay_src_probe(GstPad* pad, GstPadProbeInfo* info, StreamData* stream)
+{
+   StreamStats* stats = &stream->stats;
+   GstBuffer* buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+
+   stat_set(&stats->depay_bytes, 0);
+   /* Intra refresh has no keyframes to decode alone, decoder_src_probe halves the fps instead */
+   if (g_atomic_int_get(&stream->governor_level) >= GOVERNOR_KEYFRAMES && GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT) && !stream->intra_refresh)
+   {
+      /* Back at full the decoder starts at a keyframe */
+      stream->wait_keyframe = TRUE;
+      return GST_PAD_PROBE_DROP;
+   }
+   if (g_atomic_int_compare_and_exchange(&stream->flush_pending, 1, 0))
+   {
+      GstEvent* segment = gst_pad_get_sticky_event(pad, GST_EVENT_SEGMENT, 0);
+      GstPad* sinkpad = gst_element_get_static_pad(GST_ELEMENT(GST_OBJECT_PARENT(pad)), "sink");
+
+      stream->local_flush = TRUE;
+      gst_pad_push_event(pad, gst_event_new_flush_start());
+      gst_pad_push_event(pad, gst_event_new_flush_stop(FALSE));
+      stream->local_flush = FALSE;
+      /* flush-stop removed the segment */
+      if (segment)
+      {
+         gst_pad_push_event(pad, segment);
+      }
+
+      /* Everything the decoder had is gone */
+      stat_add(&stats->decoder_gone_frames, stat_get(&stats->decoder_in_frames) - stat_get(&stats->decoder_out_frames) - stat_get(&stats->decoder_gone_frames));
+      stat_add(&stats->flushes, 1);
+
+      /* Becomes a PLI/FIR to the camera if it supports that */
+      gst_pad_push_event(sinkpad, gst_video_event_new_upstream_force_key_unit(GST_CLOCK_TIME_NONE, TRUE, 0));
+      gst_object_unref(sinkpad);
+      stream->wait_keyframe = TRUE;
+      stream->refresh_broken = TRUE;
+      stream->refresh_hide = TRUE;
+   }
+   refresh_track(stream, pad, info);
+   buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+   if (stream->wait_keyframe)
+   {
+      if (GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT))
+      {
+         return GST_PAD_PROBE_DROP;
+      }
+      stream->wait_keyframe = FALSE;
+   }
+   return GST_PAD_PROBE_OK;
+}
+
+/*
+ * Counted at the decoder and not at the depayloader: with --timeshift the
+ * decoder may be fed by the replay instead
+ */
+
+static GstPadProbeReturn decoder_sink_probe(GstPad* pad, GstPadProbeInfo* info, StreamData* stream)
+{
+   cpu_stage(stream, CPU_DECODE);
+   stat_add(&stream->stats.decoder_in_frames, 1);
+   stat_add(&stream->stats.decoder_in_bytes, gst_buffer_get_size(GST_PAD_PROBE_INFO_BUFFER(info)));
+   return GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn decoder_src_probe(GstPad* pad, GstPadProbeInfo* info, StreamData* stream)
+{
+   GstBuffer* buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+   GstClockTime pts = GST_BUFFER_PTS(buffer);
+   GovernorLevel level = g_atomic_int_get(&stream->governor_level);
+   gboolean corrupted = GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_CORRUPTED);
+
+   stat_add(&stream->stats.decoder_out_frames, 1);
+   stat_set(&stream->stats.frame_bytes, gst_buffer_get_size(buffer));
+
+   /* Until the picture is complete, see refresh_track() */
+   if (stream->refresh_pending)
+   {
+      if (!GST_CLOCK_TIME_IS_VALID(stream->refresh_show_pts) || (GST_CLOCK_TIME_IS_VALID(pts) && pts < stream->refresh_show_pts))
+      {
+         corrupted = TRUE;
+      }
+      else
+      {
+         stream->refresh_pending = FALSE;
+         if (stream->refresh_loss_time)
+         {
+            stat_add(&stream->stats.recovery_time_us, g_get_monotonic_time() - stream->refresh_loss_time);
+            stat_add(&stream->stats.recoveries, 1);
+            stream->refresh_loss_time = 0;
+         }
+      }
+   }
+   if (corrupted)
+   {
+      /* The sink keeps showing the last frame */
+      if ((stream->refresh_pending && stream->refresh_hide) || stream_conceal_policy(stream) != CONCEAL_SHOW)
+      {
+         stat_add(&stream->stats.held_frames, 1);
+         return GST_PAD_PROBE_DROP;
+      }
+      stat_add(&stream->stats.corrupted_frames_shown, 1);
+   }
+
+   /* Every other frame, saves the conversion and rendering */
+   if ((level == GOVERNOR_REDUCED_FPS || (level == GOVERNOR_KEYFRAMES && stream->intra_refresh)) && (stream->governor_frames++ & 1))
+   {
+      return GST_PAD_PROBE_DROP;
+   }
+   return GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn decoder_src_event_probe(GstPad* pad, GstPadProbeInfo* info, StreamData* stream)
+{
+   return stream->local_flush ? GST_PAD_PROBE_DROP : GST_PAD_PROBE_OK;
+}
+
+static void stream_add_memory_probes(StreamData* stream, GstElement* source, GstElement* depay, GstElement* decoder)
+{
+   GstPad* pad;
+
+   /* The source is rtspsrc, webrtcbin or, replaying a capture, rtpbin itself */
+   if (g_signal_lookup("new-manager", G_OBJECT_TYPE(source)))
+   {
+      g_signal_connect(source, "new-manager", G_CALLBACK(new_manager_cb), stream);
+   }
+   else if (source == stream->srt_source)
+   {
+      /* No jitterbuffer, SRT buffers inside srtsrc */
+   }
+   else if (source == stream->whep_source)
+   {
+      GstElement* rtpbin = gst_bin_get_by_name(GST_BIN(source), "rtpbin");
+
+      if (rtpbin)
+      {
+         new_manager_cb(NULL, rtpbin, stream);
+         gst_object_unref(rtpbin);
+      }
+   }
+   else
+   {
+      new_manager_cb(NULL, source, stream);
+   }
+
+   pad = gst_element_get_static_pad(depay, "sink");
+   gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, (GstPadProbeCallback)depay_sink_probe, stream, NULL);
+   gst_object_unref(pad);
+   pad = gst_element_get_static_pad(depay, "src");
+   gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, (GstPadProbeCallback)depay_src_probe, stream, NULL);
+   gst_object_unref(pad);
+   pad = gst_element_get_static_pad(decoder, "sink");
+   gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, (GstPadProbeCallback)decoder_sink_probe, stream, NULL);
+   gst_object_unref(pad);
+   pad = gst_element_get_static_pad(decoder, "src");
+   gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, (GstPadProbeCallback)decoder_src_probe, stream, NULL);
+   gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_EVENT_FLUSH, (GstPadProbeCallback)decoder_src_event_probe, stream, NULL);
+   gst_object_unref(pad);
+}
+
+/*
+ * Timeshift
+ *
+ * With --timeshift=S the encoded access units of the last S seconds are kept
+ * per stream, as references to the depayloader's buffers so nothing is
+ * copied, with an index of the keyframes. An input-selector in front of the
+ * decoder switches between the live depayloader and an appsrc that replays
+ * from the ring. The replayed units are retimestamped to the current running
+ * time, so the sink shows them at their original pace. The RTSP session
+ * isn't touched: going back to the live edge switches the selector back and
+ * flushes to the next keyframe (stream_request_flush)
+ */
+
+static GstClockTime stream_running_time(StreamData* stream)
+{
+   GstClock* clock = gst_element_get_clock(stream->pipeline);
+   GstClockTime now = GST_CLOCK_TIME_NONE;
+
+   if (clock)
+   {
+      now = gst_clock_get_time(clock) - gst_element_get_base_time(stream->pipeline);
+      gst_object_unref(clock);
+   }
+   return now;
+}
+
+/*
+ * Push the units the appsrc can take. With the stream's lock held, from the
+ * appsrc's need-data and from the live streaming thread when the replay
+ * caught up with the live edge
+ */
+
+static void timeshift_feed_locked(StreamData* stream)
+{
+   TimeShift* ts = &stream->timeshift;
+
+   while (ts->replaying && !ts->paused && g_atomic_int_get(&ts->wanted) && ts->cursor < ts->first_seq + ts->count)
+   {
+      GstBuffer* unit = timeshift_unit(ts, ts->cursor++);
+      GstBuffer* buffer;
+
+      if (ts->rebase)
+      {
+         GstClockTime now = stream_running_time(stream);
+         ts->offset = GST_CLOCK_TIME_IS_VALID(now) && GST_BUFFER_PTS_IS_VALID(unit) ? GST_CLOCK_DIFF(GST_BUFFER_PTS(unit), now) : 0;
+         ts->rebase = FALSE;
+      }
+
+      /* Shares the memory, only the timestamps change */
+      buffer = gst_buffer_copy(unit);
+      if (GST_BUFFER_PTS_IS_VALID(buffer))
+      {
+         GST_BUFFER_PTS(buffer) += ts->offset;
+      }
+      if (GST_BUFFER_DTS_IS_VALID(buffer))
+      {
+         GST_BUFFER_DTS(buffer) += ts->offset;
+      }
+      gst_app_src_push_buffer(GST_APP_SRC(stream->replay), buffer);
+   }
+}
+
+/*
+ * On the selector's live pad, so it sees what the decoder would get live.
+ * Runs on the jitterbuffer's streaming thread
+ */
+
+static GstPadProbeReturn timeshift_record_probe(GstPad* pad, GstPadProbeInfo* info, StreamData* stream)
+{
+   TimeShift* ts = &stream->timeshift;
+   GstBuffer* buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+
+   g_mutex_lock(&stream->lock);
+
+   /* Drop the oldest units beyond --timeshift */
+   while (ts->count > 0)
+   {
+      GstBuffer* oldest = timeshift_unit(ts, ts->first_seq);
+
+      if (ts->count < ts->capacity &&
+          !(GST_BUFFER_PTS_IS_VALID(buffer) && GST_BUFFER_PTS_IS_VALID(oldest) &&
+            GST_BUFFER_PTS(buffer) > GST_BUFFER_PTS(oldest) + opt_timeshift * GST_SECOND))
+      {
+         break;
+      }
+      if (ts->keyframes->len > 0 && g_array_index(ts->keyframes, guint64, 0) == ts->first_seq)
+      {
+         g_array_remove_index(ts->keyframes, 0);
+      }
+      ts->bytes -= gst_buffer_get_size(oldest);
+      gst_buffer_unref(oldest);
+      ts->head = (ts->head + 1) % ts->capacity;
+      ts->first_seq++;
+      ts->count--;
+   }
+
+   /* A paused or slow replay fell off the end, continue at the oldest keyframe */
+   if (ts->replaying && ts->cursor < ts->first_seq && ts->keyframes->len > 0)
+   {
+      ts->cursor = g_array_index(ts->keyframes, guint64, 0);
+      ts->rebase = TRUE;
+   }
+
+   ts->units[(ts->head + ts->count) % ts->capacity] = gst_buffer_ref(buffer);
+   if (!GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT))
+   {
+      guint64 seq = ts->first_seq + ts->count;
+      g_array_append_val(ts->keyframes, seq);
+   }
+   ts->count++;
+   ts->bytes += gst_buffer_get_size(buffer);
+
+   timeshift_feed_locked(stream);
+   g_mutex_unlock(&stream->lock);
+   return GST_PAD_PROBE_OK;
+}
+
+static void replay_need_data_cb(GstAppSrc* appsrc, guint length, StreamData* stream)
+{
+   g_atomic_int_set(&stream->timeshift.wanted, 1);
+   g_mutex_lock(&stream->lock);
+   timeshift_feed_locked(stream);
+   g_mutex_unlock(&stream->lock);
+}
+
+/*
+ * May be emitted from within gst_app_src_push_buffer(), so no locking here
+ */
+
+static void replay_enough_data_cb(GstAppSrc* appsrc, StreamData* stream)
+{
+   g_atomic_int_set(&stream->timeshift.wanted, 0);
+}
+
+/*
+ * Drop whatever the appsrc still queued, by restarting it
+ */
+
+static void timeshift_reset_replay(StreamData* stream)
+{
+   GstCaps* caps = gst_pad_get_current_caps(stream->live_pad);
+
+   gst_element_set_state(stream->replay, GST_STATE_READY);
+   if (caps)
+   {
+      gst_app_src_set_caps(GST_APP_SRC(stream->replay), caps);
+      gst_caps_unref(caps);
+   }
+   gst_element_sync_state_with_parent(stream->replay);
+}
+
+/*
+ * Start replaying from the last keyframe at least seconds before the live
+ * edge. Main loop only, like the other timeshift_xxx() below
+ */
+
+static void timeshift_seek(StreamData* stream, gdouble seconds)
+{
+   TimeShift* ts = &stream->timeshift;
+   GstClockTime target;
+   guint lo = 0, hi;
+
+   g_mutex_lock(&stream->lock);
+   ts->replaying = FALSE;
+   if (ts->keyframes->len == 0 || !GST_BUFFER_PTS_IS_VALID(timeshift_unit(ts, ts->first_seq + ts->count - 1)))
+   {
+      g_mutex_unlock(&stream->lock);
+      return;
+   }
+   target = GST_BUFFER_PTS(timeshift_unit(ts, ts->first_seq + ts->count - 1));
+   target -= MIN(target, (GstClockTime)(seconds * GST_SECOND));
+
+   /* Last keyframe at or before target, or else the oldest */
+   hi = ts->keyframes->len;
+   while (hi - lo > 1)
+   {
+      guint mid = (lo + hi) / 2;
+      GstBuffer* unit = timeshift_unit(ts, g_array_index(ts->keyframes, guint64, mid));
+
+      if (GST_BUFFER_PTS_IS_VALID(unit) && GST_BUFFER_PTS(unit) <= target)
+      {
+         lo = mid;
+      }
+      else
+      {
+         hi = mid;
+      }
+   }
+   ts->cursor = g_array_index(ts->keyframes, guint64, lo);
+   g_mutex_unlock(&stream->lock);
+
+   timeshift_reset_replay(stream);
+   g_object_set(G_OBJECT(stream->selector), "active-pad", stream->replay_pad, NULL);
+
+   g_mutex_lock(&stream->lock);
+   ts->replaying = TRUE;
+   ts->paused = FALSE;
+   ts->rebase = TRUE;
+   timeshift_feed_locked(stream);
+   g_mutex_unlock(&stream->lock);
+}
+
+/*
+ * Freeze the picture. A live stream is switched to the replay at the live
+ * edge, so resuming continues from where it was paused
+ */
+
+static void timeshift_pause(StreamData* stream)
+{
+   TimeShift* ts = &stream->timeshift;
+   gboolean replaying;
+
+   g_mutex_lock(&stream->lock);
+   ts->paused = TRUE;
+   replaying = ts->replaying;
+   if (!replaying)
+   {
+      ts->cursor = ts->first_seq + ts->count;
+   }
+   g_mutex_unlock(&stream->lock);
+
+   if (!replaying)
+   {
+      timeshift_reset_replay(stream);
+      g_object_set(G_OBJECT(stream->selector), "active-pad", stream->replay_pad, NULL);
+      g_mutex_lock(&stream->lock);
+      ts->replaying = TRUE;
+      g_mutex_unlock(&stream->lock);
+   }
+}
+
+static void timeshift_resume(StreamData* stream)
+{
+   TimeShift* ts = &stream->timeshift;
+
+   g_mutex_lock(&stream->lock);
+   if (ts->paused)
+   {
+      ts->paused = FALSE;
+      ts->rebase = TRUE;
+      timeshift_feed_locked(stream);
+   }
+   g_mutex_unlock(&stream->lock);
+}
+
+static void timeshift_go_live(StreamData* stream)
+{
+   TimeShift* ts = &stream->timeshift;
+
+   g_mutex_lock(&stream->lock);
+   if (!ts->replaying)
+   {
+      g_mutex_unlock(&stream->lock);
+      return;
+   }
+   ts->replaying = FALSE;
+   ts->paused = FALSE;
+   g_mutex_unlock(&stream->lock);
+
+   g_object_set(G_OBJECT(stream->selector), "active-pad", stream->live_pad, NULL);
+   timeshift_reset_replay(stream);
+   stream_request_flush(stream, "back to the live edge");
+}
+
+/*
+ * ONVIF replay
+ *
+ * With --replay-start, rtspsrc acts as ONVIF client (Require: onvif-replay)
+ * and plays the camera's recording instead of the live view. The seek before
+ * PLAY becomes the Range header, in clock (absolute UTC) times, its rate the
+ * Scale header and the key unit trick mode "Frames: intra". Rate-Control: no
+ * makes the camera send as fast as it can, over the RTSP connection, and the
+ * sink doesn't sync, so the recording is pulled through the decoder faster
+ * than real time
+ */
+
+#define PRIME_EPOCH_OFFSET G_GINT64_CONSTANT(2208988800)   /* 1900-01-01 to 1970-01-01, in s */
+
+/*
+ * ONVIF mode rtspsrc takes seek positions in ns since the prime epoch
+ */
+
+static GstClockTime replay_parse_time(const gchar* iso)
+{
+   GDateTime* time;
+   GstClockTime result;
+
+   if (!iso || !(time = g_date_time_new_from_iso8601(iso, NULL)))
+   {
+      return GST_CLOCK_TIME_NONE;
+   }
+   result = (g_date_time_to_unix(time) + PRIME_EPOCH_OFFSET) * GST_SECOND + g_date_time_get_microsecond(time) * GST_USECOND;
+   g_date_time_unref(time);
+   return result;
+}
+
+/*
+ * Called when the pipeline is PAUSED and rtspsrc hasn't sent PLAY yet
+ */
+
+static void stream_replay_seek(StreamData* stream)
+{
+   GstElement* source = stream_get_element(stream, "source");
+   GstClockTime start = replay_parse_time(opt_replay_start);
+   GstClockTime stop = replay_parse_time(opt_replay_end);
+   GstSeekFlags flags = GST_SEEK_FLAG_FLUSH;
+
+   if (opt_replay_keyframes)
+   {
+      flags |= GST_SEEK_FLAG_TRICKMODE | GST_SEEK_FLAG_TRICKMODE_KEY_UNITS;
+   }
+   if (!gst_element_send_event(source, gst_event_new_seek(opt_replay_rate, GST_FORMAT_TIME, flags,
+               GST_SEEK_TYPE_SET, start, stop == GST_CLOCK_TIME_NONE ? GST_SEEK_TYPE_NONE : GST_SEEK_TYPE_SET, stop)))
+   {
+      g_printerr("%s: replay seek failed\n", stream->prefix);
+   }
+   gst_object_unref(source);
+}
+
+/*
+ * Capture and replay
+ *
+ * With --capture every RTP and RTCP packet rtspsrc receives is written to a
+ * file, as it enters rtpbin, with its arrival time. That is the timestamp
+ * udpsrc (or rtspsrc for RTP over TCP) gave it on receipt, in clock time,
+ * as the socket's kernel timestamps don't make it into GStreamer. The caps
+ * of each session are written too, so a capture file is all a replay needs.
+ *
+ * Given a capture file instead of an rtsp:// URL, the stream is fed from it:
+ * two appsrc's into rtpbin, in place of rtspsrc, so the jitterbuffer and
+ * everything after it is the same as live. The packets are pushed at their
+ * original arrival times or, with --capture-fast, as fast as the pipeline
+ * takes them with the arrival times as timestamps
+ */
+
+#define CAPTURE_BACKLOG 8192              /* Records queued for the writer */
+
+typedef struct
+{
+   StreamData*  stream;
+   CaptureKind  kind;
+   guint        session;
+}
+CapturePad;
+
+/*
+ * Once, from whichever thread notices first. What was written so far can
+ * still be replayed, capture_next() ignores a truncated last record
+ */
+
+static void capture_stop(StreamData* stream, const gchar* reason)
+{
+   if (g_atomic_int_compare_and_exchange(&stream->capture_stopped, FALSE, TRUE))
+   {
+      g_printerr("%s: capture stopped, %s\n", stream->prefix, reason);
+   }
+}
+
+/*
+ * On the stream's capture writer thread, the record with its data and
+ * padding in one piece
+ */
+
+static void capture_writer(GBytes* bytes, StreamData* stream)
+{
+   gsize size;
+   gconstpointer data = g_bytes_get_data(bytes, &size);
+
+   if (!g_atomic_int_get(&stream->capture_stopped) && fwrite(data, 1, size, stream->capture_file) != size)
+   {
+      capture_stop(stream, g_strerror(errno));
+   }
+   g_bytes_unref(bytes);
+}
+
+/*
+ * On the receiving streaming threads. Disk I/O is left to the writer thread,
+ * so a slow disk doesn't stall reception
+ */
+
+static void capture_write(StreamData* stream, CaptureKind kind, guint session, GstClockTime arrival, gconstpointer data, gsize length)
+{
+   gsize size = sizeof(CaptureRecord) + CAPTURE_ALIGN(length);
+   CaptureRecord* record;
+
+   if (g_atomic_int_get(&stream->capture_stopped))
+   {
+      return;
+   }
+   record = g_malloc0(size);
+   memcpy(record + 1, data, length);
+   record->length = length;
+   record->kind = kind;
+   record->session = session;
+
+   /* Under the lock so the records are queued in the order of their times */
+   g_mutex_lock(&stream->capture_lock);
+   if (!GST_CLOCK_TIME_IS_VALID(stream->capture_start))
+   {
+      stream->capture_start = arrival;
+   }
+   record->arrival = arrival - MIN(arrival, stream->capture_start);
+   if (g_thread_pool_unprocessed(stream->capture_writer) >= CAPTURE_BACKLOG)
+   {
+      capture_stop(stream, "the disk can't keep up");
+      g_free(record);
+   }
+   else
+   {
+      g_thread_pool_push(stream->capture_writer, g_bytes_new_take(record, size), NULL);
+   }
+   g_mutex_unlock(&stream->capture_lock);
+}
+
+static gboolean capture_buffer(GstBuffer** buffer, guint index, CapturePad* cpad)
+{
+   GstClockTime arrival = GST_BUFFER_DTS_OR_PTS(*buffer);
+   GstMapInfo map;
+
+   if (!GST_CLOCK_TIME_IS_VALID(arrival))
+   {
+      arrival = stream_running_time(cpad->stream);
+   }
+   if (gst_buffer_map(*buffer, &map, GST_MAP_READ))
+   {
+      capture_write(cpad->stream, cpad->kind, cpad->session, arrival, map.data, map.size);
+      gst_buffer_unmap(*buffer, &map);
+   }
+   return TRUE;
+}
+
+static GstPadProbeReturn capture_probe(GstPad* pad, GstPadProbeInfo* info, CapturePad* cpad)
+{
+   if (info->type & GST_PAD_PROBE_TYPE_BUFFER)
+   {
+      GstBuffer* buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+      capture_buffer(&buffer, 0, cpad);
+   }
+   else if (info->type & GST_PAD_PROBE_TYPE_BUFFER_LIST)
+   {
+      gst_buffer_list_foreach(GST_PAD_PROBE_INFO_BUFFER_LIST(info), (GstBufferListFunc)capture_buffer, cpad);
+   }
+   else if (GST_EVENT_TYPE(GST_PAD_PROBE_INFO_EVENT(info)) == GST_EVENT_CAPS && cpad->kind == CAPTURE_RTP)
+   {
+      GstCaps* caps;
+      gchar* str;
+
+      gst_event_parse_caps(GST_PAD_PROBE_INFO_EVENT(info), &caps);
+      str = gst_caps_to_string(caps);
+      capture_write(cpad->stream, CAPTURE_CAPS, cpad->session, stream_running_time(cpad->stream), str, strlen(str) + 1);
+      g_free(str);
+   }
+   return GST_PAD_PROBE_OK;
+}
+
+/*
+ * rtspsrc requests rtpbin's recv_rtp_sink_%u and recv_rtcp_sink_%u for each
+ * session, that's where the packets are taken
+ */
+
+static void capture_pad_added_cb(GstElement* manager, GstPad* pad, StreamData* stream)
+{
+   gchar* name = gst_pad_get_name(pad);
+   CapturePad* cpad = g_new0(CapturePad, 1);
+
+   cpad->stream = stream;
+   if (sscanf(name, "recv_rtp_sink_%u", &cpad->session) == 1)
+   {
+      cpad->kind = CAPTURE_RTP;
+   }
+   else if (sscanf(name, "recv_rtcp_sink_%u", &cpad->session) == 1)
+   {
+      cpad->kind = CAPTURE_RTCP;
+   }
+   else
+   {
+      g_free(cpad);
+      cpad = NULL;
+   }
+   if (cpad)
+   {
+      gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST | GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM,
+            (GstPadProbeCallback)capture_probe, cpad, g_free);
+   }
+   g_free(name);
+}
+
+static FILE* capture_create(const gchar* filename)
+{
+   FILE* file = fopen(filename, "wb");
+
+   if (!file)
+   {
+      g_printerr("Can't create %s\n", filename);
+      return NULL;
+   }
+   if (fwrite(CAPTURE_MAGIC, 1, CAPTURE_HEADER_SIZE, file) != CAPTURE_HEADER_SIZE)
+   {
+      g_printerr("Can't write %s\n", filename);
+      fclose(file);
+      return NULL;
+   }
+   return file;
+}
+
+/*
+ * The next record of a mmap'ed capture file, or NULL at the end
+ */
+
+static const CaptureRecord* capture_next(const gchar* data, gsize size, gsize* offset)
+{
+   const CaptureRecord* record;
+
+   if (*offset + sizeof(CaptureRecord) > size)
+   {
+      return NULL;
+   }
+   record = (const CaptureRecord*)(data + *offset);
+   if (*offset + sizeof(CaptureRecord) + record->length > size)
+   {
+      return NULL;
+   }
+   *offset += sizeof(CaptureRecord) + CAPTURE_ALIGN(record->length);
+   return record;
+}
+
+/*
+ * Map a capture file and find its video session. Returns its caps, or NULL
+ * when it's no capture file or has no video
+ */
+
+static GstCaps* capture_open(const gchar* filename, GMappedFile** file, guint* session)
+{
+   const gchar* data;
+   gsize size, offset = CAPTURE_HEADER_SIZE;
+   const CaptureRecord* record;
+
+   *file = g_mapped_file_new(filename, FALSE, NULL);
+   if (!*file)
+   {
+      return NULL;
+   }
+   data = g_mapped_file_get_contents(*file);
+   size = g_mapped_file_get_length(*file);
+   if (size < CAPTURE_HEADER_SIZE || memcmp(data, CAPTURE_MAGIC, CAPTURE_HEADER_SIZE) != 0)
+   {
+      return NULL;
+   }
+   while ((record = capture_next(data, size, &offset)) != NULL)
+   {
+      if (record->kind == CAPTURE_CAPS && record->length > 0 && ((const gchar*)(record + 1))[record->length - 1] == '\0')
+      {
+         GstCaps* caps = gst_caps_from_string((const gchar*)(record + 1));
+         const gchar* media = caps ? gst_structure_get_string(gst_caps_get_structure(caps, 0), "media") : NULL;
+
+         if (g_strcmp0(media, "video") == 0)
+         {
+            *session = record->session;
+            return caps;
+         }
+         if (caps)
+         {
+            gst_caps_unref(caps);
+         }
+      }
+   }
+   return NULL;
+}
+
+static gpointer capture_replay_thread(StreamData* stream)
+{
+   CaptureReplay* replay = stream->capture_replay;
+   const gchar* data = g_mapped_file_get_contents(replay->file);
+   gsize size = g_mapped_file_get_length(replay->file), offset = CAPTURE_HEADER_SIZE;
+   gint64 start = g_get_monotonic_time();
+   const CaptureRecord* record;
+
+   g_mutex_lock(&replay->lock);
+   while (!replay->stop && (record = capture_next(data, size, &offset)) != NULL)
+   {
+      GstBuffer* buffer;
+
+      if (record->session != replay->session || record->kind == CAPTURE_CAPS)
+      {
+         continue;
+      }
+      if (!opt_capture_fast)
+      {
+         /* Until its arrival time, or stopped */
+         while (!replay->stop && g_cond_wait_until(&replay->cond, &replay->lock, start + record->arrival / 1000));
+         if (replay->stop)
+         {
+            break;
+         }
+      }
+
+      /* The data stays in the mapped file */
+      buffer = gst_buffer_new_wrapped_full(GST_MEMORY_FLAG_READONLY, (gpointer)(record + 1), record->length, 0, record->length,
+            g_mapped_file_ref(replay->file), (GDestroyNotify)g_mapped_file_unref);
+      if (opt_capture_fast)
+      {
+         GST_BUFFER_DTS(buffer) = record->arrival;
+      }
+      g_mutex_unlock(&replay->lock);
+      gst_app_src_push_buffer(GST_APP_SRC(record->kind == CAPTURE_RTP ? replay->rtp_src : replay->rtcp_src), buffer);
+      g_mutex_lock(&replay->lock);
+   }
+   g_mutex_unlock(&replay->lock);
+
+   gst_app_src_end_of_stream(GST_APP_SRC(replay->rtp_src));
+   gst_app_src_end_of_stream(GST_APP_SRC(replay->rtcp_src));
+   return NULL;
+}
+
+/*
+ * Add the appsrc's that feed rtpbin from the capture file
+ */
+
+static gboolean capture_replay_setup(StreamData* stream, GstElement* pipeline, GstElement* rtpbin)
+{
+   CaptureReplay* replay = g_new0(CaptureReplay, 1);
+   GstCaps* caps = capture_open(stream->url, &replay->file, &replay->session);
+   gchar* name;
+
+   stream->capture_replay = replay;
+   g_mutex_init(&replay->lock);
+   g_cond_init(&replay->cond);
+   if (!caps)
+   {
+      g_printerr("%s: %s is no capture file with video\n", stream->prefix, stream->url);
+      return FALSE;
+   }
+
+   name = g_strconcat(stream->prefix, "capture-rtp", NULL);
+   replay->rtp_src = gst_element_factory_make("appsrc", name);
+   g_free(name);
+   name = g_strconcat(stream->prefix, "capture-rtcp", NULL);
+   replay->rtcp_src = gst_element_factory_make("appsrc", name);
+   g_free(name);
+   g_object_set(G_OBJECT(replay->rtp_src), "caps", caps, NULL);
+   gst_caps_unref(caps);
+   caps = gst_caps_new_empty_simple("application/x-rtcp");
+   g_object_set(G_OBJECT(replay->rtcp_src), "caps", caps, NULL);
+   gst_caps_unref(caps);
+
+   /* Timestamped on push like udpsrc does, or with the arrival times as fast as possible */
+   g_object_set(G_OBJECT(replay->rtp_src), "is-live", TRUE, "format", GST_FORMAT_TIME, "do-timestamp", !opt_capture_fast, "block", opt_capture_fast, NULL);
+   g_object_set(G_OBJECT(replay->rtcp_src), "is-live", TRUE, "format", GST_FORMAT_TIME, "do-timestamp", !opt_capture_fast, NULL);
+   gst_bin_add_many(GST_BIN(pipeline), replay->rtp_src, replay->rtcp_src, NULL);
+
+   name = g_strdup_printf("recv_rtp_sink_%u", replay->session);
+   gst_element_link_pads(replay->rtp_src, "src", rtpbin, name);
+   g_free(name);
+   name = g_strdup_printf("recv_rtcp_sink_%u", replay->session);
+   gst_element_link_pads(replay->rtcp_src, "src", rtpbin, name);
+   g_free(name);
+   return TRUE;
+}
+
+/*
+ * Once PAUSED, so the appsrc's take the data. Live sources don't start
+ * before PLAYING, but a live pipeline only gets there with data
+ */
+
+static void capture_replay_start(StreamData* stream)
+{
+   if (!stream->capture_replay->thread)
+   {
+      stream->capture_replay->thread = g_thread_new(stream->prefix, (GThreadFunc)capture_replay_thread, stream);
+   }
+}
+
+/*
+ * Audio
+ *
+ * Audio gets its own depay ! decoder ! audioconvert ! audioresample ! sink
+ * branch. It runs on the jitterbuffer thread of its own RTP session, so it
+ * never blocks the video. The pipeline latency would normally be the largest
+ * of all sinks, which would delay the video by the audio device's buffer.
+ * Instead it is set from the video path only (latency_cb): audio that comes
+ * out too late for that is dropped by the audio sink, and the sink resamples
+ * to follow the pipeline clock (the system clock, the audio sink doesn't
+ * provide it). --audio-buffer sets the device buffer and with it the audio
+ * latency. The A/V offset is printed every second
+ */
+
+static const struct
+{
+   const gchar* encoding;
+   const gchar* depay;
+   const gchar* decoder;
+}
+audio_codecs[] =
+{
+   { "MPEG4-GENERIC", "rtpmp4gdepay", "avdec_aac" },
+   { "MP4A-LATM", "rtpmp4adepay", "avdec_aac" },
+   { "PCMU", "rtppcmudepay", "mulawdec" },
+   { "PCMA", "rtppcmadepay", "alawdec" },
+   { "OPUS", "rtpopusdepay", "opusdec" },
+};
+
+/*
+ * autoaudiosink creates the actual sink when it goes to READY
+ */
+
+static void audio_sink_child_added_cb(GstChildProxy* proxy, GObject* child, gchar* name, StreamData* stream)
+{
+   gint64 buffer_time = (gint64)opt_audio_buffer * 1000;
+
+   if (!g_object_class_find_property(G_OBJECT_GET_CLASS(child), "buffer-time"))
+   {
+      return;
+   }
+   g_object_set(child, "buffer-time", buffer_time, "latency-time", MIN(buffer_time / 2, G_GINT64_CONSTANT(10000)),
+         "provide-clock", FALSE, "drift-tolerance", buffer_time / 2, "alignment-threshold", (guint64)opt_audio_buffer * GST_MSECOND, NULL);
+   gst_util_set_object_arg(child, "slave-method", "resample");
+}
+
+static GstPadProbeReturn audio_sink_probe(GstPad* pad, GstPadProbeInfo* info, StreamData* stream)
+{
+   stream->audio_last_pts = GST_BUFFER_PTS(GST_PAD_PROBE_INFO_BUFFER(info));
+   return GST_PAD_PROBE_OK;
+}
+
+static void stream_add_audio(StreamData* stream, GstElement* source, GstPad* pad, const gchar* encoding)
+{
+   GstElement* pipeline = GST_ELEMENT(gst_element_get_parent(source));
+   GstElement *depay = NULL, *decoder = NULL, *convert, *resample, *sink;
+   GstPad* sinkpad;
+
+   for (guint i = 0; i < G_N_ELEMENTS(audio_codecs); i++)
+   {
+      if (g_ascii_strcasecmp(encoding, audio_codecs[i].encoding) == 0)
+      {
+         depay = gst_element_factory_make(audio_codecs[i].depay, NULL);
+         decoder = gst_element_factory_make(audio_codecs[i].decoder, NULL);
+         break;
+      }
+   }
+   convert = gst_element_factory_make("audioconvert", NULL);
+   resample = gst_element_factory_make("audioresample", NULL);
+   sink = gst_element_factory_make("autoaudiosink", NULL);
+   if (!depay || !decoder || !convert || !resample || !sink)
+   {
+      g_printerr("%s: no audio, %s not supported\n", stream->prefix, encoding);
+      g_clear_object(&depay);
+      g_clear_object(&decoder);
+      g_clear_object(&convert);
+      g_clear_object(&resample);
+      g_clear_object(&sink);
+      gst_object_unref(pipeline);
+      return;
+   }
+
+   g_signal_connect(sink, "child-added", G_CALLBACK(audio_sink_child_added_cb), stream);
+   sinkpad = gst_element_get_static_pad(sink, "sink");
+   gst_pad_add_probe(sinkpad, GST_PAD_PROBE_TYPE_BUFFER, (GstPadProbeCallback)audio_sink_probe, stream, NULL);
+   gst_object_unref(sinkpad);
+
+   gst_bin_add_many(GST_BIN(pipeline), depay, decoder, convert, resample, sink, NULL);
+   gst_element_link_many(depay, decoder, convert, resample, sink, NULL);
+   sinkpad = gst_element_get_static_pad(depay, "sink");
+   gst_pad_link(pad, sinkpad);
+   gst_object_unref(sinkpad);
+   gst_element_sync_state_with_parent(sink);
+   gst_element_sync_state_with_parent(resample);
+   gst_element_sync_state_with_parent(convert);
+   gst_element_sync_state_with_parent(decoder);
+   gst_element_sync_state_with_parent(depay);
+
+   stream->audio_sink = sink;
+   gst_object_unref(pipeline);
+   g_print("%sAudio: %s, %dms buffer\n", stream->prefix, encoding, opt_audio_buffer);
+}
+
+/*
+ * The pipeline latency follows the video path only, see above. The stats
+ * panel shows it too
+ */
+
+static void latency_cb(GstBus *bus, GstMessage *msg, StreamData *stream)
+{
+   GstElement* sink;
+   GstQuery* query;
+
+   if (!(sink = stream_get_element(stream, "sink")))
+   {
+      return;
+   }
+   query = gst_query_new_latency();
+   if (gst_element_query(sink, query))
+   {
+      GstClockTime min_latency;
+
+      gst_query_parse_latency(query, NULL, &min_latency, NULL);
+      stream->video_latency = min_latency;
+      if (stream->audio_sink)
+      {
+         gst_pipeline_set_latency(GST_PIPELINE(stream->pipeline), min_latency);
+         gst_bin_recalculate_latency(GST_BIN(stream->pipeline));
+      }
+   }
+   gst_query_unref(query);
+   gst_object_unref(sink);
+}
+
+/*
+ * Both timestamps are what just reached the sinks, in the same time base
+ * (rtspsrc syncs the sessions through RTCP). The audio device plays its
+ * buffer later than that
+ */
+
+static void stream_report_av(StreamData* stream)
+{
+   GstClockTime audio = stream->audio_last_pts, video = stream->last_pts;
+
+   if (!opt_verbose || !stream->audio_sink || !GST_CLOCK_TIME_IS_VALID(audio) || !GST_CLOCK_TIME_IS_VALID(video))
+   {
+      return;
+   }
+   g_print("%sA/V offset: audio %+.0fms, +%dms device buffer\n", stream->prefix, GST_CLOCK_DIFF(audio, video) / -1e6, opt_audio_buffer);
+}
+
+/*
+ * ONVIF metadata
+ *
+ * Cameras with analytics send their detections as an RTP stream of ONVIF XML
+ * documents (VND.ONVIF.METADATA), one document per marker bit. An appsink
+ * collects the documents on the metadata session's own streaming thread and
+ * hands them to a worker thread, which parses them and draws the bounding
+ * boxes with cairo into an overlay composition. On the video streaming thread
+ * overlaycomposition's draw signal only picks the composition that matches
+ * the frame's timestamp. That becomes a GstVideoOverlayCompositionMeta when
+ * the sink supports it (glimagesink), else overlaycomposition blends it
+ */
+
+#define METADATA_MAX_DOC (1024 * 1024)
+#define METADATA_MAX_OVERLAYS 64
+#define METADATA_EXPIRE (GST_SECOND)            /* Boxes are gone when there's no newer document by then */
+#define METADATA_RENDER_WIDTH 960               /* Boxes are drawn at this width and scaled */
+
+typedef struct
+{
+   StreamData*  stream;
+   GBytes*      xml;
+   GstClockTime pts;
+}
+MetadataDoc;
+
+typedef struct
+{
+   gdouble      left, top, right, bottom;
+   gchar        label[32];
+}
+MetadataBox;
+
+typedef struct
+{
+   GArray*      boxes;
+   gdouble      translate_x, translate_y, scale_x, scale_y;
+   gboolean     in_type;
+}
+MetadataParse;
+
+static const gchar* local_name(const gchar* element_name)
+{
+   const gchar* colon = strrchr(element_name, ':');
+   return colon ? colon + 1 : element_name;
+}
+
+static gdouble attribute_double(const gchar** names, const gchar** values, const gchar* name, gdouble fallback)
+{
+   for (guint i = 0; names[i]; i++)
+   {
+      if (strcmp(names[i], name) == 0)
+      {
+         return g_ascii_strtod(values[i], NULL);
+      }
+   }
+   return fallback;
+}
+
+static void metadata_start_element(GMarkupParseContext* context, const gchar* element_name, const gchar** names, const gchar** values,
+      MetadataParse* parse, GError** error)
+{
+   const gchar* name = local_name(element_name);
+
+   if (strcmp(name, "Object") == 0)
+   {
+      MetadataBox box = { 0 };
+      g_array_append_val(parse->boxes, box);
+      parse->translate_x = parse->translate_y = 0;
+      parse->scale_x = parse->scale_y = 1;
+   }
+   else if (parse->boxes->len == 0)
+   {
+      return;
+   }
+   else if (strcmp(name, "Translate") == 0)
+   {
+      parse->translate_x = attribute_double(names, values, "x", 0);
+      parse->translate_y = attribute_double(names, values, "y", 0);
+   }
+   else if (strcmp(name, "Scale") == 0)
+   {
+      parse->scale_x = attribute_double(names, values, "x", 1);
+      parse->scale_y = attribute_double(names, values, "y", 1);
+   }
+   else if (strcmp(name, "BoundingBox") == 0)
+   {
+      MetadataBox* box = &g_array_index(parse->boxes, MetadataBox, parse->boxes->len - 1);
+
+      /* To the normalized [-1, 1] space, y up */
+      box->left = attribute_double(names, values, "left", 0) * parse->scale_x + parse->translate_x;
+      box->right = attribute_double(names, values, "right", 0) * parse->scale_x + parse->translate_x;
+      box->top = attribute_double(names, values, "top", 0) * parse->scale_y + parse->translate_y;
+      box->bottom = attribute_double(names, values, "bottom", 0) * parse->scale_y + parse->translate_y;
+   }
+   else if (strcmp(name, "Type") == 0)
+   {
+      parse->in_type = TRUE;
+   }
+}
+
+static void metadata_end_element(GMarkupParseContext* context, const gchar* element_name, MetadataParse* parse, GError** error)
+{
+   parse->in_type = FALSE;
+}
+
+static void metadata_text(GMarkupParseContext* context, const gchar* text, gsize length, MetadataParse* parse, GError** error)
+{
+   if (parse->in_type && parse->boxes->len > 0)
+   {
+      MetadataBox* box = &g_array_index(parse->boxes, MetadataBox, parse->boxes->len - 1);
+      g_strlcpy(box->label, text, MIN(length + 1, sizeof(box->label)));
+   }
+}
+
+static const GMarkupParser metadata_parser =
+{
+   (gpointer)metadata_start_element,
+   (gpointer)metadata_end_element,
+   (gpointer)metadata_text,
+   NULL,
+   NULL
+};
+
+/*
+ * One ARGB rectangle over the whole frame, drawn at METADATA_RENDER_WIDTH
+ */
+
+static GstVideoOverlayComposition* metadata_render(GArray* boxes, gint video_width, gint video_height)
+{
+   gint width = METADATA_RENDER_WIDTH, height = METADATA_RENDER_WIDTH * video_height / video_width;
+   gint stride = cairo_format_stride_for_width(CAIRO_FORMAT_ARGB32, width);
+   GstBuffer* buffer = gst_buffer_new_allocate(NULL, stride * height, NULL);
+   GstVideoOverlayRectangle* rectangle;
+   GstVideoOverlayComposition* composition;
+   cairo_surface_t* surface;
+   cairo_t* cr;
+   GstMapInfo map;
+
+   gst_buffer_map(buffer, &map, GST_MAP_WRITE);
+   memset(map.data, 0, map.size);
+   surface = cairo_image_surface_create_for_data(map.data, CAIRO_FORMAT_ARGB32, width, height, stride);
+   cr = cairo_create(surface);
+   cairo_set_line_width(cr, 2);
+   cairo_set_font_size(cr, 14);
+   for (guint i = 0; i < boxes->len; i++)
+   {
+      MetadataBox* box = &g_array_index(boxes, MetadataBox, i);
+      gdouble x = (box->left + 1) / 2 * width, y = (1 - box->top) / 2 * height;
+      gdouble w = (box->right - box->left) / 2 * width, h = (box->top - box->bottom) / 2 * height;
+
+      cairo_set_source_rgba(cr, 0, 1, 0, 0.9);
+      cairo_rectangle(cr, x, y, w, h);
+      cairo_stroke(cr);
+      if (box->label[0])
+      {
+         cairo_move_to(cr, x + 2, y - 4);
+         cairo_show_text(cr, box->label);
+      }
+   }
+   cairo_destroy(cr);
+   cairo_surface_destroy(surface);
+   gst_buffer_unmap(buffer, &map);
+
+   /* Cairo's ARGB32 is premultiplied, native endian */
+   gst_buffer_add_video_meta(buffer, GST_VIDEO_FRAME_FLAG_NONE,
+#if G_BYTE_ORDER == G_LITTLE_ENDIAN
+         GST_VIDEO_FORMAT_BGRA,
+#else
+         GST_VIDEO_FORMAT_ARGB,
+#endif
+         width, height);
+   rectangle = gst_video_overlay_rectangle_new_raw(buffer, 0, 0, video_width, video_height, GST_VIDEO_OVERLAY_FORMAT_FLAG_PREMULTIPLIED_ALPHA);
+   composition = gst_video_overlay_composition_new(rectangle);
+   gst_video_overlay_rectangle_unref(rectangle);
+   gst_buffer_unref(buffer);
+   return composition;
+}
+
+/*
+ * Runs on the metadata pool's thread
+ */
+
+static void metadata_worker(MetadataDoc* doc, CustomData* app)
+{
+   StreamData* stream = doc->stream;
+   MetadataParse parse = { g_array_new(FALSE, FALSE, sizeof(MetadataBox)), 0, 0, 1, 1, FALSE };
+   GMarkupParseContext* context = g_markup_parse_context_new(&metadata_parser, 0, &parse, NULL);
+   gint width = g_atomic_int_get(&stream->video_width), height = g_atomic_int_get(&stream->video_height);
+   gsize size;
+   const gchar* xml = g_bytes_get_data(doc->xml, &size);
+
+   if (g_markup_parse_context_parse(context, xml, size, NULL) && g_markup_parse_context_end_parse(context, NULL) && width > 0 && height > 0)
+   {
+      MetadataOverlay* overlay = g_new0(MetadataOverlay, 1);
+
+      overlay->pts = doc->pts;
+      overlay->composition = parse.boxes->len > 0 ? metadata_render(parse.boxes, width, height) : NULL;
+
+      g_mutex_lock(&stream->metadata_lock);
+      g_queue_push_tail(&stream->metadata_overlays, overlay);
+      while (g_queue_get_length(&stream->metadata_overlays) > METADATA_MAX_OVERLAYS)
+      {
+         metadata_overlay_free(g_queue_pop_head(&stream->metadata_overlays));
+      }
+      g_mutex_unlock(&stream->metadata_lock);
+   }
+
+   g_markup_parse_context_free(context);
+   g_array_free(parse.boxes, TRUE);
+   g_bytes_unref(doc->xml);
+   g_free(doc);
+}
+
+/*
+ * On the metadata session's streaming thread: put the RTP payloads together
+ * into documents
+ */
+
+static GstFlowReturn metadata_new_sample_cb(GstAppSink* appsink, StreamData* stream)
+{
+   GstSample* sample = gst_app_sink_pull_sample(appsink);
+   GstBuffer* buffer;
+   GstRTPBuffer rtp = GST_RTP_BUFFER_INIT;
+
+   if (!sample)
+   {
+      return GST_FLOW_EOS;
+   }
+   buffer = gst_sample_get_buffer(sample);
+   if (gst_rtp_buffer_map(buffer, GST_MAP_READ, &rtp))
+   {
+      if (!stream->metadata_doc)
+      {
+         stream->metadata_doc = g_byte_array_new();
+      }
+      if (stream->metadata_doc->len == 0)
+      {
+         stream->metadata_pts = GST_BUFFER_PTS(buffer);
+      }
+      g_byte_array_append(stream->metadata_doc, gst_rtp_buffer_get_payload(&rtp), gst_rtp_buffer_get_payload_len(&rtp));
+      if (gst_rtp_buffer_get_marker(&rtp))
+      {
+         MetadataDoc* doc = g_new0(MetadataDoc, 1);
+
+         doc->stream = stream;
+         doc->pts = stream->metadata_pts;
+         doc->xml = g_byte_array_free_to_bytes(stream->metadata_doc);
+         stream->metadata_doc = NULL;
+         g_thread_pool_push(stream->app->metadata_pool, doc, NULL);
+      }
+      else if (stream->metadata_doc->len > METADATA_MAX_DOC)
+      {
+         g_byte_array_set_size(stream->metadata_doc, 0);
+      }
+      gst_rtp_buffer_unmap(&rtp);
+   }
+   gst_sample_unref(sample);
+   return GST_FLOW_OK;
+}
+
+static void stream_add_metadata(StreamData* stream, GstElement* source, GstPad* pad)
+{
+   GstElement* pipeline = GST_ELEMENT(gst_element_get_parent(source));
+   GstElement* sink = gst_element_factory_make("appsink", NULL);
+   GstPad* sinkpad = gst_element_get_static_pad(sink, "sink");
+
+   g_object_set(G_OBJECT(sink), "sync", FALSE, "async", FALSE, "emit-signals", TRUE, NULL);
+   g_signal_connect(sink, "new-sample", G_CALLBACK(metadata_new_sample_cb), stream);
+   gst_bin_add(GST_BIN(pipeline), sink);
+   gst_pad_link(pad, sinkpad);
+   gst_element_sync_state_with_parent(sink);
+   gst_object_unref(sinkpad);
+   gst_object_unref(pipeline);
+   g_print("%sMetadata: ONVIF analytics\n", stream->prefix);
+}
+
+static void overlay_caps_changed_cb(GstElement* overlay, GstCaps* caps, guint window_width, guint window_height, StreamData* stream)
+{
+   GstVideoInfo info;
+
+   if (gst_video_info_from_caps(&info, caps))
+   {
+      g_atomic_int_set(&stream->video_width, GST_VIDEO_INFO_WIDTH(&info));
+      g_atomic_int_set(&stream->video_height, GST_VIDEO_INFO_HEIGHT(&info));
+   }
+}
+
+/*
+ * On the video streaming thread, so nothing but a lookup: the newest overlay
+ * not later than the frame
+ */
+
+static GstVideoOverlayComposition* overlay_draw_cb(GstElement* overlay, GstSample* sample, StreamData* stream)
+{
+   GstClockTime pts = GST_BUFFER_PTS(gst_sample_get_buffer(sample));
+   GstVideoOverlayComposition* composition = NULL;
+   MetadataOverlay* head;
+
+   if (!GST_CLOCK_TIME_IS_VALID(pts))
+   {
+      return NULL;
+   }
+   g_mutex_lock(&stream->metadata_lock);
+   while (g_queue_get_length(&stream->metadata_overlays) >= 2 &&
+          ((MetadataOverlay*)g_queue_peek_nth(&stream->metadata_overlays, 1))->pts <= pts)
+   {
+      metadata_overlay_free(g_queue_pop_head(&stream->metadata_overlays));
+   }
+   head = g_queue_peek_head(&stream->metadata_overlays);
+   if (head && head->composition && head->pts <= pts && pts - head->pts < METADATA_EXPIRE)
+   {
+      composition = gst_video_overlay_composition_ref(head->composition);
+   }
+   g_mutex_unlock(&stream->metadata_lock);
+   return composition;
+}
+
+/*
+ * HTTP
+ *
+ * The LL-HLS and WHEP endpoints are served by threaded socket services, one
+ * request per connection. Requests may block for a while (blocking playlist
+ * reload, ICE gathering), so on exit http_stop() wakes them up and waits for
+ * them before the streams go
+ */
+
+#define HTTP_MAX_BODY (64 * 1024)
+
+typedef struct
+{
+   gchar*       method;
+   gchar*       path;                   /* Without the query */
+   gchar*       query;                  /* Or "" */
+   gchar*       body;                   /* Zero terminated, or NULL */
+}
+HttpRequest;
+
+static void http_request_clear(HttpRequest* request)
+{
+   g_free(request->method);
+   g_free(request->path);
+   g_free(request->query);
+   g_free(request->body);
+}
+
+static gboolean http_read_request(GDataInputStream* in, HttpRequest* request)
+{
+   gchar* line = g_data_input_stream_read_line(in, NULL, NULL, NULL);
+   gchar** words = g_strsplit(line ? line : "", " ", 3);
+   gsize length = 0;
+   gboolean ok = g_strv_length(words) >= 2;
+
+   memset(request, 0, sizeof(*request));
+   if (ok)
+   {
+      gchar* query = strchr(words[1], '?');
+
+      request->method = g_strdup(words[0]);
+      request->path = g_strndup(words[1], query ? (gsize)(query - words[1]) : strlen(words[1]));
+      request->query = g_strdup(query ? query + 1 : "");
+   }
+   g_strfreev(words);
+   g_free(line);
+
+   while ((line = g_data_input_stream_read_line(in, NULL, NULL, NULL)) != NULL && line[0] != '\r' && line[0] != '\0')
+   {
+      if (g_ascii_strncasecmp(line, "Content-Length:", 15) == 0)
+      {
+         length = strtoul(line + 15, NULL, 10);
+      }
+      g_free(line);
+   }
+   g_free(line);
+
+   if (ok && length > 0 && length <= HTTP_MAX_BODY)
+   {
+      request->body = g_malloc0(length + 1);
+      ok = g_input_stream_read_all(G_INPUT_STREAM(in), request->body, length, NULL, NULL, NULL);
+   }
+   return ok;
+}
+
+static void http_respond(GOutputStream* out, guint status, const gchar* type, const gchar* headers, gconstpointer data, gsize size)
+{
+   const gchar* reason = status == 200 ? "OK" : status == 201 ? "Created" : status == 204 ? "No Content" :
+         status == 400 ? "Bad Request" : status == 503 ? "Service Unavailable" : "Not Found";
+   gchar* header = g_strdup_printf("HTTP/1.1 %u %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\n%s"
+         "Cache-Control: no-cache\r\nAccess-Control-Allow-Origin: *\r\nAccess-Control-Expose-Headers: Location\r\nConnection: close\r\n\r\n",
+         status, reason, type, size, headers ? headers : "");
+
+   if (g_output_stream_write_all(out, header, strlen(header), NULL, NULL, NULL) && size > 0)
+   {
+      g_output_stream_write_all(out, data, size, NULL, NULL, NULL);
+   }
+   g_free(header);
+}
+
+/*
+ * The stream of "/input<N>/...", and the rest of the path
+ */
+
+static StreamData* http_stream(CustomData* app, const gchar* path, const gchar** rest)
+{
+   guint index = 0;
+   gint offset = 0;
+
+   if (sscanf(path, "/input%u/%n", &index, &offset) == 1 && offset > 0 && index >= 1 && index <= app->streams->len)
+   {
+      *rest = path + offset;
+      return g_ptr_array_index(app->streams, index - 1);
+   }
+   return NULL;
+}
+
+static void http_connection_begin(CustomData* app, GSocketConnection* connection)
+{
+   g_mutex_lock(&app->http_lock);
+   app->http_connections++;
+   g_mutex_unlock(&app->http_lock);
+   g_socket_set_timeout(g_socket_connection_get_socket(connection), 10);
+}
+
+static void http_connection_end(CustomData* app)
+{
+   g_mutex_lock(&app->http_lock);
+   if (--app->http_connections == 0)
+   {
+      g_cond_signal(&app->http_idle);
+   }
+   g_mutex_unlock(&app->http_lock);
+}
+
+/*
+ * LL-HLS output
+ *
+ * With --hls-port the depayloaded H.264 is teed off, before the decoder, into
+ * h264parse ! cmafmux ! appsink. cmafmux cuts a fragment at the first keyframe
+ * after a second and a chunk every --hls-part ms; the fragments are the HLS
+ * segments, the chunks its parts. No re-encoding and no second RTSP session
+ * to the camera. A threaded socket service serves the playlists with blocking
+ * reload (_HLS_msn/_HLS_part), the init segment, parts and segments:
+ *
+ *   /input<N>/index.m3u8, /input<N>/init.mp4, /input<N>/<msn>.<part>.m4s and
+ *   /input<N>/<msn>.m4s
+ *
+ * The publish latency is the time from the last frame of a part leaving the
+ * depayloader to the part being available to the HTTP threads
+ */
+
+#define HLS_BLOCK_TIMEOUT (6 * G_TIME_SPAN_SECOND)
+
+static GstPadProbeReturn hls_input_probe(GstPad* pad, GstPadProbeInfo* info, StreamData* stream)
+{
+   HlsOutput* hls = stream->hls;
+
+   g_mutex_lock(&hls->lock);
+   hls->input_pts[hls->input_head] = GST_BUFFER_PTS(GST_PAD_PROBE_INFO_BUFFER(info));
+   hls->input_time[hls->input_head] = g_get_monotonic_time();
+   hls->input_head = (hls->input_head + 1) % HLS_INPUT_RING;
+   g_mutex_unlock(&hls->lock);
+   return GST_PAD_PROBE_OK;
+}
+
+/*
+ * When the last frame before end went into the muxer, or 0. With the lock
+ * held
+ */
+
+static gint64 hls_input_time_locked(HlsOutput* hls, GstClockTime end)
+{
+   GstClockTime best = GST_CLOCK_TIME_NONE;
+   gint64 time = 0;
+
+   for (guint i = 0; i < HLS_INPUT_RING; i++)
+   {
+      GstClockTime pts = hls->input_pts[i];
+
+      if (hls->input_time[i] && GST_CLOCK_TIME_IS_VALID(pts) && pts < end && (!GST_CLOCK_TIME_IS_VALID(best) || pts > best))
+      {
+         best = pts;
+         time = hls->input_time[i];
+      }
+   }
+   return time;
+}
+
+static void hls_add_bytes(GByteArray* bytes, GstBuffer* buffer, GstClockTime* start, GstClockTime* end)
+{
+   GstMapInfo map;
+
+   if (GST_BUFFER_PTS_IS_VALID(buffer))
+   {
+      *start = GST_CLOCK_TIME_IS_VALID(*start) ? MIN(*start, GST_BUFFER_PTS(buffer)) : GST_BUFFER_PTS(buffer);
+      if (GST_BUFFER_DURATION_IS_VALID(buffer))
+      {
+         *end = GST_CLOCK_TIME_IS_VALID(*end) ? MAX(*end, GST_BUFFER_PTS(buffer) + GST_BUFFER_DURATION(buffer)) : GST_BUFFER_PTS(buffer) + GST_BUFFER_DURATION(buffer);
+      }
+   }
+   gst_buffer_map(buffer, &map, GST_MAP_READ);
+   g_byte_array_append(bytes, map.data, map.size);
+   gst_buffer_unmap(buffer, &map);
+}
+
+/*
+ * On the muxer's streaming thread: every sample is a chunk (moof + mdat),
+ * which becomes a part. A part starting with a keyframe starts a segment
+ */
+
+static GstFlowReturn hls_new_sample_cb(GstAppSink* appsink, StreamData* stream)
+{
+   HlsOutput* hls = stream->hls;
+   GstSample* sample = gst_app_sink_pull_sample(appsink);
+   GstBufferList* list;
+   GstBuffer* first;
+   GByteArray* bytes;
+   GstClockTime start = GST_CLOCK_TIME_NONE, end = GST_CLOCK_TIME_NONE;
+   HlsPart* part;
+   HlsSegment* segment;
+   gint64 input_time;
+
+   if (!sample)
+   {
+      return GST_FLOW_EOS;
+   }
+
+   bytes = g_byte_array_new();
+   list = gst_sample_get_buffer_list(sample);
+   if (list)
+   {
+      first = gst_buffer_list_get(list, 0);
+      for (guint i = 0; i < gst_buffer_list_length(list); i++)
+      {
+         hls_add_bytes(bytes, gst_buffer_list_get(list, i), &start, &end);
+      }
+   }
+   else
+   {
+      first = gst_sample_get_buffer(sample);
+      hls_add_bytes(bytes, first, &start, &end);
+   }
+
+   part = g_new0(HlsPart, 1);
+   part->data = g_byte_array_free_to_bytes(bytes);
+   part->duration = GST_CLOCK_TIME_IS_VALID(start) && GST_CLOCK_TIME_IS_VALID(end) ? (end - start) / 1e9 : opt_hls_part / 1e3;
+   part->independent = first && !GST_BUFFER_FLAG_IS_SET(first, GST_BUFFER_FLAG_DELTA_UNIT);
+
+   g_mutex_lock(&hls->lock);
+   if (!hls->init)
+   {
+      /* cmafmux puts the moov in the caps */
+      const GValue* headers = gst_structure_get_value(gst_caps_get_structure(gst_sample_get_caps(sample), 0), "streamheader");
+
+      if (headers && gst_value_array_get_size(headers) > 0)
+      {
+         GstBuffer* header = gst_value_get_buffer(gst_value_array_get_value(headers, 0));
+         GstMapInfo map;
+
+         gst_buffer_map(header, &map, GST_MAP_READ);
+         hls->init = g_bytes_new(map.data, map.size);
+         gst_buffer_unmap(header, &map);
+      }
+   }
+   segment = g_queue_peek_tail(&hls->segments);
+   if (!segment && !part->independent)
+   {
+      /* Wait for a keyframe */
+      g_mutex_unlock(&hls->lock);
+      hls_part_free(part);
+      gst_sample_unref(sample);
+      return GST_FLOW_OK;
+   }
+   if (!segment || (part->independent && segment->parts->len > 0))
+   {
+      if (segment)
+      {
+         segment->complete = TRUE;
+         hls->max_duration = MAX(hls->max_duration, segment->duration);
+      }
+      segment = g_new0(HlsSegment, 1);
+      segment->msn = hls->next_msn++;
+      segment->parts = g_ptr_array_new_with_free_func((GDestroyNotify)hls_part_free);
+      g_queue_push_tail(&hls->segments, segment);
+      while (g_queue_get_length(&hls->segments) > HLS_SEGMENTS + 1)
+      {
+         hls_segment_free(g_queue_pop_head(&hls->segments));
+      }
+   }
+   g_ptr_array_add(segment->parts, part);
+   segment->duration += part->duration;
+
+   input_time = GST_CLOCK_TIME_IS_VALID(end) ? hls_input_time_locked(hls, end) : 0;
+   if (input_time)
+   {
+      gint64 latency = g_get_monotonic_time() - input_time;
+
+      hls->latency_sum += latency;
+      hls->latency_max = MAX(hls->latency_max, latency);
+      hls->latency_count++;
+   }
+   g_cond_broadcast(&hls->cond);
+   g_mutex_unlock(&hls->lock);
+
+   gst_sample_unref(sample);
+   return GST_FLOW_OK;
+}
+
+/*
+ * tee ! queue ! h264parse ! cmafmux ! appsink. Fails when the elements
+ * aren't there (cmafmux is in gst-plugins-rs)
+ */
+
+static gboolean stream_add_hls(StreamData* stream, GstElement* pipeline, GstElement* tee)
+{
+   gchar* name = g_strconcat(stream->prefix, "hlsmux", NULL);
+   GstElement* queue = gst_element_factory_make("queue", NULL);
+   GstElement* parse = gst_element_factory_make("h264parse", NULL);
+   GstElement* mux = gst_element_factory_make("cmafmux", name);
+   GstElement* sink = gst_element_factory_make("appsink", NULL);
+   GstPad* pad;
+
+   g_free(name);
+   if (!queue || !parse || !mux || !sink)
+   {
+      g_warning("Failed to create the LL-HLS elements (cmafmux needs gst-plugins-rs)!");
+      g_clear_object(&queue);
+      g_clear_object(&parse);
+      g_clear_object(&mux);
+      g_clear_object(&sink);
+      return FALSE;
+   }
+
+   /* Never hold up the decoder */
+   g_object_set(G_OBJECT(queue), "leaky", 2, "max-size-buffers", 0, "max-size-bytes", 0, "max-size-time", 2 * GST_SECOND, NULL);
+   g_object_set(G_OBJECT(mux), "fragment-duration", GST_SECOND, "chunk-duration", opt_hls_part * GST_MSECOND, NULL);
+   g_object_set(G_OBJECT(sink), "sync", FALSE, "async", FALSE, "emit-signals", TRUE, NULL);
+   g_signal_connect(sink, "new-sample", G_CALLBACK(hls_new_sample_cb), stream);
+
+   gst_bin_add_many(GST_BIN(pipeline), queue, parse, mux, sink, NULL);
+   if (!gst_element_link_many(tee, queue, parse, mux, sink, NULL))
+   {
+      g_warning("Failed to link the LL-HLS elements!");
+      return FALSE;
+   }
+   pad = gst_element_get_static_pad(queue, "sink");
+   gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, (GstPadProbeCallback)hls_input_probe, stream, NULL);
+   gst_object_unref(pad);
+   return TRUE;
+}
+
+static void hls_report(StreamData* stream)
+{
+   HlsOutput* hls = stream->hls;
+   guint count, requests, msn;
+   gint64 sum, max;
+
+   if (!hls)
+   {
+      return;
+   }
+   g_mutex_lock(&hls->lock);
+   count = hls->latency_count;
+   sum = hls->latency_sum;
+   max = hls->latency_max;
+   requests = hls->requests;
+   msn = hls->next_msn;
+   hls->latency_count = hls->requests = 0;
+   hls->latency_sum = hls->latency_max = 0;
+   g_mutex_unlock(&hls->lock);
+   if (opt_verbose && count > 0)
+   {
+      g_print("%sHLS: %u parts, publish latency avg %.1fms, max %.1fms, segment %u, %u requests\n", stream->prefix, count, sum / 1e3 / count, max / 1e3, msn, requests);
+   }
+}
+
+/*
+ * Whether part (or with part < 0 the whole segment) msn is there. With the
+ * lock held
+ */
+
+static gboolean hls_has_locked(HlsOutput* hls, guint msn, gint part)
+{
+   HlsSegment* last = g_queue_peek_tail(&hls->segments);
+
+   if (!last)
+   {
+      return FALSE;
+   }
+   if (msn != last->msn)
+   {
+      return msn < last->msn;
+   }
+   return part >= 0 && (guint)part < last->parts->len;
+}
+
+static HlsSegment* hls_find_locked(HlsOutput* hls, guint msn)
+{
+   for (GList* l = hls->segments.head; l; l = l->next)
+   {
+      if (((HlsSegment*)l->data)->msn == msn)
+      {
+         return l->data;
+      }
+   }
+   return NULL;
+}
+
+/*
+ * Blocking reload and preload hints: wait for the part to be published
+ */
+
+static gboolean hls_wait_locked(HlsOutput* hls, guint msn, gint part)
+{
+   gint64 end = g_get_monotonic_time() + HLS_BLOCK_TIMEOUT;
+
+   while (!hls_has_locked(hls, msn, part) && !hls->stopped)
+   {
+      if (!g_cond_wait_until(&hls->cond, &hls->lock, end))
+      {
+         return FALSE;
+      }
+   }
+   return !hls->stopped;
+}
+
+static GString* hls_playlist_locked(HlsOutput* hls)
+{
+   GString* playlist = g_string_new("#EXTM3U\n#EXT-X-VERSION:9\n");
+   HlsSegment* first = g_queue_peek_head(&hls->segments);
+   HlsSegment* last = g_queue_peek_tail(&hls->segments);
+
+   g_string_append_printf(playlist, "#EXT-X-TARGETDURATION:%u\n", MAX(1, (guint)(hls->max_duration + 0.999)));
+   g_string_append_printf(playlist, "#EXT-X-PART-INF:PART-TARGET=%.3f\n", opt_hls_part / 1e3);
+   g_string_append_printf(playlist, "#EXT-X-SERVER-CONTROL:CAN-BLOCK-RELOAD=YES,PART-HOLD-BACK=%.3f\n", 3 * opt_hls_part / 1e3);
+   g_string_append_printf(playlist, "#EXT-X-MEDIA-SEQUENCE:%u\n", first ? first->msn : 0);
+   g_string_append(playlist, "#EXT-X-MAP:URI=\"init.mp4\"\n");
+   for (GList* l = hls->segments.head; l; l = l->next)
+   {
+      HlsSegment* segment = l->data;
+
+      /* Parts are only listed for the last segments */
+      if (segment->msn + 2 >= last->msn)
+      {
+         for (guint i = 0; i < segment->parts->len; i++)
+         {
+            HlsPart* part = g_ptr_array_index(segment->parts, i);
+
+            g_string_append_printf(playlist, "#EXT-X-PART:DURATION=%.3f,URI=\"%u.%u.m4s\"%s\n", part->duration, segment->msn, i,
+                  part->independent ? ",INDEPENDENT=YES" : "");
+         }
+      }
+      if (segment->complete)
+      {
+         g_string_append_printf(playlist, "#EXTINF:%.3f,\n%u.m4s\n", segment->duration, segment->msn);
+      }
+   }
+   if (last)
+   {
+      g_string_append_printf(playlist, "#EXT-X-PRELOAD-HINT:TYPE=PART,URI=\"%u.%u.m4s\"\n", last->msn, last->parts->len);
+   }
+   return playlist;
+}
+
+/*
+ * One request per connection, on a thread of the socket service
+ */
+
+static gboolean hls_serve(GThreadedSocketService* service, GSocketConnection* connection, GObject* source, CustomData* app)
+{
+   GDataInputStream* in = g_data_input_stream_new(g_io_stream_get_input_stream(G_IO_STREAM(connection)));
+   GOutputStream* out = g_io_stream_get_output_stream(G_IO_STREAM(connection));
+   HttpRequest request;
+   StreamData* stream;
+   const gchar* file;
+   guint msn = 0;
+   gint part = -1;
+   HlsOutput* hls = NULL;
+   GBytes* body = NULL;
+   const gchar* type = "video/mp4";
+   GString* playlist = NULL;
+
+   http_connection_begin(app, connection);
+   if (http_read_request(in, &request) && strcmp(request.method, "GET") == 0 &&
+       (stream = http_stream(app, request.path, &file)) != NULL)
+   {
+      hls = stream->hls;
+      g_mutex_lock(&hls->lock);
+      hls->requests++;
+      if (strcmp(file, "index.m3u8") == 0)
+      {
+         gchar* msn_arg = strstr(request.query, "_HLS_msn=");
+         gchar* part_arg = strstr(request.query, "_HLS_part=");
+
+         /* On timeout the playlist as it is */
+         if (msn_arg)
+         {
+            hls_wait_locked(hls, strtoul(msn_arg + 9, NULL, 10), part_arg ? atoi(part_arg + 10) : -1);
+         }
+         if (!hls->stopped)
+         {
+            playlist = hls_playlist_locked(hls);
+            type = "application/vnd.apple.mpegurl";
+         }
+      }
+      else if (strcmp(file, "init.mp4") == 0)
+      {
+         body = hls->init ? g_bytes_ref(hls->init) : NULL;
+      }
+      else if (sscanf(file, "%u.%d.m4s", &msn, &part) == 2 && part >= 0)
+      {
+         HlsSegment* segment;
+
+         if (hls_wait_locked(hls, msn, part) && (segment = hls_find_locked(hls, msn)) != NULL && (guint)part < segment->parts->len)
+         {
+            body = g_bytes_ref(((HlsPart*)g_ptr_array_index(segment->parts, part))->data);
+         }
+      }
+      else if (sscanf(file, "%u.m4s", &msn) == 1)
+      {
+         HlsSegment* segment = hls_find_locked(hls, msn);
+
+         if (segment && segment->complete)
+         {
+            GByteArray* bytes = g_byte_array_new();
+
+            for (guint i = 0; i < segment->parts->len; i++)
+            {
+               gsize size;
+               gconstpointer data = g_bytes_get_data(((HlsPart*)g_ptr_array_index(segment->parts, i))->data, &size);
+               g_byte_array_append(bytes, data, size);
+            }
+            body = g_byte_array_free_to_bytes(bytes);
+         }
+      }
+      g_mutex_unlock(&hls->lock);
+   }
+
+   if (playlist)
+   {
+      http_respond(out, 200, type, NULL, playlist->str, playlist->len);
+      g_string_free(playlist, TRUE);
+   }
+   else if (body)
+   {
+      gsize size;
+      gconstpointer data = g_bytes_get_data(body, &size);
+
+      http_respond(out, 200, type, NULL, data, size);
+      g_bytes_unref(body);
+   }
+   else
+   {
+      http_respond(out, 404, "text/plain", NULL, NULL, 0);
+   }
+
+   http_request_clear(&request);
+   g_object_unref(in);
+   http_connection_end(app);
+   return TRUE;
+}
+
+/*
+ * WebRTC output (WHEP)
+ *
+ * With --whep-port a browser, or any WHEP player, POSTs its SDP offer to
+ * /input<N>/whep and gets the answer, with all ICE candidates (no trickle).
+ * Each viewer gets its own branch from the tee after the depayloader:
+ * queue ! rtph264pay ! webrtcbin, so the camera's H.264 goes out as it came
+ * in. DELETE on the returned Location ends it.
+ *
+ * Without re-encoding the only answer to congestion is sending less until
+ * the next keyframe: on a REMB below the viewer's bitrate, or TWCC reporting
+ * loss or a growing delay, the viewer's branch drops delta frames and a
+ * keyframe is requested upstream, which the depayloader turns into a PLI to
+ * the camera. PLIs of the viewer itself take the same way.
+ *
+ * Each access unit gets an SEI (user data unregistered) with the wall clock
+ * time it left the depayloader. --whep-test plays a stream back through a
+ * webrtcbin in this process and reports the end-to-end latency from it
+ */
+
+#define WHEP_TWCC_URI "http://www.ietf.org/id/draft-holmer-rmcat-transport-wide-cc-extensions-01"
+#define WHEP_GATHER_TIMEOUT (3 * G_TIME_SPAN_SECOND)
+#define WHEP_MAX_LOSS_PCT 5.0
+#define WHEP_MAX_DELTA_OF_DELTA (10 * GST_MSECOND)
+
+/* Our timestamps. No two zero bytes in a row, so never escaped */
+static const guint8 sei_timestamp_uuid[16] =
+{
+   0x6c, 0x6c, 0x2d, 0x6c, 0x69, 0x76, 0x65, 0x2d, 0x74, 0x69, 0x6d, 0x65, 0x73, 0x74, 0x61, 0x6d
+};
+
+struct _WhepViewer
+{
+   StreamData*  stream;
+   guint        id;
+   GstElement*  queue;
+   GstElement*  pay;
+   GstElement*  webrtc;
+   GstPad*      tee_pad;
+   GstElement*  pipeline;
+
+   GMutex       lock;
+   GCond        cond;                   /* ICE gathering complete */
+   gboolean     gathered;
+   gint64       keyframe_request_time;  /* Protected by lock */
+
+   gint         congested;              /* Atomic: drop delta frames until a keyframe */
+   gint         avc;                    /* Input is length prefixed, -1 = don't know yet */
+   gint64       window_start;           /* Streaming thread, for the bitrate */
+   gsize        window_bytes;
+   gint         bitrate;                /* Atomic, bits per second */
+};
+
+static gint whep_next_id = 1;
+
+/*
+ * Emulation prevention: no 00 00 0x (x <= 3) in the NAL unit
+ */
+
+static void sei_escape(GByteArray* out, const guint8* data, gsize size)
+{
+   guint zeros = 0;
+
+   for (gsize i = 0; i < size; i++)
+   {
+      if (zeros >= 2 && data[i] <= 3)
+      {
+         static const guint8 three = 3;
+         g_byte_array_append(out, &three, 1);
+         zeros = 0;
+      }
+      g_byte_array_append(out, &data[i], 1);
+      zeros = data[i] == 0 ? zeros + 1 : 0;
+   }
+}
+
+static void sei_timestamp_nal(GByteArray* nal, gint64 timestamp)
+{
+   guint8 payload[2 + sizeof(sei_timestamp_uuid) + 8];
+   static const guint8 header = 0x06, trailing = 0x80;
+
+   payload[0] = 5;                           /* user_data_unregistered */
+   payload[1] = sizeof(sei_timestamp_uuid) + 8;
+   memcpy(payload + 2, sei_timestamp_uuid, sizeof(sei_timestamp_uuid));
+   for (guint i = 0; i < 8; i++)
+   {
+      payload[2 + sizeof(sei_timestamp_uuid) + i] = timestamp >> (56 - 8 * i);
+   }
+   g_byte_array_append(nal, &header, 1);
+   sei_escape(nal, payload, sizeof(payload));
+   g_byte_array_append(nal, &trailing, 1);
+}
+
+/*
+ * Finds our timestamp in an access unit, either format
+ */
+
+static gboolean sei_find_timestamp(const guint8* data, gsize size, gint64* timestamp)
+{
+   for (gsize i = 0; i + sizeof(sei_timestamp_uuid) < size; i++)
+   {
+      if (memcmp(data + i, sei_timestamp_uuid, sizeof(sei_timestamp_uuid)) == 0)
+      {
+         gsize pos = i + sizeof(sei_timestamp_uuid);
+         guint zeros = 0, got = 0;
+
+         *timestamp = 0;
+         for (; pos < size && got < 8; pos++)
+         {
+            if (zeros >= 2 && data[pos] == 3)
+            {
+               zeros = 0;
+               continue;
+            }
+            *timestamp = (*timestamp << 8) | data[pos];
+            zeros = data[pos] == 0 ? zeros + 1 : 0;
+            got++;
+         }
+         return got == 8;
+      }
+   }
+   return FALSE;
+}
+
+/*
+ * The access unit with the SEI before its first slice. Only the SEI is new
+ * memory, the rest shares the original's, so a large I-frame isn't copied for
+ * every viewer
+ */
+
+static GstBuffer* sei_insert_timestamp(GstBuffer* buffer, gboolean avc, gint64 timestamp)
+{
+   static const guint8 start_code[4] = { 0, 0, 0, 1 };
+   GByteArray* sei = g_byte_array_new();
+   GstBuffer* result;
+   GstMapInfo map;
+   gsize offset = 0, insert_at = 0, size;
+   gboolean found = FALSE;
+   guint8* data;
+
+   if (!gst_buffer_map(buffer, &map, GST_MAP_READ))
+   {
+      g_byte_array_unref(sei);
+      return gst_buffer_ref(buffer);
+   }
+
+   /* Where the first VCL NAL unit starts, including its length or start code */
+   while (!found && offset + 4 < map.size)
+   {
+      if (avc)
+      {
+         gsize length = GST_READ_UINT32_BE(map.data + offset);
+
+         if ((map.data[offset + 4] & 0x1f) >= 1 && (map.data[offset + 4] & 0x1f) <= 5)
+         {
+            insert_at = offset;
+            found = TRUE;
+         }
+         offset += 4 + length;
+      }
+      else if (map.data[offset] == 0 && map.data[offset + 1] == 0 && map.data[offset + 2] == 1)
+      {
+         guint type = map.data[offset + 3] & 0x1f;
+
+         if (type >= 1 && type <= 5)
+         {
+            insert_at = offset > 0 && map.data[offset - 1] == 0 ? offset - 1 : offset;
+            found = TRUE;
+         }
+         offset += 3;
+      }
+      else
+      {
+         offset++;
+      }
+   }
+   gst_buffer_unmap(buffer, &map);
+
+   /* Length prefix or start code, then the NAL unit */
+   g_byte_array_append(sei, start_code, 4);
+   sei_timestamp_nal(sei, timestamp);
+   if (avc)
+   {
+      GST_WRITE_UINT32_BE(sei->data, sei->len - 4);
+   }
+   size = sei->len;
+   data = g_byte_array_free(sei, FALSE);
+
+   result = gst_buffer_new();
+   gst_buffer_copy_into(result, buffer, GST_BUFFER_COPY_METADATA, 0, -1);
+   if (insert_at > 0)
+   {
+      result = gst_buffer_append(result, gst_buffer_copy_region(buffer, GST_BUFFER_COPY_MEMORY, 0, insert_at));
+   }
+   gst_buffer_append_memory(result, gst_memory_new_wrapped(0, data, size, 0, size, data, g_free));
+   return gst_buffer_append(result, gst_buffer_copy_region(buffer, GST_BUFFER_COPY_MEMORY, insert_at, -1));
+}
+
+/*
+ * On the depayloader's streaming thread, for each viewer: congestion drops,
+ * the bitrate and the timestamp
+ */
+
+static GstPadProbeReturn whep_input_probe(GstPad* pad, GstPadProbeInfo* info, WhepViewer* viewer)
+{
+   GstBuffer* buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+   gint64 now = g_get_monotonic_time();
+
+   if (GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT))
+   {
+      if (g_atomic_int_get(&viewer->congested))
+      {
+         return GST_PAD_PROBE_DROP;
+      }
+   }
+   else
+   {
+      g_atomic_int_set(&viewer->congested, 0);
+   }
+
+   viewer->window_bytes += gst_buffer_get_size(buffer);
+   if (now - viewer->window_start >= G_USEC_PER_SEC)
+   {
+      g_atomic_int_set(&viewer->bitrate, viewer->window_bytes * 8 * G_USEC_PER_SEC / MAX(now - viewer->window_start, 1));
+      viewer->window_start = now;
+      viewer->window_bytes = 0;
+   }
+
+   if (viewer->avc < 0)
+   {
+      GstCaps* caps = gst_pad_get_current_caps(pad);
+      const gchar* format = caps ? gst_structure_get_string(gst_caps_get_structure(caps, 0), "stream-format") : NULL;
+
+      viewer->avc = g_strcmp0(format, "byte-stream") != 0;
+      if (caps)
+      {
+         gst_caps_unref(caps);
+      }
+   }
+   GST_PAD_PROBE_INFO_DATA(info) = sei_insert_timestamp(buffer, viewer->avc, g_get_real_time());
+   gst_buffer_unref(buffer);
+   return GST_PAD_PROBE_OK;
+}
+
+static void whep_congestion(WhepViewer* viewer, const gchar* reason)
+{
+   gint64 now = g_get_monotonic_time();
+   gboolean request;
+
+   g_atomic_int_set(&viewer->congested, 1);
+   g_mutex_lock(&viewer->lock);
+   request = now - viewer->keyframe_request_time >= G_USEC_PER_SEC;
+   if (request)
+   {
+      viewer->keyframe_request_time = now;
+   }
+   g_mutex_unlock(&viewer->lock);
+   if (request)
+   {
+      g_print("%sWHEP %u: %s, sending keyframes only until the next one\n", viewer->stream->prefix, viewer->id, reason);
+      gst_pad_send_event(viewer->tee_pad, gst_video_event_new_upstream_force_key_unit(GST_CLOCK_TIME_NONE, TRUE, 0));
+   }
+}
+
+/*
+ * REMB: "REMB", number of SSRCs, 6 bit exponent and 18 bit mantissa
+ */
+
+static void whep_feedback_cb(GObject* session, guint type, guint fbtype, guint sender_ssrc, guint media_ssrc, GstBuffer* fci, WhepViewer* viewer)
+{
+   GstMapInfo map;
+
+   if (type != GST_RTCP_TYPE_PSFB || fbtype != GST_RTCP_PSFB_TYPE_AFB || !fci || !gst_buffer_map(fci, &map, GST_MAP_READ))
+   {
+      return;
+   }
+   if (map.size >= 8 && memcmp(map.data, "REMB", 4) == 0)
+   {
+      guint64 remb = (guint64)(((map.data[5] & 0x03) << 16) | (map.data[6] << 8) | map.data[7]) << (map.data[5] >> 2);
+
+      if (remb < (guint64)g_atomic_int_get(&viewer->bitrate))
+      {
+         whep_congestion(viewer, "REMB below the stream's bitrate");
+      }
+   }
+   gst_buffer_unmap(fci, &map);
+}
+
+static void whep_twcc_stats_cb(GObject* session, GParamSpec* pspec, WhepViewer* viewer)
+{
+   GstStructure* stats = NULL;
+   gdouble loss = 0;
+   gint64 delta_of_delta = 0;
+
+   g_object_get(session, "twcc-stats", &stats, NULL);
+   if (!stats)
+   {
+      return;
+   }
+   gst_structure_get_double(stats, "packet-loss-pct", &loss);
+   gst_structure_get_int64(stats, "avg-delta-of-delta", &delta_of_delta);
+   if (loss > WHEP_MAX_LOSS_PCT)
+   {
+      whep_congestion(viewer, "TWCC packet loss");
+   }
+   else if (delta_of_delta > WHEP_MAX_DELTA_OF_DELTA)
+   {
+      whep_congestion(viewer, "TWCC delay growing");
+   }
+   gst_structure_free(stats);
+}
+
+static void whep_gathering_cb(GstElement* webrtc, GParamSpec* pspec, WhepViewer* viewer)
+{
+   GstWebRTCICEGatheringState state;
+
+   g_object_get(webrtc, "ice-gathering-state", &state, NULL);
+   if (state == GST_WEBRTC_ICE_GATHERING_STATE_COMPLETE)
+   {
+      g_mutex_lock(&viewer->lock);
+      viewer->gathered = TRUE;
+      g_cond_broadcast(&viewer->cond);
+      g_mutex_unlock(&viewer->lock);
+   }
+}
+
+/*
+ * Payload type of the offer's first H.264 and its TWCC extension id (or 0)
+ */
+
+static gint whep_offer_h264(const GstSDPMessage* sdp, guint* twcc_id)
+{
+   gint pt = -1;
+
+   *twcc_id = 0;
+   for (guint i = 0; i < gst_sdp_message_medias_len(sdp); i++)
+   {
+      const GstSDPMedia* media = gst_sdp_message_get_media(sdp, i);
+
+      if (g_strcmp0(gst_sdp_media_get_media(media), "video") != 0)
+      {
+         continue;
+      }
+      for (guint j = 0; j < gst_sdp_media_attributes_len(media); j++)
+      {
+         const GstSDPAttribute* attribute = gst_sdp_media_get_attribute(media, j);
+         gint value;
+         gchar name[128];
+
+         if (pt < 0 && g_strcmp0(attribute->key, "rtpmap") == 0 && sscanf(attribute->value, "%d %127[^/]", &value, name) == 2 &&
+             g_ascii_strcasecmp(name, "H264") == 0)
+         {
+            pt = value;
+         }
+         else if (g_strcmp0(attribute->key, "extmap") == 0 && sscanf(attribute->value, "%d %127s", &value, name) == 2 &&
+                  strcmp(name, WHEP_TWCC_URI) == 0)
+         {
+            *twcc_id = value;
+         }
+      }
+      break;
+   }
+   return pt;
+}
+
+static GstWebRTCSessionDescription* whep_promise_wait(GstElement* webrtc, const gchar* signal, gpointer argument, const gchar* field)
+{
+   GstPromise* promise = gst_promise_new();
+   GstWebRTCSessionDescription* description = NULL;
+
+   g_signal_emit_by_name(webrtc, signal, argument, promise);
+   if (gst_promise_wait(promise) == GST_PROMISE_RESULT_REPLIED && field)
+   {
+      const GstStructure* reply = gst_promise_get_reply(promise);
+      if (reply)
+      {
+         gst_structure_get(reply, field, GST_TYPE_WEBRTC_SESSION_DESCRIPTION, &description, NULL);
+      }
+   }
+   gst_promise_unref(promise);
+   return description;
+}
+
+static void whep_viewer_free(WhepViewer* viewer)
+{
+   if (viewer->tee_pad)
+   {
+      gst_object_unref(viewer->tee_pad);
+   }
+   if (viewer->pipeline)
+   {
+      gst_object_unref(viewer->pipeline);
+   }
+   g_cond_clear(&viewer->cond);
+   g_mutex_clear(&viewer->lock);
+   g_free(viewer);
+}
+
+/*
+ * Runs on a GStreamer thread, the branch is unlinked by then
+ */
+
+static void whep_viewer_dispose(GstElement* pipeline, WhepViewer* viewer)
+{
+   GstElement* elements[] = { viewer->webrtc, viewer->pay, viewer->queue };
+
+   for (guint i = 0; i < G_N_ELEMENTS(elements); i++)
+   {
+      gst_element_set_state(elements[i], GST_STATE_NULL);
+      gst_bin_remove(GST_BIN(pipeline), elements[i]);
+   }
+   gst_element_release_request_pad(g_atomic_pointer_get(&viewer->stream->tee), viewer->tee_pad);
+   whep_viewer_free(viewer);
+}
+
+static GstPadProbeReturn whep_unlink_probe(GstPad* pad, GstPadProbeInfo* info, WhepViewer* viewer)
+{
+   GstPad* peer = gst_pad_get_peer(pad);
+
+   if (peer)
+   {
+      gst_pad_unlink(pad, peer);
+      gst_object_unref(peer);
+   }
+   gst_element_call_async(viewer->pipeline, (GstElementCallAsyncFunc)whep_viewer_dispose, viewer, NULL);
+   return GST_PAD_PROBE_REMOVE;
+}
+
+/*
+ * Takes the viewer out of the list. The branch goes when the tee is between
+ * two buffers
+ */
+
+static void whep_viewer_remove(WhepViewer* viewer)
+{
+   StreamData* stream = viewer->stream;
+
+   g_mutex_lock(&stream->lock);
+   stream->whep_viewers = g_list_remove(stream->whep_viewers, viewer);
+   g_mutex_unlock(&stream->lock);
+   gst_pad_add_probe(viewer->tee_pad, GST_PAD_PROBE_TYPE_IDLE, (GstPadProbeCallback)whep_unlink_probe, viewer, NULL);
+}
+
+static void whep_viewer_connect_feedback(WhepViewer* viewer)
+{
+   GstElement* rtpbin = gst_bin_get_by_name(GST_BIN(viewer->webrtc), "rtpbin");
+   GObject* session = NULL;
+
+   if (!rtpbin)
+   {
+      return;
+   }
+   /* Bundled, so everything is in session 0 */
+   g_signal_emit_by_name(rtpbin, "get-internal-session", 0, &session);
+   if (session)
+   {
+      g_signal_connect(session, "on-feedback-rtcp", G_CALLBACK(whep_feedback_cb), viewer);
+      g_signal_connect(session, "notify::twcc-stats", G_CALLBACK(whep_twcc_stats_cb), viewer);
+      g_object_unref(session);
+   }
+   gst_object_unref(rtpbin);
+}
+
+/*
+ * On an HTTP thread: adds the branch and negotiates. Returns the answer or
+ * NULL
+ */
+
+static gchar* whep_viewer_add(StreamData* stream, const gchar* offer_text, guint* id)
+{
+   GstElement* tee = g_atomic_pointer_get(&stream->tee);
+   GstSDPMessage* sdp = NULL;
+   GstWebRTCSessionDescription* offer;
+   GstWebRTCSessionDescription* answer;
+   GstWebRTCSessionDescription* local = NULL;
+   WhepViewer* viewer;
+   GstCaps* caps;
+   GstPad* pad;
+   guint twcc_id;
+   gint pt;
+   gint64 end;
+   gchar* text = NULL;
+
+   if (!tee || !offer_text || gst_sdp_message_new_from_text(offer_text, &sdp) != GST_SDP_OK)
+   {
+      return NULL;
+   }
+   if ((pt = whep_offer_h264(sdp, &twcc_id)) < 0)
+   {
+      gst_sdp_message_free(sdp);
+      return NULL;
+   }
+
+   viewer = g_new0(WhepViewer, 1);
+   viewer->stream = stream;
+   viewer->avc = -1;
+   g_mutex_init(&viewer->lock);
+   g_cond_init(&viewer->cond);
+   viewer->pipeline = GST_ELEMENT(gst_object_get_parent(GST_OBJECT(tee)));
+   viewer->queue = gst_element_factory_make("queue", NULL);
+   viewer->pay = gst_element_factory_make("rtph264pay", NULL);
+   viewer->webrtc = gst_element_factory_make("webrtcbin", NULL);
+   if (!viewer->pipeline || !viewer->queue || !viewer->pay || !viewer->webrtc)
+   {
+      g_warning("Failed to create the WebRTC elements!");
+      g_clear_object(&viewer->queue);
+      g_clear_object(&viewer->pay);
+      g_clear_object(&viewer->webrtc);
+      whep_viewer_free(viewer);
+      gst_sdp_message_free(sdp);
+      return NULL;
+   }
+   viewer->id = g_atomic_int_add(&whep_next_id, 1);
+
+   /* A slow viewer never holds up the decoder */
+   g_object_set(G_OBJECT(viewer->queue), "leaky", 2, "max-size-buffers", 0, "max-size-bytes", 0, "max-size-time", GST_SECOND / 2, NULL);
+   g_object_set(G_OBJECT(viewer->pay), "config-interval", -1, "pt", pt, NULL);
+   gst_util_set_object_arg(G_OBJECT(viewer->pay), "aggregate-mode", "zero-latency");
+   gst_util_set_object_arg(G_OBJECT(viewer->webrtc), "bundle-policy", "max-bundle");
+   if (twcc_id)
+   {
+      GstRTPHeaderExtension* twcc = gst_rtp_header_extension_create_from_uri(WHEP_TWCC_URI);
+      if (twcc)
+      {
+         gst_rtp_header_extension_set_id(twcc, twcc_id);
+         g_signal_emit_by_name(viewer->pay, "add-extension", twcc);
+         gst_object_unref(twcc);
+      }
+   }
+   g_signal_connect(viewer->webrtc, "notify::ice-gathering-state", G_CALLBACK(whep_gathering_cb), viewer);
+
+   gst_bin_add_many(GST_BIN(viewer->pipeline), viewer->queue, viewer->pay, viewer->webrtc, NULL);
+   caps = gst_caps_new_simple("application/x-rtp", "media", G_TYPE_STRING, "video", "encoding-name", G_TYPE_STRING, "H264",
+         "clock-rate", G_TYPE_INT, 90000, "payload", G_TYPE_INT, pt, "rtcp-fb-nack-pli", G_TYPE_BOOLEAN, TRUE,
+         "rtcp-fb-goog-remb", G_TYPE_BOOLEAN, TRUE, "rtcp-fb-transport-cc", G_TYPE_BOOLEAN, TRUE, NULL);
+   gst_element_link(viewer->queue, viewer->pay);
+   gst_element_link_filtered(viewer->pay, viewer->webrtc, caps);
+   gst_caps_unref(caps);
+   if ((pad = gst_element_get_static_pad(viewer->webrtc, "sink_0")) != NULL)
+   {
+      GstWebRTCRTPTransceiver* transceiver = NULL;
+
+      g_object_get(pad, "transceiver", &transceiver, NULL);
+      if (transceiver)
+      {
+         g_object_set(transceiver, "direction", GST_WEBRTC_RTP_TRANSCEIVER_DIRECTION_SENDONLY, NULL);
+         gst_object_unref(transceiver);
+      }
+      gst_object_unref(pad);
+   }
+
+   viewer->tee_pad = gst_element_request_pad_simple(tee, "src_%u");
+   pad = gst_element_get_static_pad(viewer->queue, "sink");
+   gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, (GstPadProbeCallback)whep_input_probe, viewer, NULL);
+   gst_pad_link(viewer->tee_pad, pad);
+   gst_object_unref(pad);
+   gst_element_sync_state_with_parent(viewer->webrtc);
+   gst_element_sync_state_with_parent(viewer->pay);
+   gst_element_sync_state_with_parent(viewer->queue);
+
+   g_mutex_lock(&stream->lock);
+   stream->whep_viewers = g_list_prepend(stream->whep_viewers, viewer);
+   g_mutex_unlock(&stream->lock);
+
+   /* Offer, answer and all candidates in it */
+   offer = gst_webrtc_session_description_new(GST_WEBRTC_SDP_TYPE_OFFER, sdp);
+   whep_promise_wait(viewer->webrtc, "set-remote-description", offer, NULL);
+   gst_webrtc_session_description_free(offer);
+   answer = whep_promise_wait(viewer->webrtc, "create-answer", NULL, "answer");
+   if (answer)
+   {
+      whep_promise_wait(viewer->webrtc, "set-local-description", answer, NULL);
+      gst_webrtc_session_description_free(answer);
+
+      end = g_get_monotonic_time() + WHEP_GATHER_TIMEOUT;
+      g_mutex_lock(&viewer->lock);
+      while (!viewer->gathered && g_cond_wait_until(&viewer->cond, &viewer->lock, end))
+      {
+      }
+      g_mutex_unlock(&viewer->lock);
+
+      g_object_get(viewer->webrtc, "local-description", &local, NULL);
+   }
+   if (!local)
+   {
+      whep_viewer_remove(viewer);
+      return NULL;
+   }
+   text = gst_sdp_message_as_text(local->sdp);
+   gst_webrtc_session_description_free(local);
+   whep_viewer_connect_feedback(viewer);
+   *id = viewer->id;
+   g_print("%sWHEP %u: viewer connected\n", stream->prefix, viewer->id);
+   return text;
+}
+
+static gboolean whep_viewer_delete(StreamData* stream, guint id)
+{
+   WhepViewer* viewer = NULL;
+
+   g_mutex_lock(&stream->lock);
+   for (GList* l = stream->whep_viewers; l; l = l->next)
+   {
+      if (((WhepViewer*)l->data)->id == id)
+      {
+         viewer = l->data;
+      }
+   }
+   g_mutex_unlock(&stream->lock);
+   if (viewer)
+   {
+      g_print("%sWHEP %u: viewer gone\n", stream->prefix, id);
+      whep_viewer_remove(viewer);
+   }
+   return viewer != NULL;
+}
+
+static gboolean whep_serve(GThreadedSocketService* service, GSocketConnection* connection, GObject* source, CustomData* app)
+{
+   GDataInputStream* in = g_data_input_stream_new(g_io_stream_get_input_stream(G_IO_STREAM(connection)));
+   GOutputStream* out = g_io_stream_get_output_stream(G_IO_STREAM(connection));
+   HttpRequest request;
+   StreamData* stream = NULL;
+   const gchar* rest = NULL;
+   guint id = 0;
+
+   http_connection_begin(app, connection);
+   if (http_read_request(in, &request))
+   {
+      stream = http_stream(app, request.path, &rest);
+   }
+   if (!stream)
+   {
+      http_respond(out, 404, "text/plain", NULL, NULL, 0);
+   }
+   else if (strcmp(request.method, "OPTIONS") == 0)
+   {
+      /* CORS preflight of a browser on another origin */
+      http_respond(out, 204, "text/plain", "Access-Control-Allow-Methods: POST, DELETE, OPTIONS\r\nAccess-Control-Allow-Headers: Content-Type\r\n", NULL, 0);
+   }
+   else if (strcmp(request.method, "POST") == 0 && strcmp(rest, "whep") == 0)
+   {
+      gchar* answer = whep_viewer_add(stream, request.body, &id);
+
+      if (answer)
+      {
+         gchar* location = g_strdup_printf("Location: %s/%u\r\n", request.path, id);
+         http_respond(out, 201, "application/sdp", location, answer, strlen(answer));
+         g_free(location);
+         g_free(answer);
+      }
+      else
+      {
+         http_respond(out, g_atomic_pointer_get(&stream->tee) ? 400 : 503, "text/plain", NULL, NULL, 0);
+      }
+   }
+   else if (strcmp(request.method, "DELETE") == 0 && sscanf(rest, "whep/%u", &id) == 1 && whep_viewer_delete(stream, id))
+   {
+      http_respond(out, 200, "text/plain", NULL, NULL, 0);
+   }
+   else
+   {
+      http_respond(out, 404, "text/plain", NULL, NULL, 0);
+   }
+
+   http_request_clear(&request);
+   g_object_unref(in);
+   http_connection_end(app);
+   return TRUE;
+}
+
+/*
+ * --whep-test: a WHEP player in this process. The timestamps in the SEI tell
+ * how long ago the access unit left our depayloader
+ */
+
+static GMutex whep_test_lock;
+static gint64 whep_test_latency_sum;
+static gint64 whep_test_latency_max;
+static guint  whep_test_frames;
+
+static GstPadProbeReturn whep_test_probe(GstPad* pad, GstPadProbeInfo* info, gpointer user_data)
+{
+   GstBuffer* buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+   GstMapInfo map;
+   gint64 timestamp;
+
+   if (gst_buffer_map(buffer, &map, GST_MAP_READ))
+   {
+      if (sei_find_timestamp(map.data, map.size, &timestamp))
+      {
+         gint64 latency = g_get_real_time() - timestamp;
+
+         g_mutex_lock(&whep_test_lock);
+         whep_test_latency_sum += latency;
+         whep_test_latency_max = MAX(whep_test_latency_max, latency);
+         whep_test_frames++;
+         g_mutex_unlock(&whep_test_lock);
+      }
+      gst_buffer_unmap(buffer, &map);
+   }
+   return GST_PAD_PROBE_OK;
+}
+
+static void whep_test_pad_added_cb(GstElement* webrtc, GstPad* pad, GstElement* pipeline)
+{
+   GstElement* depay;
+   GstElement* sink;
+   GstPad* sinkpad;
+
+   if (GST_PAD_DIRECTION(pad) != GST_PAD_SRC)
+   {
+      return;
+   }
+   depay = gst_element_factory_make("rtph264depay", NULL);
+   sink = gst_element_factory_make("fakesink", NULL);
+   g_object_set(G_OBJECT(sink), "sync", FALSE, "async", FALSE, NULL);
+   gst_bin_add_many(GST_BIN(pipeline), depay, sink, NULL);
+   gst_element_link(depay, sink);
+   sinkpad = gst_element_get_static_pad(depay, "sink");
+   gst_pad_link(pad, sinkpad);
+   gst_object_unref(sinkpad);
+   sinkpad = gst_element_get_static_pad(sink, "sink");
+   gst_pad_add_probe(sinkpad, GST_PAD_PROBE_TYPE_BUFFER, whep_test_probe, NULL, NULL);
+   gst_object_unref(sinkpad);
+   gst_element_sync_state_with_parent(depay);
+   gst_element_sync_state_with_parent(sink);
+}
+
+/*
+ * Minimal HTTP/1.1 client for the WHEP signaling. Returns the body of a 2xx
+ * response or NULL, and its Location, made absolute, when asked for
+ */
+
+static gchar* http_client_request(const gchar* method, const gchar* url, const gchar* body, gchar** location, GCancellable* cancellable)
+{
+   GUri* uri = g_uri_parse(url, G_URI_FLAGS_NONE, NULL);
+   GSocketClient* client = g_socket_client_new();
+   GSocketConnection* connection = NULL;
+   gchar* result = NULL;
+
+   if (uri)
+   {
+      gboolean tls = g_strcmp0(g_uri_get_scheme(uri), "https") == 0;
+
+      g_socket_client_set_tls(client, tls);
+      g_socket_client_set_timeout(client, 5);
+      connection = g_socket_client_connect_to_host(client, g_uri_get_host(uri), g_uri_get_port(uri) > 0 ? g_uri_get_port(uri) : (tls ? 443 : 80), cancellable, NULL);
+   }
+   if (connection)
+   {
+      gchar* request = g_strdup_printf("%s %s HTTP/1.1\r\nHost: %s\r\nContent-Type: application/sdp\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n%s",
+            method, g_uri_get_path(uri), g_uri_get_host(uri), body ? strlen(body) : 0, body ? body : "");
+      gchar* response = g_malloc0(HTTP_MAX_BODY + 1);
+      gsize size = 0;
+      guint status = 0;
+      gchar* content;
+
+      g_output_stream_write_all(g_io_stream_get_output_stream(G_IO_STREAM(connection)), request, strlen(request), NULL, cancellable, NULL);
+      g_input_stream_read_all(g_io_stream_get_input_stream(G_IO_STREAM(connection)), response, HTTP_MAX_BODY, &size, cancellable, NULL);
+      if (sscanf(response, "HTTP/1.%*d %u", &status) == 1 && status >= 200 && status < 300 && (content = strstr(response, "\r\n\r\n")) != NULL)
+      {
+         gchar** headers = g_strsplit(response, "\r\n", -1);
+
+         *content = '\0';
+         result = g_strdup(content + 4);
+         for (guint i = 0; location && headers[i]; i++)
+         {
+            if (g_ascii_strncasecmp(headers[i], "Location:", 9) == 0)
+            {
+               *location = g_uri_resolve_relative(url, g_strstrip(headers[i] + 9), G_URI_FLAGS_NONE, NULL);
+            }
+         }
+         g_strfreev(headers);
+      }
+      g_free(response);
+      g_free(request);
+      g_object_unref(connection);
+   }
+   g_object_unref(client);
+   if (uri)
+   {
+      g_uri_unref(uri);
+   }
+   return result;
+}
+
+/*
+ * Client side: the offer, with all candidates (WHEP doesn't trickle)
+ */
+
+static gchar* whep_create_offer(GstElement* webrtc)
+{
+   WhepViewer* gathering = g_new0(WhepViewer, 1);
+   GstWebRTCSessionDescription* offer;
+   GstWebRTCSessionDescription* local = NULL;
+   gchar* text = NULL;
+   gint64 end;
+
+   g_mutex_init(&gathering->lock);
+   g_cond_init(&gathering->cond);
+   g_signal_connect(webrtc, "notify::ice-gathering-state", G_CALLBACK(whep_gathering_cb), gathering);
+   offer = whep_promise_wait(webrtc, "create-offer", NULL, "offer");
+   if (offer)
+   {
+      whep_promise_wait(webrtc, "set-local-description", offer, NULL);
+      gst_webrtc_session_description_free(offer);
+      end = g_get_monotonic_time() + WHEP_GATHER_TIMEOUT;
+      g_mutex_lock(&gathering->lock);
+      while (!gathering->gathered && g_cond_wait_until(&gathering->cond, &gathering->lock, end))
+      {
+      }
+      g_mutex_unlock(&gathering->lock);
+      g_object_get(webrtc, "local-description", &local, NULL);
+   }
+   g_signal_handlers_disconnect_by_data(webrtc, gathering);
+   whep_viewer_free(gathering);
+   if (local)
+   {
+      text = gst_sdp_message_as_text(local->sdp);
+      gst_webrtc_session_description_free(local);
+   }
+   return text;
+}
+
+static gboolean whep_set_answer(GstElement* webrtc, const gchar* text)
+{
+   GstWebRTCSessionDescription* answer;
+   GstSDPMessage* sdp;
+
+   if (!text || gst_sdp_message_new_from_text(text, &sdp) != GST_SDP_OK)
+   {
+      return FALSE;
+   }
+   answer = gst_webrtc_session_description_new(GST_WEBRTC_SDP_TYPE_ANSWER, sdp);
+   whep_promise_wait(webrtc, "set-remote-description", answer, NULL);
+   gst_webrtc_session_description_free(answer);
+   return TRUE;
+}
+
+static void whep_add_transceiver(GstElement* webrtc, const gchar* caps_string)
+{
+   GstCaps* caps = gst_caps_from_string(caps_string);
+   GstWebRTCRTPTransceiver* transceiver = NULL;
+
+   g_signal_emit_by_name(webrtc, "add-transceiver", GST_WEBRTC_RTP_TRANSCEIVER_DIRECTION_RECVONLY, caps, &transceiver);
+   gst_caps_unref(caps);
+   if (transceiver)
+   {
+      /* Retransmissions by the sender, asked for by the jitterbuffer */
+      g_object_set(transceiver, "do-nack", TRUE, NULL);
+      gst_object_unref(transceiver);
+   }
+}
+
+#define WHEP_VIDEO_CAPS "application/x-rtp,media=video,encoding-name=H264,clock-rate=90000,payload=96," \
+      "packetization-mode=(string)1,profile-level-id=(string)42e01f,rtcp-fb-nack=(boolean)true,rtcp-fb-nack-pli=(boolean)true," \
+      "rtcp-fb-goog-remb=(boolean)true,rtcp-fb-transport-cc=(boolean)true,extmap-3=(string)" WHEP_TWCC_URI
+#define WHEP_AUDIO_CAPS "application/x-rtp,media=audio,encoding-name=OPUS,clock-rate=48000,payload=111"
+
+/*
+ * whep:// URLs
+ *
+ * The WHEP counterpart of rtspsrc: webrtcbin, with --latency for its
+ * jitterbuffer, receive only transceivers for H.264 (and Opus) and the offer
+ * POSTed to the http(s) version of the URL. Its pads go through
+ * rtsp_pad_added_cb() like those of rtspsrc and its rtpbin gets the same
+ * probes (stream_add_memory_probes). Retrying until the endpoint has the
+ * stream, so a stream of this same process (--whep-port) can be the sender
+ */
+
+static gpointer whep_ingest_thread(StreamData* stream)
+{
+   GstElement* webrtc = stream->whep_offerer;
+   GCancellable* cancellable = stream->app->cancellable;
+   gchar* url = g_strconcat(g_str_has_prefix(stream->url, "wheps:") ? "https" : "http", strstr(stream->url, "://"), NULL);
+   gchar* offer = whep_create_offer(webrtc);
+   gchar* answer = NULL;
+   gchar* location = NULL;
+   gint64 end = g_get_monotonic_time() + MAX(opt_timeout, 1) * G_TIME_SPAN_SECOND;
+
+   while (offer && !(answer = http_client_request("POST", url, offer, &location, cancellable)) && g_get_monotonic_time() < end &&
+          !g_cancellable_is_cancelled(cancellable))
+   {
+      g_usleep(G_USEC_PER_SEC / 2);
+   }
+   if (g_cancellable_is_cancelled(cancellable))
+   {
+      /* stream_free() waits for this */
+      if (location)
+      {
+         whep_delete(location);
+      }
+   }
+   else if (whep_set_answer(webrtc, answer))
+   {
+      g_mutex_lock(&stream->lock);
+      stream->whep_resource = location;
+      g_mutex_unlock(&stream->lock);
+      location = NULL;
+   }
+   else
+   {
+      GST_ELEMENT_ERROR(webrtc, RESOURCE, OPEN_READ, ("WHEP: no answer from %s", url), (NULL));
+   }
+   g_free(location);
+   g_free(answer);
+   g_free(offer);
+   g_free(url);
+   return NULL;
+}
+
+static void whep_negotiation_needed_cb(GstElement* webrtc, StreamData* stream)
+{
+   /* Not on webrtcbin's thread, the promises are resolved there */
+   if (g_atomic_int_compare_and_exchange(&stream->whep_negotiating, 0, 1))
+   {
+      stream->whep_offerer = gst_object_ref(webrtc);
+      stream->whep_thread = g_thread_new("whep-ingest", (GThreadFunc)whep_ingest_thread, stream);
+   }
+}
+
+static void whep_ingest_setup(StreamData* stream, GstElement* webrtc)
+{
+   stream->whep_source = webrtc;
+   g_object_set(G_OBJECT(webrtc), "latency", opt_latency, NULL);
+   gst_util_set_object_arg(G_OBJECT(webrtc), "bundle-policy", "max-bundle");
+   whep_add_transceiver(webrtc, WHEP_VIDEO_CAPS);
+   if (opt_audio_buffer > 0)
+   {
+      whep_add_transceiver(webrtc, WHEP_AUDIO_CAPS);
+   }
+   g_signal_connect(webrtc, "on-negotiation-needed", G_CALLBACK(whep_negotiation_needed_cb), stream);
+}
+
+/*
+ * Ends the session at the sender, at exit
+ */
+
+static void whep_delete(const gchar* resource)
+{
+   g_free(http_client_request("DELETE", resource, NULL, NULL, NULL));
+}
+
+static gpointer whep_test_thread(gchar* url)
+{
+   GstElement* pipeline = gst_pipeline_new("whep-test");
+   GstElement* webrtc = gst_element_factory_make("webrtcbin", NULL);
+   gchar* offer;
+   gchar* answer;
+
+   if (!webrtc)
+   {
+      g_printerr("WHEP test: no webrtcbin\n");
+      gst_object_unref(pipeline);
+      return NULL;
+   }
+   gst_util_set_object_arg(G_OBJECT(webrtc), "bundle-policy", "max-bundle");
+   gst_bin_add(GST_BIN(pipeline), webrtc);
+   g_signal_connect(webrtc, "pad-added", G_CALLBACK(whep_test_pad_added_cb), pipeline);
+   gst_element_set_state(pipeline, GST_STATE_PLAYING);
+   whep_add_transceiver(webrtc, WHEP_VIDEO_CAPS);
+
+   offer = whep_create_offer(webrtc);
+   answer = offer ? http_client_request("POST", url, offer, NULL, NULL) : NULL;
+   if (!whep_set_answer(webrtc, answer))
+   {
+      g_printerr("WHEP test: no answer from %s\n", url);
+      gst_element_set_state(pipeline, GST_STATE_NULL);
+      gst_object_unref(pipeline);
+   }
+   else
+   {
+      /* Lives as long as the process */
+      g_print("WHEP test: playing %s\n", url);
+   }
+   g_free(answer);
+   g_free(offer);
+   return NULL;
+}
+
+static void whep_test_report(void)
+{
+   g_mutex_lock(&whep_test_lock);
+   if (whep_test_frames > 0)
+   {
+      g_print("WHEP test: end-to-end latency avg %.1fms, max %.1fms over %u frames\n",
+            whep_test_latency_sum / 1e3 / whep_test_frames, whep_test_latency_max / 1e3, whep_test_frames);
+   }
+   whep_test_latency_sum = whep_test_latency_max = 0;
+   whep_test_frames = 0;
+   g_mutex_unlock(&whep_test_lock);
+}
+
+static GSocketService* http_listen(gint port, GCallback handler, CustomData* app, const gchar* what)
+{
+   GSocketService* service = g_threaded_socket_service_new(64);
+   GError* error = NULL;
+
+   if (!g_socket_listener_add_inet_port(G_SOCKET_LISTENER(service), port, NULL, &error))
+   {
+      g_printerr("%s: can't listen on port %d: %s\n", what, port, error->message);
+      g_error_free(error);
+      g_object_unref(service);
+      return NULL;
+   }
+   g_signal_connect(service, "run", handler, app);
+   g_socket_service_start(service);
+   return service;
+}
+
+static void http_start(CustomData* app)
+{
+   g_mutex_init(&app->http_lock);
+   g_cond_init(&app->http_idle);
+   if (opt_hls_port > 0 && (app->hls_service = http_listen(opt_hls_port, G_CALLBACK(hls_serve), app, "LL-HLS")) != NULL)
+   {
+      g_print("LL-HLS: http://localhost:%d/input1/index.m3u8\n", opt_hls_port);
+   }
+   if (opt_whep_port > 0 && (app->whep_service = http_listen(opt_whep_port, G_CALLBACK(whep_serve), app, "WHEP")) != NULL)
+   {
+      g_print("WHEP: http://localhost:%d/input1/whep\n", opt_whep_port);
+   }
+   if (opt_whep_test)
+   {
+      g_thread_unref(g_thread_new("whep-test", (GThreadFunc)whep_test_thread, opt_whep_test));
+   }
+}
+
+/*
+ * Wakes up the blocked requests and waits for them, the streams go next
+ */
+
+static void http_stop(CustomData* app)
+{
+   GSocketService* services[] = { app->hls_service, app->whep_service };
+
+   for (guint i = 0; i < G_N_ELEMENTS(services); i++)
+   {
+      if (services[i])
+      {
+         g_socket_service_stop(services[i]);
+         g_socket_listener_close(G_SOCKET_LISTENER(services[i]));
+      }
+   }
+   for (guint i = 0; i < app->streams->len; i++)
+   {
+      HlsOutput* hls = ((StreamData*)g_ptr_array_index(app->streams, i))->hls;
+
+      if (hls)
+      {
+         g_mutex_lock(&hls->lock);
+         hls->stopped = TRUE;
+         g_cond_broadcast(&hls->cond);
+         g_mutex_unlock(&hls->lock);
+      }
+   }
+   g_mutex_lock(&app->http_lock);
+   while (app->http_connections > 0)
+   {
+      g_cond_wait(&app->http_idle, &app->http_lock);
+   }
+   g_mutex_unlock(&app->http_lock);
+   g_clear_object(&app->hls_service);
+   g_clear_object(&app->whep_service);
+}
+
+/*
+ * SRT ingest
+ *
+ * An srt:// URL, usually an encoder in front of a camera across a WAN, is
+ * received with srtsrc (caller mode) carrying MPEG-TS. tsdemux hands the
+ * H.264 to h264parse in the depayloader's place, so the rest of the chain
+ * and the probes are the same as for RTSP. Lost packets are retransmitted by
+ * SRT within its latency window and dropped when too late, the stream never
+ * stalls behind them as it would over TCP.
+ *
+ * The window is derived from the RTT and --srt-budget, the end-to-end
+ * latency we may spend: about four RTTs lets a packet be retransmitted more
+ * than once, but no more than what is left of the budget after the one way
+ * delay and the decode/render allowance. Before the first RTT measurement
+ * the whole remainder is used. SRT only negotiates the latency at the
+ * handshake, so when the measured RTT asks for a clearly different window
+ * the source reconnects (srt_reconnect_func)
+ */
+
+#define SRT_PIPELINE_ALLOWANCE 60    /* ms, demux, decode and render */
+#define SRT_MIN_LATENCY 20           /* ms */
+#define SRT_RTT_FACTOR 4
+#define SRT_ADAPT_INTERVAL 30        /* s, between reconnects */
+
+static gint srt_derive_latency(gdouble rtt_ms)
+{
+   gint room = opt_srt_budget - SRT_PIPELINE_ALLOWANCE - (gint)(rtt_ms / 2);
+   gint latency = rtt_ms > 0 ? MIN((gint)(SRT_RTT_FACTOR * rtt_ms), room) : room;
+
+   return MAX(latency, SRT_MIN_LATENCY);
+}
+
+static void srt_pad_added_cb(GstElement* demux, GstPad* pad, StreamData* stream)
+{
+   GstCaps* caps = gst_pad_query_caps(pad, NULL);
+   GstElement* parse;
+
+   /* Video only, the audio of a TS would need its own decoder */
+   if (gst_caps_get_size(caps) > 0 && gst_structure_has_name(gst_caps_get_structure(caps, 0), "video/x-h264"))
+   {
+      parse = stream_get_element(stream, "depay");
+      if (!parse || !gst_element_link_pads(demux, GST_PAD_NAME(pad), parse, "sink"))
+      {
+         printf("Failed to link elements\n");
+      }
+      g_clear_object(&parse);
+   }
+   gst_caps_unref(caps);
+}
+
+/*
+ * srtsrc and tsdemux, for create_pipeline() to add. tsdemux links to the
+ * depayloader in srt_pad_added_cb()
+ */
+
+static GstElement* srt_ingest_create(StreamData* stream, const gchar* name, const gchar* url)
+{
+   gchar* demux_name = g_strconcat(stream->prefix, "demux", NULL);
+   GstElement* source = gst_element_factory_make("srtsrc", name);
+   GstElement* demux = gst_element_factory_make("tsdemux", demux_name);
+
+   g_free(demux_name);
+   if (!source || !demux)
+   {
+      g_warning("No srtsrc or tsdemux, can't play %s", url);
+      g_clear_object(&source);
+      g_clear_object(&demux);
+      return NULL;
+   }
+   g_object_set(G_OBJECT(source), "uri", url, NULL);
+   /* A latency in the URL is the user's choice */
+   stream->srt_adaptive = strstr(url, "latency=") == NULL;
+   if (stream->srt_adaptive)
+   {
+      g_object_set(G_OBJECT(source), "latency", srt_derive_latency(stream->srt_rtt), NULL);
+   }
+   /* Default 700ms of lookahead for the PCR, there's one in every packet of a live encoder */
+   g_object_set(G_OBJECT(demux), "latency", 0, NULL);
+   g_signal_connect(demux, "pad-added", G_CALLBACK(srt_pad_added_cb), stream);
+   stream->srt_source = source;
+   stream->srt_demux = demux;
+   return source;
+}
+
+static void srt_reconnect_func(GstElement* pipeline, StreamData* stream)
+{
+   gst_element_set_state(pipeline, GST_STATE_NULL);
+   g_object_set(G_OBJECT(stream->srt_source), "latency", srt_derive_latency(stream->srt_rtt), NULL);
+   if (gst_element_set_state(pipeline, GST_STATE_PLAYING) == GST_STATE_CHANGE_FAILURE)
+   {
+      GST_ELEMENT_ERROR(pipeline, CORE, STATE_CHANGE, ("Failed to reconnect SRT"), (NULL));
+   }
+}
+
+static gint64 srt_stats_get(const GstStructure* s, const gchar* field)
+{
+   const GValue* value = gst_structure_get_value(s, field);
+   GValue result = G_VALUE_INIT;
+   gint64 number = 0;
+
+   /* The counters are a mix of int, int64 and uint64 */
+   g_value_init(&result, G_TYPE_INT64);
+   if (value && g_value_transform(value, &result))
+   {
+      number = g_value_get_int64(&result);
+   }
+   g_value_unset(&result);
+   return number;
+}
+
+/*
+ * Once a second, into the stream's counters. Adapts the latency window
+ */
+
+static void srt_report(StreamData* stream)
+{
+   StreamStats* stats = &stream->stats;
+   GstStructure* s = NULL;
+   gint64 now = g_get_monotonic_time();
+   gint negotiated, wanted;
+
+   if (!stream->srt_source)
+   {
+      return;
+   }
+   g_object_get(G_OBJECT(stream->srt_source), "stats", &s, NULL);
+   if (!s)
+   {
+      return;
+   }
+   if (gst_structure_get_double(s, "rtt-ms", &stream->srt_rtt))
+   {
+      stat_set(&stats->srt_rtt_us, (gssize)(stream->srt_rtt * 1000));
+      stat_set(&stats->srt_retransmitted_packets, srt_stats_get(s, "packets-received-retransmitted"));
+      stat_set(&stats->srt_lost_packets, srt_stats_get(s, "packets-received-lost"));
+      stat_set(&stats->srt_dropped_packets, srt_stats_get(s, "packets-received-dropped"));
+      negotiated = srt_stats_get(s, "negotiated-latency-ms");
+
+      if (opt_verbose)
+      {
+         g_print("%sSRT: rtt %.1fms, latency %dms, %zi retransmitted, %zi lost, %zi too late\n", stream->prefix, stream->srt_rtt, negotiated,
+               stat_get(&stats->srt_retransmitted_packets), stat_get(&stats->srt_lost_packets), stat_get(&stats->srt_dropped_packets));
+      }
+
+      wanted = srt_derive_latency(stream->srt_rtt);
+      if (stream->srt_adaptive && negotiated > 0 && ABS(wanted - negotiated) > MAX(negotiated / 4, SRT_MIN_LATENCY) &&
+            now - stream->srt_adapt_time > SRT_ADAPT_INTERVAL * G_TIME_SPAN_SECOND)
+      {
+         /* The sender's latency, if larger, still wins the negotiation */
+         g_print("%sSRT: reconnecting with latency %dms\n", stream->prefix, wanted);
+         stream->srt_adapt_time = now;
+         gst_element_call_async(stream->pipeline, (GstElementCallAsyncFunc)srt_reconnect_func, stream, NULL);
+      }
+   }
+   gst_structure_free(s);
+}
+
+/*
+ * Re-encode relay
+ *
+ * With --relay-port the decoded video is also downscaled and re-encoded for
+ * remote viewers on slow links, and served by an RTSP server in this process
+ * at rtsp://host:PORT/input<N>. The media is shared: one encode per stream
+ * for all viewers, and the camera only sees this workstation.
+ *
+ *    decoder -> tee -> queue -> videoscale -> x264enc -> appsink ... appsrc -> rtph264pay
+ *                   -> identity -> sink
+ *
+ * The queue is leaky and requested before the display branch, so the encoder
+ * has its own thread and never holds up the display, nor the display (which
+ * waits for the clock) it. Without viewers, relay_queue_probe drops the frames
+ * before they cost anything. videoscale's bilinear scaling of I420 is ORC
+ * (SIMD) code. x264 runs with tune=zerolatency (no lookahead, no frame
+ * threads) and slice threads, no B-frames and intra refresh instead of
+ * keyframes, so no frame is much bigger than the others and a viewer that
+ * joins or loses a packet recovers within key-int-max frames. The time each
+ * frame spends in the encoder is measured, see relay_encoder_src_probe()
+ */
+
+#define RELAY_KEY_INT_MAX 60         /* Frames, intra refresh period */
+#define RELAY_VBV_BUFFER 200         /* ms */
+
+static GstPadProbeReturn relay_queue_probe(GstPad* pad, GstPadProbeInfo* info, StreamData* stream)
+{
+   return g_atomic_pointer_get(&stream->relay_src) ? GST_PAD_PROBE_OK : GST_PAD_PROBE_DROP;
+}
+
+static GstPadProbeReturn relay_encoder_sink_probe(GstPad* pad, GstPadProbeInfo* info, StreamData* stream)
+{
+   cpu_stage(stream, CPU_ENCODE);
+   g_mutex_lock(&stream->relay_lock);
+   /* One frame out for each in, the oldest is overwritten if the encoder dropped some */
+   stream->relay_pending[(stream->relay_pending_head + stream->relay_pending_count) % RELAY_PENDING] = g_get_monotonic_time();
+   if (stream->relay_pending_count < RELAY_PENDING)
+   {
+      stream->relay_pending_count++;
+   }
+   else
+   {
+      stream->relay_pending_head = (stream->relay_pending_head + 1) % RELAY_PENDING;
+   }
+   g_mutex_unlock(&stream->relay_lock);
+   return GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn relay_encoder_src_probe(GstPad* pad, GstPadProbeInfo* info, StreamData* stream)
+{
+   gint64 now = g_get_monotonic_time();
+
+   g_mutex_lock(&stream->relay_lock);
+   if (stream->relay_pending_count > 0)
+   {
+      gint64 latency = now - stream->relay_pending[stream->relay_pending_head];
+
+      stream->relay_pending_head = (stream->relay_pending_head + 1) % RELAY_PENDING;
+      stream->relay_pending_count--;
+      stream->relay_latency_sum += latency;
+      stream->relay_latency_max = MAX(stream->relay_latency_max, latency);
+      stream->relay_frames++;
+   }
+   stream->relay_bytes += gst_buffer_get_size(GST_PAD_PROBE_INFO_BUFFER(info));
+   g_mutex_unlock(&stream->relay_lock);
+   return GST_PAD_PROBE_OK;
+}
+
+/*
+ * From the encoder's thread into the RTSP server's media. The timestamps
+ * are of our pipeline, the media has its own clock: appsrc stamps them again
+ */
+
+static GstFlowReturn relay_new_sample_cb(GstElement* appsink, StreamData* stream)
+{
+   GstSample* sample = gst_app_sink_pull_sample(GST_APP_SINK(appsink));
+   GstElement* src;
+
+   if (!sample)
+   {
+      return GST_FLOW_EOS;
+   }
+   g_mutex_lock(&stream->relay_lock);
+   src = stream->relay_src ? gst_object_ref(stream->relay_src) : NULL;
+   g_mutex_unlock(&stream->relay_lock);
+   if (src)
+   {
+      GstBuffer* buffer = gst_buffer_copy(gst_sample_get_buffer(sample));
+      GstCaps* caps = gst_app_src_get_caps(GST_APP_SRC(src));
+
+      if (!caps || !gst_caps_is_equal(caps, gst_sample_get_caps(sample)))
+      {
+         gst_app_src_set_caps(GST_APP_SRC(src), gst_sample_get_caps(sample));
+      }
+      if (caps)
+      {
+         gst_caps_unref(caps);
+      }
+      GST_BUFFER_PTS(buffer) = GST_BUFFER_DTS(buffer) = GST_CLOCK_TIME_NONE;
+      gst_app_src_push_buffer(GST_APP_SRC(src), buffer);
+      gst_object_unref(src);
+   }
+   gst_sample_unref(sample);
+   return GST_FLOW_OK;
+}
+
+static gboolean stream_add_relay(StreamData* stream, GstElement* pipeline, GstElement* decoder, GstElement* identity)
+{
+   const gchar* names[] = { "relaytee", "relayqueue", "relayscale", "relaycaps", "relayencoder", "relaysink" };
+   const gchar* factories[] = { "tee", "queue", "videoscale", "capsfilter", "x264enc", "appsink" };
+   GstElement* elements[G_N_ELEMENTS(names)];
+   GstCaps* caps;
+   GstPad* pad;
+
+   for (guint i = 0; i < G_N_ELEMENTS(names); i++)
+   {
+      gchar* name = g_strconcat(stream->prefix, names[i], NULL);
+
+      elements[i] = gst_element_factory_make(factories[i], name);
+      g_free(name);
+      if (!elements[i])
+      {
+         g_warning("Failed to create the relay's %s!", factories[i]);
+         while (i-- > 0)
+         {
+            gst_object_unref(elements[i]);
+         }
+         return FALSE;
+      }
+   }
+   g_object_set(G_OBJECT(elements[1]), "max-size-buffers", 1, "max-size-bytes", 0, "max-size-time", G_GUINT64_CONSTANT(0), NULL);
+   gst_util_set_object_arg(G_OBJECT(elements[1]), "leaky", "downstream");
+   gst_util_set_object_arg(G_OBJECT(elements[2]), "method", "bilinear");
+   /* Width only, videoscale keeps the aspect ratio */
+   caps = gst_caps_new_simple("video/x-raw", "width", G_TYPE_INT, opt_relay_width, NULL);
+   g_object_set(G_OBJECT(elements[3]), "caps", caps, NULL);
+   gst_caps_unref(caps);
+   gst_util_set_object_arg(G_OBJECT(elements[4]), "tune", "zerolatency");
+   gst_util_set_object_arg(G_OBJECT(elements[4]), "speed-preset", "superfast");
+   g_object_set(G_OBJECT(elements[4]), "bitrate", opt_relay_bitrate, "vbv-buf-capacity", RELAY_VBV_BUFFER, "sliced-threads", TRUE,
+         "bframes", 0, "intra-refresh", TRUE, "key-int-max", RELAY_KEY_INT_MAX, NULL);
+   g_object_set(G_OBJECT(elements[5]), "sync", FALSE, "async", FALSE, "emit-signals", TRUE, NULL);
+   g_signal_connect(elements[5], "new-sample", G_CALLBACK(relay_new_sample_cb), stream);
+   stream->relay_encoder = elements[4];
+
+   for (guint i = 0; i < G_N_ELEMENTS(elements); i++)
+   {
+      gst_bin_add(GST_BIN(pipeline), elements[i]);
+   }
+   /* The relay's tee pad first, see above */
+   if (!gst_element_link(decoder, elements[0]) || !gst_element_link_many(elements[0], elements[1], elements[2], elements[3], elements[4], elements[5], NULL) ||
+       !gst_element_link(elements[0], identity))
+   {
+      g_warning("Failed to link the relay elements!");
+      return FALSE;
+   }
+   pad = gst_element_get_static_pad(elements[1], "sink");
+   gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, (GstPadProbeCallback)relay_queue_probe, stream, NULL);
+   gst_object_unref(pad);
+   pad = gst_element_get_static_pad(elements[4], "sink");
+   gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, (GstPadProbeCallback)relay_encoder_sink_probe, stream, NULL);
+   gst_object_unref(pad);
+   pad = gst_element_get_static_pad(elements[4], "src");
+   gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, (GstPadProbeCallback)relay_encoder_src_probe, stream, NULL);
+   gst_object_unref(pad);
+   return TRUE;
+}
+
+static void relay_media_unprepared_cb(GstRTSPMedia* media, StreamData* stream)
+{
+   GstElement* src;
+
+   g_mutex_lock(&stream->relay_lock);
+   src = stream->relay_src;
+   g_atomic_pointer_set(&stream->relay_src, NULL);
+   g_mutex_unlock(&stream->relay_lock);
+   g_clear_object(&src);
+}
+
+/*
+ * The shared media is created for the first viewer and lives until the last
+ * one leaves
+ */
+
+static void relay_media_configure_cb(GstRTSPMediaFactory* factory, GstRTSPMedia* media, StreamData* stream)
+{
+   GstElement* bin = gst_rtsp_media_get_element(media);
+   GstElement* src = gst_bin_get_by_name_recurse_up(GST_BIN(bin), "src");
+   GstPad* pad;
+
+   gst_object_unref(bin);
+   if (!src || !stream->relay_encoder)
+   {
+      g_clear_object(&src);
+      return;
+   }
+   g_object_set(G_OBJECT(src), "is-live", TRUE, "format", GST_FORMAT_TIME, "do-timestamp", TRUE, "min-latency", G_GINT64_CONSTANT(0),
+         "max-bytes", (guint64)opt_relay_bitrate * 1000 / 8, NULL);
+   gst_util_set_object_arg(G_OBJECT(src), "leaky-type", "downstream");
+   g_signal_connect(media, "unprepared", G_CALLBACK(relay_media_unprepared_cb), stream);
+   g_mutex_lock(&stream->relay_lock);
+   g_clear_object(&stream->relay_src);
+   g_atomic_pointer_set(&stream->relay_src, src);
+   g_mutex_unlock(&stream->relay_lock);
+
+   /* Start a refresh right away rather than within key-int-max frames */
+   pad = gst_element_get_static_pad(stream->relay_encoder, "sink");
+   gst_pad_send_event(pad, gst_video_event_new_downstream_force_key_unit(GST_CLOCK_TIME_NONE, GST_CLOCK_TIME_NONE, GST_CLOCK_TIME_NONE, TRUE, 0));
+   gst_object_unref(pad);
+}
+
+static void relay_start(CustomData* app)
+{
+   GstRTSPMountPoints* mounts;
+   gchar* service = g_strdup_printf("%d", opt_relay_port);
+
+   app->relay_server = gst_rtsp_server_new();
+   g_object_set(G_OBJECT(app->relay_server), "service", service, NULL);
+   g_free(service);
+   mounts = gst_rtsp_server_get_mount_points(app->relay_server);
+   for (guint i = 0; i < app->streams->len; i++)
+   {
+      StreamData* stream = g_ptr_array_index(app->streams, i);
+      GstRTSPMediaFactory* factory = gst_rtsp_media_factory_new();
+      gchar* path = g_strdup_printf("/input%u", stream->index + 1);
+
+      gst_rtsp_media_factory_set_launch(factory, "( appsrc name=src ! h264parse ! rtph264pay name=pay0 pt=96 config-interval=-1 )");
+      gst_rtsp_media_factory_set_shared(factory, TRUE);
+      g_signal_connect(factory, "media-configure", G_CALLBACK(relay_media_configure_cb), stream);
+      gst_rtsp_mount_points_add_factory(mounts, path, factory);
+      g_free(path);
+   }
+   g_object_unref(mounts);
+   if (gst_rtsp_server_attach(app->relay_server, NULL) == 0)
+   {
+      g_printerr("Relay: can't listen on port %d\n", opt_relay_port);
+      g_clear_object(&app->relay_server);
+      return;
+   }
+   g_print("Relay: rtsp://localhost:%d/input1\n", opt_relay_port);
+}
+
+static void relay_report(StreamData* stream)
+{
+   guint frames;
+   gint64 sum, max, bytes;
+
+   if (!stream->relay_encoder)
+   {
+      return;
+   }
+   g_mutex_lock(&stream->relay_lock);
+   frames = stream->relay_frames;
+   sum = stream->relay_latency_sum;
+   max = stream->relay_latency_max;
+   bytes = stream->relay_bytes;
+   stream->relay_frames = 0;
+   stream->relay_latency_sum = stream->relay_latency_max = stream->relay_bytes = 0;
+   g_mutex_unlock(&stream->relay_lock);
+   if (opt_verbose && frames > 0)
+   {
+      g_print("%sRelay: %u frames, encode latency avg %.1fms, max %.1fms, %" G_GINT64_FORMAT " kbit\n", stream->prefix, frames, sum / 1e3 / frames, max / 1e3, bytes * 8 / 1000);
+   }
+}
+
+/*
+ * Stats file
+ *
+ * With --stats-file a snapshot of each stream goes into a memory mapped ring
+ * once a second, see statsfile.h, for after the fact analysis with
+ * statsdump. The ring holds --stats-hours of all streams, so the file has a
+ * fixed size, and it is allocated on disk up front: a full disk can't
+ * surface later as SIGBUS on a store. An existing stats file of the same
+ * shape is continued, so a restart after a crash doesn't wipe what led up to
+ * it, one of another shape is started over, any other file is left alone.
+ * Writing a record is a few stores to the mapping; the kernel writes the
+ * pages back by itself and they survive the process
+ */
+
+#define STATS_FILE_MAX_HOURS (24 * 366)
+
+static gboolean stats_file_open(CustomData* app)
+{
+   guint streams = MIN(app->streams->len, STATS_FILE_MAX_STREAMS);
+   guint32 capacity;
+   size_t size;
+   StatsFileHeader* header;
+   StatsFileHeader existing;
+   gboolean reuse = FALSE;
+   struct stat st;
+   int fd, err;
+
+   if (opt_stats_hours <= 0 || opt_stats_hours > STATS_FILE_MAX_HOURS || streams == 0)
+   {
+      g_printerr("Stats file: --stats-hours must be 1..%d\n", STATS_FILE_MAX_HOURS);
+      return FALSE;
+   }
+   /* At most a year of 32 streams, well within 32 bits */
+   capacity = opt_stats_hours * 3600 * streams;
+   size = stats_file_size(capacity);
+
+   fd = open(opt_stats_file, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+   if (fd < 0 || fstat(fd, &st) < 0)
+   {
+      g_printerr("Stats file %s: %s\n", opt_stats_file, g_strerror(errno));
+      if (fd >= 0)
+      {
+         close(fd);
+      }
+      return FALSE;
+   }
+   /* Never resize or overwrite what isn't a stats file */
+   if (st.st_size > 0)
+   {
+      if (pread(fd, &existing, sizeof(existing), 0) != sizeof(existing) || existing.magic != STATS_FILE_MAGIC)
+      {
+         g_printerr("Stats file %s: exists and is not a stats file\n", opt_stats_file);
+         close(fd);
+         return FALSE;
+      }
+      reuse = (size_t)st.st_size == size && existing.version == STATS_FILE_VERSION && existing.record_size == sizeof(StatsRecord) &&
+         existing.capacity == capacity && existing.streams == streams;
+   }
+   if ((size_t)st.st_size != size && ftruncate(fd, size) < 0)
+   {
+      g_printerr("Stats file %s: %s\n", opt_stats_file, g_strerror(errno));
+      close(fd);
+      return FALSE;
+   }
+   err = posix_fallocate(fd, 0, size);
+   if (err != 0 && err != EOPNOTSUPP)
+   {
+      g_printerr("Stats file %s: %s\n", opt_stats_file, g_strerror(err));
+      close(fd);
+      return FALSE;
+   }
+   header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   close(fd);
+   if (header == MAP_FAILED)
+   {
+      g_printerr("Stats file %s: %s\n", opt_stats_file, g_strerror(errno));
+      return FALSE;
+   }
+
+   if (!reuse)
+   {
+      memset(header, 0, STATS_FILE_HEADER_SIZE);
+      header->version = STATS_FILE_VERSION;
+      header->header_size = STATS_FILE_HEADER_SIZE;
+      header->record_size = sizeof(StatsRecord);
+      header->capacity = capacity;
+      header->streams = streams;
+      header->start_time = g_get_real_time();
+   }
+   for (guint i = 0; i < streams; i++)
+   {
+      StreamData* stream = g_ptr_array_index(app->streams, i);
+      const gchar* url = stream->url;
+      const gchar* scheme = strstr(url, "://");
+      const gchar* at = scheme ? strchr(scheme + 3, '@') : NULL;
+      gchar* name;
+
+      /* Without credentials, if the URL has them */
+      name = at && !memchr(scheme + 3, '/', at - scheme - 3) ? g_strdup_printf("%.*s%s", (int)(scheme + 3 - url), url, at + 1) : g_strdup(url);
+      g_strlcpy(header->names[i], name, STATS_FILE_NAME_SIZE);
+      g_free(name);
+   }
+   /* Last, so a reader never takes a half initialized header for a valid one */
+   __atomic_store_n(&header->magic, STATS_FILE_MAGIC, __ATOMIC_RELEASE);
+
+   app->stats_file = header;
+   app->stats_file_size = size;
+   g_print("Stats file: %s, %u hours of %u streams (%zu KB)%s\n", opt_stats_file, opt_stats_hours, streams, size / 1024, reuse ? ", continued" : "");
+   return TRUE;
+}
+
+static void stats_file_close(CustomData* app)
+{
+   if (app->stats_file)
+   {
+      msync(app->stats_file, app->stats_file_size, MS_SYNC);
+      munmap(app->stats_file, app->stats_file_size);
+      app->stats_file = NULL;
+   }
+}
+
+/*
+ * The hold times skew_add_hold() collected since the previous call: the
+ * quantiles in ms, and the counts slo_evaluate() needs. The SLO is on the
+ * end-to-end latency as the panel shows it, the hold time plus the video
+ * path's latency, so that comes off its limits here
+ */
+
+static void stats_hold_quantiles(StreamData* stream, StreamSample* sample)
+{
+   SkewEstimator* skew = &stream->skew;
+   StatsRecord* record = &sample->record;
+   const gdouble quantiles[] = { 0.50, 0.95, 0.99 };
+   gfloat* values[] = { &record->latency_p50, &record->latency_p95, &record->latency_p99 };
+   guint q = 0, seen = 0;
+   gint video = GST_CLOCK_TIME_IS_VALID(stream->video_latency) ? (gint)(stream->video_latency / GST_MSECOND) : 0;
+   gint limit = stream->slo.quantile > 0 ? (gint)stream->slo.latency - video : HOLD_BUCKETS;
+   gint limit_twice = stream->slo.quantile > 0 ? 2 * (gint)stream->slo.latency - video : HOLD_BUCKETS;
+
+   g_mutex_lock(&skew->lock);
+   for (guint i = 0; i < HOLD_BUCKETS && skew->hold_count > 0; i++)
+   {
+      seen += skew->hold_histogram[i];
+      while (q < G_N_ELEMENTS(quantiles) && seen >= quantiles[q] * skew->hold_count)
+      {
+         *values[q++] = i + 1;
+      }
+      if ((gint)i >= limit)
+      {
+         sample->slo_over += skew->hold_histogram[i];
+      }
+      if ((gint)i >= limit_twice)
+      {
+         sample->slo_over_twice += skew->hold_histogram[i];
+      }
+   }
+   sample->held_frames = skew->hold_count;
+   record->latency_max = skew->hold_count > 0 ? skew->hold_max / 1e6 : 0;
+   memset(skew->hold_histogram, 0, sizeof(skew->hold_histogram));
+   skew->hold_count = 0;
+   skew->hold_max = 0;
+   g_mutex_unlock(&skew->lock);
+}
+
+static inline guint16 stats_delta(gssize now, gssize* last)
+{
+   gssize delta = now - *last;
+
+   *last = now;
+   return CLAMP(delta, 0, G_MAXUINT16);
+}
+
+/*
+ * Once a second, from the main loop: what happened since the previous call,
+ * for the stats file and the SLO
+ */
+
+static gboolean stream_stats_sample(StreamData* stream, gdouble interval, StreamSample* sample)
+{
+   StreamStats* stats = &stream->stats;
+   StatsRecord* record = &sample->record;
+   guint64 lost = 0, jitter = 0;
+   gssize bytes;
+
+   if (interval <= 0)
+   {
+      return FALSE;
+   }
+   memset(sample, 0, sizeof(*sample));
+   record->stream = stream->index;
+   record->flags = stream->state >= GST_STATE_PAUSED ? STATS_RECORD_PLAYING : 0;
+   record->time = g_get_real_time();
+   stats_hold_quantiles(stream, sample);
+
+   g_mutex_lock(&stream->lock);
+   for (guint i = 0; i < stream->jitterbuffers->len; i++)
+   {
+      GstStructure* jb_stats = NULL;
+      guint64 value;
+
+      g_object_get(G_OBJECT(g_ptr_array_index(stream->jitterbuffers, i)), "stats", &jb_stats, NULL);
+      if (jb_stats)
+      {
+         if (gst_structure_get_uint64(jb_stats, "num-lost", &value))
+         {
+            lost += value;
+         }
+         if (gst_structure_get_uint64(jb_stats, "avg-jitter", &value))
+         {
+            jitter = MAX(jitter, value);
+         }
+         gst_structure_free(jb_stats);
+      }
+   }
+   g_mutex_unlock(&stream->lock);
+   /* New jitterbuffers start from 0 again */
+   if ((gssize)lost < stream->stats_last_lost)
+   {
+      stream->stats_last_lost = 0;
+   }
+   record->packets_lost = stats_delta(lost, &stream->stats_last_lost);
+   record->jitter = jitter / 1e6;
+
+   bytes = stat_get(&stats->jitterbuffer_in_bytes);
+   record->bitrate = MAX(bytes - stream->stats_last_bytes, 0) * 8 / 1000 / interval;
+   stream->stats_last_bytes = bytes;
+   record->frames = stats_delta(stat_get(&stats->decoder_out_frames), &stream->stats_last_frames);
+   record->frames_dropped = stats_delta(stat_get(&stats->decoder_gone_frames) + stat_get(&stats->held_frames), &stream->stats_last_dropped);
+   record->corrupted = stats_delta(stat_get(&stats->corrupted_frames_shown), &stream->stats_last_corrupted);
+   record->flushes = stats_delta(stat_get(&stats->flushes), &stream->stats_last_flushes);
+   record->cpu = stream->cpu_percent;
+   record->skew = stream->skew_ppm;
+   return TRUE;
+}
+
+static void stats_file_write(StreamData* stream, const StatsRecord* record)
+{
+   StatsFileHeader* header = stream->app->stats_file;
+
+   if (header && stream->index < header->streams)
+   {
+      stats_record_write(header, record);
+   }
+}
+
+/*
+ * Latency SLO
+ *
+ * --slo gives a stream an objective like p99:200:10:1: 99% of the frames
+ * shown less than 200ms after they arrived (end-to-end as on the panel), and
+ * at most 1% of the frames dropped, over any 10 seconds.
+ * Every second slo_evaluate() adds the counts of stream_stats_sample() to a
+ * ring of the window and checks the totals. Counting frames over the limit
+ * makes the quantile exact without keeping histograms: p99 < 200ms is no
+ * more than 1% of the frames over 200ms. Over twice the limit (latency or
+ * drops) is critical, otherwise a warning.
+ *
+ * Each change, violated, escalated, eased or recovered, is an event: a log
+ * line, a JSON datagram to the --slo-socket UNIX socket and the --slo-exec
+ * command with SLO_xxx environment variables. The command runs detached; a
+ * socket nobody reads from just loses the datagram
+ */
+
+static const gchar* slo_severity_names[] = { "ok", "warning", "critical" };
+
+static void slo_start(CustomData* app)
+{
+   struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+   app->slo_socket = -1;
+   if (!opt_slo_socket)
+   {
+      return;
+   }
+   if (strlen(opt_slo_socket) >= sizeof(addr.sun_path))
+   {
+      g_printerr("SLO socket path too long: %s\n", opt_slo_socket);
+      return;
+   }
+   strcpy(addr.sun_path, opt_slo_socket);
+   app->slo_socket = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+   /* Connecting fails until the receiver is there, slo_event() tries again */
+   if (app->slo_socket >= 0 && connect(app->slo_socket, (struct sockaddr*)&addr, sizeof(addr)) < 0 && errno != ENOENT && errno != ECONNREFUSED)
+   {
+      g_printerr("SLO socket %s: %s\n", opt_slo_socket, g_strerror(errno));
+   }
+}
+
+static void slo_stop(CustomData* app)
+{
+   if (app->slo_socket >= 0)
+   {
+      close(app->slo_socket);
+      app->slo_socket = -1;
+   }
+}
+
+static void slo_event(StreamData* stream, const gchar* event, gdouble late, gdouble drops, gdouble duration)
+{
+   SloState* slo = &stream->slo;
+   CustomData* app = stream->app;
+   const gchar* severity = slo_severity_names[slo->severity];
+   gchar* json;
+
+   g_print("%sSLO %s: %s, p%g < %dms: %.1f%% of the frames over, drops %.1f%% (max %.1f%%) over %us, for %.0fs\n", stream->prefix,
+         event, severity, slo->quantile * 100, slo->latency, late, drops, slo->max_drops, slo->window, duration);
+
+   if (app->slo_socket >= 0)
+   {
+      struct sockaddr_un addr = { .sun_family = AF_UNIX };
+      gchar* url = g_strescape(stream->url, NULL);
+
+      json = g_strdup_printf("{\"time\":%" G_GINT64_FORMAT ",\"stream\":%u,\"url\":\"%s\",\"event\":\"%s\",\"severity\":\"%s\","
+            "\"quantile\":%g,\"latency_ms\":%d,\"window_s\":%u,\"late_percent\":%.2f,\"drop_percent\":%.2f,\"max_drop_percent\":%.2f,\"duration_s\":%.0f}\n",
+            g_get_real_time() / 1000, stream->index + 1, url, event, severity, slo->quantile, slo->latency, slo->window, late, drops,
+            slo->max_drops, duration);
+      strcpy(addr.sun_path, opt_slo_socket);
+      if (send(app->slo_socket, json, strlen(json), MSG_DONTWAIT | MSG_NOSIGNAL) < 0 &&
+          (connect(app->slo_socket, (struct sockaddr*)&addr, sizeof(addr)) < 0 || send(app->slo_socket, json, strlen(json), MSG_DONTWAIT | MSG_NOSIGNAL) < 0))
+      {
+         g_debug("SLO socket %s: %s", opt_slo_socket, g_strerror(errno));
+      }
+      g_free(json);
+      g_free(url);
+   }
+
+   if (opt_slo_exec)
+   {
+      gchar** argv = NULL;
+      gchar** envp = g_get_environ();
+      GError* error = NULL;
+      gchar value[G_ASCII_DTOSTR_BUF_SIZE];
+
+      envp = g_environ_setenv(envp, "SLO_STREAM", stream->prefix, TRUE);
+      envp = g_environ_setenv(envp, "SLO_URL", stream->url, TRUE);
+      envp = g_environ_setenv(envp, "SLO_EVENT", event, TRUE);
+      envp = g_environ_setenv(envp, "SLO_SEVERITY", severity, TRUE);
+      envp = g_environ_setenv(envp, "SLO_LATE_PERCENT", g_ascii_formatd(value, sizeof(value), "%.2f", late), TRUE);
+      envp = g_environ_setenv(envp, "SLO_DROP_PERCENT", g_ascii_formatd(value, sizeof(value), "%.2f", drops), TRUE);
+      envp = g_environ_setenv(envp, "SLO_DURATION", g_ascii_formatd(value, sizeof(value), "%.0f", duration), TRUE);
+      if (!g_shell_parse_argv(opt_slo_exec, NULL, &argv, &error) ||
+          !g_spawn_async(NULL, argv, envp, G_SPAWN_SEARCH_PATH | G_SPAWN_STDIN_FROM_DEV_NULL, NULL, NULL, NULL, &error))
+      {
+         g_printerr("%sSLO exec: %s\n", stream->prefix, error->message);
+         g_clear_error(&error);
+      }
+      g_strfreev(argv);
+      g_strfreev(envp);
+   }
+}
+
+/*
+ * Once a second, from the main loop
+ */
+
+static void slo_evaluate(StreamData* stream, const StreamSample* sample)
+{
+   SloState* slo = &stream->slo;
+   SloSecond* second;
+   SloSecond sum = { 0 };
+   SloSeverity severity = SLO_OK;
+   gdouble late, drops, allowed;
+   const gchar* event;
+   gint64 now = g_get_monotonic_time();
+
+   if (slo->quantile <= 0)
+   {
+      return;
+   }
+   second = &slo->seconds[slo->head];
+   second->held = sample->held_frames;
+   second->over = sample->slo_over;
+   second->over_twice = sample->slo_over_twice;
+   second->frames = sample->record.frames;
+   second->dropped = sample->record.frames_dropped;
+   slo->head = (slo->head + 1) % slo->window;
+   slo->count = MIN(slo->count + 1, slo->window);
+   if (slo->count < slo->window)
+   {
+      return;
+   }
+   for (guint i = 0; i < slo->window; i++)
+   {
+      sum.held += slo->seconds[i].held;
+      sum.over += slo->seconds[i].over;
+      sum.over_twice += slo->seconds[i].over_twice;
+      sum.frames += slo->seconds[i].frames;
+      sum.dropped += slo->seconds[i].dropped;
+   }
+   /* A window without frames says nothing about the latency */
+   if (sum.held == 0 && sum.frames + sum.dropped == 0)
+   {
+      return;
+   }
+
+   allowed = (1 - slo->quantile) * sum.held;
+   late = sum.held > 0 ? sum.over * 100.0 / sum.held : 0;
+   drops = sum.frames + sum.dropped > 0 ? sum.dropped * 100.0 / (sum.frames + sum.dropped) : 0;
+   if (sum.over > allowed || (slo->max_drops > 0 && drops > slo->max_drops))
+   {
+      severity = SLO_WARNING;
+   }
+   if (sum.over_twice > allowed || (slo->max_drops > 0 && drops > 2 * slo->max_drops))
+   {
+      severity = SLO_CRITICAL;
+   }
+   if (severity == slo->severity)
+   {
+      return;
+   }
+
+   if (slo->severity == SLO_OK)
+   {
+      slo->violation_start = now;
+      slo->violations++;
+      event = "violated";
+   }
+   else if (severity == SLO_OK)
+   {
+      slo->violated_time += now - slo->violation_start;
+      event = "recovered";
+   }
+   else
+   {
+      event = severity > slo->severity ? "escalated" : "eased";
+   }
+   slo->severity = severity;
+   slo->worst = MAX(slo->worst, severity);
+   slo_event(stream, event, late, drops, (now - slo->violation_start) / 1e6);
+   if (severity == SLO_OK)
+   {
+      g_print("%sSLO: %u violations, %.0fs in violation in total, worst %s\n", stream->prefix, slo->violations, slo->violated_time / 1e6,
+            slo_severity_names[slo->worst]);
+   }
+}
+
+/*
+ * Stats panel
+ *
+ * The text view next to the video shows per stream what an operator needs
+ * to see a degradation, every --panel-interval ms. Frame rate, drops and
+ * bitrate come from the stream's counters, read atomically like everything
+ * else that reads StreamStats; the latency quantiles from the last second's
+ * stream_stats_sample(). End-to-end here is from arrival at the socket to
+ * the display: the hold time plus the video path's latency, see latency_cb().
+ * In the jitterbuffer is the hold time plus its latency. Decode time is the
+ * CPU time of the decoding threads per frame, see stream_report_cpu(). The
+ * whole text is built first and replaces the buffer's in one change, so GTK
+ * lays it out once per tick
+ */
+
+static void panel_stream(StreamData* stream, GString* text, gdouble interval)
+{
+   StreamStats* stats = &stream->stats;
+   const StreamSample* sample = &stream->panel_sample;
+   gssize frames = stat_get(&stats->decoder_out_frames);
+   gssize dropped = stat_get(&stats->decoder_gone_frames) + stat_get(&stats->held_frames);
+   gssize bytes = stat_get(&stats->jitterbuffer_in_bytes);
+   gdouble fps = interval > 0 ? MAX(frames - stream->panel_last_frames, 0) / interval : 0;
+
+   g_string_append_printf(text, "input%u %s", stream->index + 1, gst_element_state_get_name(stream->state));
+   if (stream->slo.severity != SLO_OK)
+   {
+      g_string_append_printf(text, ", SLO %s", slo_severity_names[stream->slo.severity]);
+   }
+   g_string_append_c(text, '\n');
+   if (sample->held_frames > 0)
+   {
+      if (GST_CLOCK_TIME_IS_VALID(stream->video_latency))
+      {
+         gdouble latency = stream->video_latency / 1e6;
+
+         g_string_append_printf(text, "  e2e p50 %.0fms, p99 %.0fms\n", sample->record.latency_p50 + latency, sample->record.latency_p99 + latency);
+      }
+      g_string_append_printf(text, "  jitterbuffer %.0fms, jitter %.1fms\n", sample->record.latency_p50 + opt_latency, sample->record.jitter);
+   }
+   g_string_append_printf(text, "  %.1f fps, %.0f dropped/s (%zi)\n", fps, interval > 0 ? MAX(dropped - stream->panel_last_dropped, 0) / interval : 0,
+         dropped);
+   g_string_append_printf(text, "  %.0f kbit/s\n", interval > 0 ? MAX(bytes - stream->panel_last_bytes, 0) * 8 / 1000 / interval : 0);
+   g_string_append_printf(text, "  decode %.1fms/frame, CPU %.0f%%\n\n", fps > 0 ? stream->cpu_decode_percent * 10 / fps : 0, stream->cpu_percent);
+   stream->panel_last_frames = frames;
+   stream->panel_last_dropped = dropped;
+   stream->panel_last_bytes = bytes;
+}
+
+static gboolean panel_update(CustomData* app)
+{
+   gint64 now = g_get_monotonic_time();
+   gdouble interval = app->panel_time ? (now - app->panel_time) / 1e6 : 0;
+   GString* text = g_string_sized_new(256 * app->streams->len);
+
+   for (guint i = 0; i < app->streams->len; i++)
+   {
+      panel_stream(g_ptr_array_index(app->streams, i), text, interval);
+   }
+   app->panel_time = now;
+   gtk_text_buffer_set_text(gtk_text_view_get_buffer(GTK_TEXT_VIEW(app->streams_list)), text->str, text->len);
+   g_string_free(text, TRUE);
+   return TRUE;
+}
+
+/*
+ * Milliseconds since the process was exec'ed, so the dynamic linking of all
+ * the GStreamer and GTK libraries is included. The start time from
+ * /proc/self/stat has clock tick (10ms) resolution
+ */
+
+static gdouble ms_since_exec(void)
+{
+   gchar* contents = NULL;
+   const gchar* p;
+   unsigned long long start_ticks = 0;
+   struct timespec now;
+
+   if (!g_file_get_contents("/proc/self/stat", &contents, NULL, NULL))
+   {
+      return -1;
+   }
+   /* The fields after the command, which may contain spaces */
+   p = strrchr(contents, ')');
+   if (p)
+   {
+      sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %*u %*u %*d %*d %*d %*d %*d %*d %llu", &start_ticks);
+   }
+   g_free(contents);
+
+   clock_gettime(CLOCK_BOOTTIME, &now);
+   return now.tv_sec * 1e3 + now.tv_nsec / 1e6 - start_ticks * 1e3 / sysconf(_SC_CLK_TCK);
+}
+
+/*
+ * Resident set size of the whole process
+ */
+
+static gsize read_rss(void)
+{
+   gchar* contents = NULL;
+   gsize pages = 0;
+
+   if (g_file_get_contents("/proc/self/statm", &contents, NULL, NULL))
+   {
+      sscanf(contents, "%*u %zu", &pages);
+      g_free(contents);
+   }
+   return pages * sysconf(_SC_PAGESIZE);
+}
+
+/* This function is called when the GUI toolkit creates the physical window
+ * that will hold the video.  At this point we can retrieve its handler (which
+ * has a different meaning depending on the windowing system) and pass it to
+ * GStreamer through the VideoOverlay interface. 
+ */
+
+static void realize_cb (GtkWidget *widget, StreamData *data) 
+{
+  GdkWindow *window = gtk_widget_get_window (widget);
+  guintptr window_handle;
+
+  if (!gdk_window_ensure_native (window))
+  {
+    g_error ("Couldn't create native window needed for GstVideoOverlay!");
+  }
+
+  /* Retrieve window handler from GDK */
+#if defined (GDK_WINDOWING_WIN32)
+  data->window_handle = (guintptr)GDK_WINDOW_HWND (window);
+#elif defined (GDK_WINDOWING_QUARTZ)
+  data->window_handle = gdk_quartz_window_get_nsview (window);
+#elif defined (GDK_WINDOWING_X11)
+  data->window_handle = GDK_WINDOW_XID (window);
+#endif
+}
+
+/* 
+ * Handlers for various button presses
+ */
+static void set_state_all(CustomData *data, GstState state)
+{
+   for (guint i = 0; i < data->streams->len; i++)
+   {
+      StreamData* stream = g_ptr_array_index(data->streams, i);
+      if (stream->pipeline)
+      {
+         gst_element_set_state(stream->pipeline, state);
+      }
+   }
+}
+
+/*
+ * With --timeshift, pause and play freeze and continue the picture but the
+ * pipelines keep running, so the cameras aren't disconnected
+ */
+
+static void play_cb(GtkButton *button, CustomData *data) 
+{
+  if (opt_timeshift > 0)
+  {
+    for (guint i = 0; i < data->streams->len; i++)
+    {
+      StreamData *stream = g_ptr_array_index (data->streams, i);
+      if (stream->selector)
+      {
+        timeshift_resume (stream);
+      }
+    }
+    return;
+  }
+  set_state_all(data, GST_STATE_PLAYING);
+}
+
+static void pause_cb(GtkButton *button, CustomData *data) 
+{
+  if (opt_timeshift > 0)
+  {
+    for (guint i = 0; i < data->streams->len; i++)
+    {
+      StreamData *stream = g_ptr_array_index (data->streams, i);
+      if (stream->selector)
+      {
+        timeshift_pause (stream);
+      }
+    }
+    return;
+  }
+  set_state_all(data, GST_STATE_PAUSED);
+}
+
+static void live_cb(GtkButton *button, CustomData *data) 
+{
+  for (guint i = 0; i < data->streams->len; i++)
+  {
+    StreamData *stream = g_ptr_array_index (data->streams, i);
+    if (stream->selector)
+    {
+      timeshift_go_live (stream);
+    }
+  }
+  g_signal_handler_block (data->slider, data->slider_update_signal_id);
+  gtk_range_set_value (GTK_RANGE (data->slider), 0);
+  g_signal_handler_unblock (data->slider, data->slider_update_signal_id);
+}
+
+static void stop_cb (GtkButton *button, CustomData *data) 
+{
+  set_state_all(data, GST_STATE_READY);
+}
+
+static void snapshot_done_cb(GObject* source, GAsyncResult* result, StreamData* stream)
+{
+   GError* error = NULL;
+
+   if (stream_finish(result, &error))
+   {
+      g_print("%s: snapshot saved\n", stream->prefix);
+   }
+   else
+   {
+      g_printerr("Snapshot failed: %s\n", error->message);
+      g_error_free(error);
+   }
+}
+
+static void snapshot_cb(GtkButton *button, CustomData *data)
+{
+   for (guint i = 0; i < data->streams->len; i++)
+   {
+      StreamData* stream = g_ptr_array_index(data->streams, i);
+      gchar* filename = g_strdup_printf("%ssnapshot.png", stream->prefix);
+
+      stream_snapshot_async(stream, filename, opt_timeout * 1000, data->cancellable, (GAsyncReadyCallback)snapshot_done_cb, stream);
+      g_free(filename);
+   }
+}
+
+/* 
+ * This function is called when the main window is closed 
+ */
+
+static void delete_event_cb(GtkWidget *widget, GdkEvent *event, CustomData *data) 
+{
+  g_cancellable_cancel (data->cancellable);
+  stop_cb (NULL, data);
+  gtk_main_quit ();
+}
+
+/* This function is called everytime the video window needs to be redrawn (due
+ * to damage/exposure, rescaling, etc). GStreamer takes care of this in the
+ * PAUSED and PLAYING states, otherwise, we simply draw a black rectangle to
+ * avoid garbage showing up. 
+ */
+
+static gboolean draw_cb(GtkWidget *widget, cairo_t *cr, StreamData *data) 
+{
+	if (data->state < GST_STATE_PAUSED)
+	{
+		GtkAllocation allocation;
+
+		/* Cairo is a 2D graphics library which we use here to clean the video window.
+		 * It is used by GStreamer for other reasons, so it will always be available to us. */
+		gtk_widget_get_allocation (widget, &allocation);
+		cairo_set_source_rgb (cr, 0, 0, 0);
+		cairo_rectangle (cr, 0, 0, allocation.width, allocation.height);
+		cairo_fill (cr);
+	}
+	return FALSE;
+}
+
+/* 
+ * This function is called when the slider changes its position. We perform a
+ * seek to the new position here. With --timeshift the slider goes from
+ * -timeshift to 0 seconds, relative to the live edge
+ */
+
+static void slider_cb (GtkRange *range, CustomData *data) 
+{
+  gdouble value = gtk_range_get_value (GTK_RANGE (data->slider));
+
+  if (opt_timeshift > 0)
+  {
+    if (value >= 0)
+    {
+      live_cb (NULL, data);
+      return;
+    }
+    for (guint i = 0; i < data->streams->len; i++)
+    {
+      StreamData *stream = g_ptr_array_index (data->streams, i);
+      if (stream->selector)
+      {
+        timeshift_seek (stream, -value);
+      }
+    }
+    return;
+  }
+  for (guint i = 0; i < data->streams->len; i++)
+  {
+    StreamData *stream = g_ptr_array_index (data->streams, i);
+    if (!stream->pipeline)
+    {
+      continue;
+    }
+    gst_element_seek_simple (stream->pipeline, GST_FORMAT_TIME, GST_SEEK_FLAG_FLUSH | GST_SEEK_FLAG_KEY_UNIT,
+        (gint64)(value * GST_SECOND));
+  }
+}
+
+/* 
+ * This creates all the GTK+ widgets that compose our application, and registers the callbacks 
+ */
+
+static void create_ui (CustomData *data) 
+{
+  GtkWidget *main_window;  /* The uppermost window, containing all other windows */
+  GtkWidget *video_grid;   /* Grid of drawing areas, one per stream, where the video will be shown */
+  GtkWidget *main_box;     /* VBox to hold main_hbox and the controls */
+  GtkWidget *main_hbox;    /* HBox to hold the video_grid and the stream info text widget */
+  GtkWidget *controls;     /* HBox to hold the buttons and the slider */
+  GtkWidget *play_button, *pause_button, *stop_button, *snapshot_button, *live_button; /* Buttons */
+  guint columns = 1;
+
+  main_window = gtk_window_new (GTK_WINDOW_TOPLEVEL);
+  g_signal_connect (G_OBJECT (main_window), "delete-event", G_CALLBACK (delete_event_cb), data);
+
+  video_grid = gtk_grid_new ();
+  gtk_grid_set_row_homogeneous (GTK_GRID (video_grid), TRUE);
+  gtk_grid_set_column_homogeneous (GTK_GRID (video_grid), TRUE);
+  while (columns * columns < data->streams->len)
+  {
+    columns++;
+  }
+  for (guint i = 0; i < data->streams->len; i++)
+  {
+    StreamData *stream = g_ptr_array_index (data->streams, i);
+
+    stream->video_window = gtk_drawing_area_new ();
+    gtk_widget_set_double_buffered (stream->video_window, FALSE);
+    gtk_widget_set_hexpand (stream->video_window, TRUE);
+    gtk_widget_set_vexpand (stream->video_window, TRUE);
+    g_signal_connect (stream->video_window, "realize", G_CALLBACK (realize_cb), stream);
+    g_signal_connect (stream->video_window, "draw", G_CALLBACK (draw_cb), stream);
+    gtk_grid_attach (GTK_GRID (video_grid), stream->video_window, i % columns, i / columns, 1, 1);
+  }
+
+  play_button = gtk_button_new_from_icon_name ("media-playback-start", GTK_ICON_SIZE_SMALL_TOOLBAR);
+  g_signal_connect (G_OBJECT (play_button), "clicked", G_CALLBACK (play_cb), data);
+
+  pause_button = gtk_button_new_from_icon_name ("media-playback-pause", GTK_ICON_SIZE_SMALL_TOOLBAR);
+  g_signal_connect (G_OBJECT (pause_button), "clicked", G_CALLBACK (pause_cb), data);
+
+  stop_button = gtk_button_new_from_icon_name ("media-playback-stop", GTK_ICON_SIZE_SMALL_TOOLBAR);
+  g_signal_connect (G_OBJECT (stop_button), "clicked", G_CALLBACK (stop_cb), data);
+
+  snapshot_button = gtk_button_new_from_icon_name ("camera-photo", GTK_ICON_SIZE_SMALL_TOOLBAR);
+  g_signal_connect (G_OBJECT (snapshot_button), "clicked", G_CALLBACK (snapshot_cb), data);
+
+  live_button = gtk_button_new_from_icon_name ("media-skip-forward", GTK_ICON_SIZE_SMALL_TOOLBAR);
+  gtk_widget_set_tooltip_text (live_button, "Back to live");
+  gtk_widget_set_sensitive (live_button, opt_timeshift > 0);
+  g_signal_connect (G_OBJECT (live_button), "clicked", G_CALLBACK (live_cb), data);
+
+  if (opt_timeshift > 0)
+  {
+    data->slider = gtk_scale_new_with_range (GTK_ORIENTATION_HORIZONTAL, -opt_timeshift, 0, 1);
+    gtk_range_set_value (GTK_RANGE (data->slider), 0);
+  }
+  else
+  {
+    data->slider = gtk_scale_new_with_range (GTK_ORIENTATION_HORIZONTAL, 0, 100, 1);
+  }
+  gtk_scale_set_draw_value (GTK_SCALE (data->slider), 0);
+  data->slider_update_signal_id = g_signal_connect (G_OBJECT (data->slider), "value-changed", G_CALLBACK (slider_cb), data);
+
+  data->streams_list = gtk_text_view_new ();
+  gtk_text_view_set_editable (GTK_TEXT_VIEW (data->streams_list), FALSE);
+  gtk_text_view_set_cursor_visible (GTK_TEXT_VIEW (data->streams_list), FALSE);
+  gtk_text_view_set_monospace (GTK_TEXT_VIEW (data->streams_list), TRUE);
+
+  controls = gtk_box_new (GTK_ORIENTATION_HORIZONTAL, 0);
+  gtk_box_pack_start (GTK_BOX (controls), play_button, FALSE, FALSE, 2);
+  gtk_box_pack_start (GTK_BOX (controls), pause_button, FALSE, FALSE, 2);
+  gtk_box_pack_start (GTK_BOX (controls), stop_button, FALSE, FALSE, 2);
+  gtk_box_pack_start (GTK_BOX (controls), snapshot_button, FALSE, FALSE, 2);
+  gtk_box_pack_start (GTK_BOX (controls), live_button, FALSE, FALSE, 2);
+  gtk_box_pack_start (GTK_BOX (controls), data->slider, TRUE, TRUE, 2);
+
+  main_hbox = gtk_box_new (GTK_ORIENTATION_HORIZONTAL, 0);
+  gtk_box_pack_start (GTK_BOX (main_hbox), video_grid, TRUE, TRUE, 0);
+  gtk_box_pack_start (GTK_BOX (main_hbox), data->streams_list, FALSE, FALSE, 2);
+
+  main_box = gtk_box_new (GTK_ORIENTATION_VERTICAL, 0);
+  gtk_box_pack_start (GTK_BOX (main_box), main_hbox, TRUE, TRUE, 0);
+  gtk_box_pack_start (GTK_BOX (main_box), controls, FALSE, FALSE, 0);
+  gtk_container_add (GTK_CONTAINER (main_window), main_box);
+  gtk_window_set_default_size (GTK_WINDOW (main_window), 640, 480);
+
+  gtk_widget_show_all (main_window);
+}
+
+/* 
+ * Called every second to print some time info
+ */
+
+static void update_stream_timeinfo(StreamData *data) 
+{
+  gint64 current = -1;
+
+  /* We do not want to update anything unless we are in the PAUSED or PLAYING states */
+  if (data->state < GST_STATE_PAUSED)
+  {
+    return;
+  }
+
+  if (gst_element_query_position(data->pipeline, GST_FORMAT_TIME, &current)) 
+  {
+
+     GstClockTimeDiff diff = GST_CLOCK_DIFF(current, data->last_pts);
+     g_print("%sLast PTS: %" GST_TIME_FORMAT ", current: %" GST_TIME_FORMAT ", Diff with current: %li.%03lims\n", data->prefix, GST_TIME_ARGS(data->last_pts), GST_TIME_ARGS(current), diff / 1000000, (labs(diff) / 1000) % 1000);
+  }
+}
+
+static gboolean update_timeinfo(CustomData *data) 
+{
+  gint64 now = g_get_monotonic_time();
+  gdouble interval = data->cpu_sample_time ? (now - data->cpu_sample_time) / 1e6 : 0;
+  gdouble process = process_cpu_seconds(), streams = 0;
+  StreamSample sample;
+
+  for (guint i = 0; i < data->streams->len; i++)
+  {
+    StreamData *stream = g_ptr_array_index(data->streams, i);
+
+    update_stream_timeinfo(stream);
+    streams += stream_report_cpu(stream, interval);
+    latency_control(stream, interval);
+    if (stream->state >= GST_STATE_PAUSED)
+    {
+      stream_check_memory(stream);
+      stream_report_av(stream);
+      hls_report(stream);
+      stream_report_loss(stream);
+      srt_report(stream);
+      relay_report(stream);
+    }
+    if (stream_stats_sample(stream, interval, &sample))
+    {
+      stats_file_write(stream, &sample.record);
+      slo_evaluate(stream, &sample);
+      stream->panel_sample = sample;
+    }
+  }
+  if (opt_whep_test)
+  {
+    whep_test_report();
+  }
+  if (interval > 0)
+  {
+    gdouble process_percent = (process - data->cpu_process_last) * 100 / interval;
+
+    if (opt_verbose)
+    {
+      g_print("CPU: process %.1f%%, unattributed %.1f%%\n", process_percent, (process - streams - data->cpu_unattributed_last) * 100 / interval);
+    }
+    if (opt_cpu_budget > 0)
+    {
+      governor_step(data, process_percent);
+    }
+  }
+  data->cpu_sample_time = now;
+  data->cpu_process_last = process;
+  data->cpu_unattributed_last = process - streams;
+  return TRUE;
+}
+
+/* 
+ * An error message was posted on the bus 
+ */
+
+static void error_cb(GstBus *bus, GstMessage *msg, StreamData *data) 
+{
+  GError *err;
+  gchar *debug_info;
+
+  /* Print error details on the screen */
+  gst_message_parse_error (msg, &err, &debug_info);
+  g_printerr ("Error received from element %s: %s\n", GST_OBJECT_NAME (msg->src), err->message);
+  g_printerr ("Debugging information: %s\n", debug_info ? debug_info : "none");
+
+  /* Whoever waits for this stream won't get what they wait for */
+  stream_ops_return (data, STREAM_OP_CONNECT, err);
+  stream_ops_return (data, STREAM_OP_FRAME, err);
+  stream_ops_return (data, STREAM_OP_PACKET, err);
+  g_clear_error (&err);
+  g_free (debug_info);
+
+  /* Set the pipeline to READY (which stops playback) */
+  gst_element_set_state (data->pipeline, GST_STATE_READY);
+}
+
+/* 
+ * This function is called when an End-Of-Stream message is posted on the bus.
+ * We just set the pipeline to READY (which stops playback) 
+ */
+
+static void eos_cb (GstBus *bus, GstMessage *msg, StreamData *data) {
+  g_print ("%sEnd-Of-Stream reached.\n", data->prefix);
+  if (opt_replay_start && GST_CLOCK_TIME_IS_VALID (data->first_pts))
+  {
+    gdouble wall = (g_get_monotonic_time () - data->handshake_time) / 1e6;
+    gdouble media = GST_CLOCK_DIFF (data->first_pts, data->last_pts) / 1e9;
+
+    g_print ("%sReplayed %.1fs of recording, %zi frames, in %.1fs (%.1fx)\n", data->prefix, ABS (media),
+        stat_get (&data->stats.decoder_out_frames), wall, wall > 0 ? ABS (media) / wall : 0.0);
+  }
+  gst_element_set_state (data->pipeline, GST_STATE_READY);
+}
+
+static void handoff_cb(GstElement* identity, GstBuffer* buffer, StreamData *data)
+{
+  cpu_stage(data, CPU_RENDER);
+  data->last_pts = GST_BUFFER_PTS(buffer);
+  if (!GST_CLOCK_TIME_IS_VALID(data->first_pts))
+  {
+    data->first_pts = data->last_pts;
+  }
+
+  /* Somebody waits for a frame (stream_first_frame_async), tell application_cb */
+  if (g_atomic_int_compare_and_exchange(&data->frame_wanted, 1, 0))
+  {
+    gst_element_post_message(identity, gst_message_new_application(GST_OBJECT(identity),
+          gst_structure_new("frame-ready", "pts", G_TYPE_UINT64, GST_BUFFER_PTS(buffer), NULL)));
+  }
+}
+
+/* 
+ * This function is called when the pipeline changes states. We use it to
+ * keep track of the current state. 
+ */
+
+static void state_changed_cb(GstBus *bus, GstMessage *msg, StreamData *data) 
+{
+   GstState old_state, new_state, pending_state;
+
+   /* Only the pipeline itself is of interest, not each of its elements */
+   if (GST_MESSAGE_SRC (msg) != GST_OBJECT (data->pipeline))
+   {
+      return;
+   }
+   gst_message_parse_state_changed (msg, &old_state, &new_state, &pending_state);
+
+   data->state = new_state;
+   g_print ("%sState set to %s\n", data->prefix, gst_element_state_get_name (new_state));
+   if (old_state == GST_STATE_READY && new_state == GST_STATE_PAUSED) 
+   {
+      /* Refresh the GUI as soon as we reach the PAUSED state */
+      update_stream_timeinfo(data);
+   }
+   if (new_state == GST_STATE_PAUSED && data->capture_replay)
+   {
+      capture_replay_start(data);
+   }
+   if (new_state == GST_STATE_PLAYING)
+   {
+      stream_ops_return (data, STREAM_OP_CONNECT, NULL);
+   }
+}
+
+/*
+ * See GstBusSyncHandler documentation
+ *
+ * Note: user_data must be valid pointer to StreamData
+ */
+
+static GstBusSyncReply tell_window(GstBus * bus, GstMessage * message, StreamData* data)
+{
+   /* Posted from the streaming thread itself, see cpu_thread_enter() */
+   if (GST_MESSAGE_TYPE(message) == GST_MESSAGE_STREAM_STATUS)
+   {
+      GstStreamStatusType type;
+      GstElement* owner;
+
+      gst_message_parse_stream_status(message, &type, &owner);
+      if (type == GST_STREAM_STATUS_TYPE_ENTER)
+      {
+         cpu_thread_enter(data, owner);
+      }
+      else if (type == GST_STREAM_STATUS_TYPE_LEAVE)
+      {
+         cpu_thread_leave(data);
+      }
+      return GST_BUS_PASS;
+   }
+
+   // ignore anything but 'prepare-window-handle' element messages
+   if (!gst_is_video_overlay_prepare_window_handle_message(message))
+   {
+      return GST_BUS_PASS;
+   }
+
+   gst_video_overlay_set_window_handle(GST_VIDEO_OVERLAY (GST_MESSAGE_SRC (message)), data->window_handle);
+   gst_message_unref (message);
+   return GST_BUS_DROP;
+}
+
+/* 
+ * This function is called when an "application" message is posted on the bus.
+ * Here we retrieve the message posted by the tags_cb callback, the
+ * "frame-ready" message posted by handoff_cb and the "packet-ready" message
+ * posted by depay_sink_probe
+ */
+
+static void application_cb(GstBus *bus, GstMessage *msg, StreamData *data) 
+{
+	const gchar *name = gst_structure_get_name (gst_message_get_structure (msg));
+
+	if (g_strcmp0 (name, "tags-changed") == 0) 
+	{
+		/* removed */
+	}
+	else if (g_strcmp0 (name, "frame-ready") == 0)
+	{
+		stream_ops_return (data, STREAM_OP_FRAME, NULL);
+	}
+	else if (g_strcmp0 (name, "packet-ready") == 0)
+	{
+		stream_ops_return (data, STREAM_OP_PACKET, NULL);
+	}
+}
+
+/*
+ * QOS message sent on the bus. For now we don't do much, just print.
+ *
+ * But it's a starting point for more specific handling...
+ */
+
+static void qos_cb(GstBus *bus, GstMessage *msg, StreamData *data) 
+{
+   guint64 running_time;
+   guint64 stream_time;
+   guint64 timestamp;
+   guint64 duration;
+   gboolean live;
+
+   GstFormat format;
+   guint64 processed;
+   guint64 dropped;
+
+   gint64 jitter;
+   gdouble proportion;
+   gint quality;
+
+   gst_message_parse_qos(msg, &live, &running_time, &stream_time, &timestamp, &duration);
+   gst_message_parse_qos_stats (msg, &format, &processed, &dropped);
+   gst_message_parse_qos_values (msg, &jitter, &proportion, &quality);
+   data->qos_events++;
+
+   /* Frames the decoder dropped no longer count as held by it */
+   if (GST_IS_VIDEO_DECODER (GST_MESSAGE_SRC (msg)) && dropped > data->decoder_qos_dropped)
+   {
+      stat_add(&data->stats.decoder_gone_frames, dropped - data->decoder_qos_dropped);
+      data->decoder_qos_dropped = dropped;
+   }
+
+   g_print(
+         "%sQOS! running_time: %" GST_TIME_FORMAT ", stream_time: %" GST_TIME_FORMAT 
          ", ts: %" GST_TIME_FORMAT ", duration: %" GST_TIME_FORMAT
          ", processed: %lu, dropped: %lu, jitter: %li\n",
+         data->prefix,
          GST_TIME_ARGS(running_time), 
          GST_TIME_ARGS(stream_time),
          GST_TIME_ARGS(timestamp),
@@ -377,150 +7601,882 @@ static void qos_cb(GstBus *bus, GstMessage *msg, CustomData *data)
 }
 
 /*
- * Handler for dynamic adding of rtsp pad, which only appears after
- * initialization. See:
- *
- * https://gstreamer.freedesktop.org/documentation/application-development/basics/pads.html
+ * Handler for dynamic adding of rtsp pad, which only appears after
+ * initialization. See:
+ *
+ * https://gstreamer.freedesktop.org/documentation/application-development/basics/pads.html
+ *
+ * Credits: https://stackoverflow.com/questions/32233370/
+ */
+
+static void rtsp_pad_added_cb(GstElement* element, GstPad* pad, StreamData* stream)
+{
+   gchar* name;
+   GstCaps* caps;
+   const gchar *media = NULL, *encoding = NULL;
+   GstElement* target;
+
+   /* rtpbin, when replaying a capture, also adds the sink pads we request */
+   if (GST_PAD_DIRECTION(pad) != GST_PAD_SRC)
+   {
+      return;
+   }
+
+   caps = gst_pad_get_current_caps(pad);
+   if (!caps)
+   {
+      caps = gst_pad_query_caps(pad, NULL);
+   }
+   if (caps && gst_caps_get_size(caps) > 0)
+   {
+      GstStructure* s = gst_caps_get_structure(caps, 0);
+      media = gst_structure_get_string(s, "media");
+      encoding = gst_structure_get_string(s, "encoding-name");
+   }
+
+   if (g_strcmp0(media, "audio") == 0)
+   {
+      if (opt_audio_buffer > 0 && encoding)
+      {
+         stream_add_audio(stream, element, pad, encoding);
+      }
+   }
+   else if (g_strcmp0(media, "application") == 0)
+   {
+      if (stream->overlay && g_strcmp0(encoding, "VND.ONVIF.METADATA") == 0)
+      {
+         stream_add_metadata(stream, element, pad);
+      }
+   }
+   else if (media == NULL || g_strcmp0(media, "video") == 0)
+   {
+      name = gst_pad_get_name(pad);
+      target = stream_get_element(stream, "onvifparse");
+      if (!target)
+      {
+         target = stream_get_element(stream, "depay");
+      }
+      if (!target || !gst_element_link_pads(element, name, target, "sink"))
+      {
+         printf("Failed to link elements\n");
+      }
+      g_clear_object(&target);
+      g_free(name);
+   }
+   if (caps)
+   {
+      gst_caps_unref(caps);
+   }
+}
+
+/*
+ * Create video pipeline and take care of naming all the elements. It replaces
+ * 
+ * gst_parse_launch("rtspsrc location=<url> user-id=<user> user-pw=<pw> latency=0 ! 
+ * rtpjitterbuffer latency=80 ! rtph264depay ! avdec_h264 ! identity ! autovideosink", NULL);
+ *
+ * and brings the advantage (later on) that we can address each element
+ * individually and add the callback to the identity more easily
+ *
+ * Note that rtspsrc has an rtpjitterbuffer inside so you shouldn't insert it
+ * in the pipeline like above
+ *
+ * https://gstreamer.freedesktop.org/documentation/additional/rtp.html?gi-language=c
+ * https://gstreamer.freedesktop.org/documentation/rtsp/rtspsrc.html?gi-language=c#rtspsrc-page
+ *
+ */
+
+static GstElement* create_pipeline(const char* pipeline_prefix, const char *url, const char* username, const char* password, StreamData* stream)
+{
+   char buf[64];
+   int offs = strlen(pipeline_prefix);
+
+   if (offs < sizeof(buf))
+   {
+      strcpy(buf, pipeline_prefix);
+      strcpy(buf+offs, "videoplayer");
+      GstElement* pipeline = gst_pipeline_new(buf);
+
+      strcpy(buf+offs, "source");
+      gboolean is_rtsp = strstr(url, "://") != NULL;
+      GstElement* rtp_source;
+      if (g_str_has_prefix(url, "whep://") || g_str_has_prefix(url, "wheps://"))
+      {
+         /* See whep_ingest_thread() */
+         rtp_source = gst_element_factory_make ("webrtcbin", buf);
+         if (rtp_source)
+         {
+            whep_ingest_setup(stream, rtp_source);
+         }
+      }
+      else if (g_str_has_prefix(url, "srt://"))
+      {
+         /* See srt_ingest_create() */
+         rtp_source = srt_ingest_create(stream, buf, url);
+      }
+      else if (is_rtsp)
+      {
+         rtp_source = gst_element_factory_make ("rtspsrc", buf);
+         /*
+          * Setting ntp-time-source=2 removes considerable latency in case of no
+          * timesync. It makes it as nearly fast as Low Latency Viewer, the
+          * latency value for dejitter being the only difference
+          */
+         g_object_set(G_OBJECT(rtp_source), "location", url, "user-id", username, "user-pw", password, "latency", opt_latency, "ntp-time-source", 2, NULL);
+         if (opt_capture)
+         {
+            gchar* filename = g_strconcat(pipeline_prefix, opt_capture, NULL);
+            stream->capture_file = capture_create(filename);
+            if (stream->capture_file)
+            {
+               stream->capture_writer = g_thread_pool_new((GFunc)capture_writer, stream, 1, FALSE, NULL);
+            }
+            g_free(filename);
+         }
+      }
+      else
+      {
+         /* A capture file, see capture_replay_setup() */
+         rtp_source = gst_element_factory_make ("rtpbin", buf);
+         g_object_set(G_OBJECT(rtp_source), "latency", opt_capture_fast ? 0 : opt_latency, NULL);
+      }
+
+      strcpy(buf+offs, "depay");
+      GstElement* depay = gst_element_factory_make (stream->srt_source ? "h264parse" : "rtph264depay", buf);
+      strcpy(buf+offs, "decoder");
+      GstElement* decoder = gst_element_factory_make ("avdec_h264", buf);
+      if (decoder && stream->concealment == CONCEAL_DROP)
+      {
+         /* Nothing damaged out of the decoder either, see refresh_loss() */
+         g_object_set(G_OBJECT(decoder), "output-corrupt", FALSE, NULL);
+      }
+      strcpy(buf+offs, "identity");
+      GstElement* identity = gst_element_factory_make ("identity", buf);
+      strcpy(buf+offs, "sink");
+      GstElement* sink = gst_element_factory_make ("xvimagesink", buf);
+      GstElement* onvifparse = NULL;
+      if (opt_metadata)
+      {
+         strcpy(buf+offs, "overlay");
+         stream->overlay = gst_element_factory_make ("overlaycomposition", buf);
+         if (!stream->overlay)
+         {
+            g_warning("No overlaycomposition, the metadata won't be shown");
+         }
+      }
+      // g_object_set(G_OBJECT(sink), "sync", FALSE, NULL);
+      g_object_set(G_OBJECT(sink), "qos", TRUE, NULL);
+      g_object_set(G_OBJECT(sink), "render-delay", 0, NULL);
+
+      if (!is_rtsp && opt_capture_fast)
+      {
+         g_object_set(G_OBJECT(sink), "sync", FALSE, "qos", FALSE, NULL);
+      }
+      if (opt_replay_start && is_rtsp && !stream->whep_source && !stream->srt_source)
+      {
+         /* See stream_replay_seek() */
+         g_object_set(G_OBJECT(rtp_source), "onvif-mode", TRUE, "onvif-rate-control", FALSE, NULL);
+         gst_util_set_object_arg(G_OBJECT(rtp_source), "protocols", "tcp");
+         g_object_set(G_OBJECT(sink), "sync", FALSE, "qos", FALSE, NULL);
+
+         /* Sets discont and keyframe flags from the ONVIF RTP header extension */
+         strcpy(buf+offs, "onvifparse");
+         onvifparse = gst_element_factory_make ("rtponvifparse", buf);
+         if (!onvifparse)
+         {
+            g_warning("Failed to create rtponvifparse!");
+            gst_object_unref(pipeline);
+            return NULL;
+         }
+         gst_bin_add(GST_BIN(pipeline), onvifparse);
+         gst_element_link(onvifparse, depay);
+      }
+
+      if (rtp_source && depay && decoder && identity && sink)
+      {
+         GstElement* video_out = depay;    /* Or the tee for LL-HLS and WebRTC */
+
+         gst_bin_add_many(GST_BIN(pipeline), rtp_source, depay, decoder, identity, sink, NULL);
+         g_signal_connect(rtp_source, "pad-added", G_CALLBACK(rtsp_pad_added_cb), stream);
+         if (stream->srt_demux && !(gst_bin_add(GST_BIN(pipeline), stream->srt_demux) && gst_element_link(rtp_source, stream->srt_demux)))
+         {
+            gst_object_unref(pipeline);
+            return NULL;
+         }
+         if (stream->hls || opt_whep_port > 0)
+         {
+            /* See stream_add_hls() and whep_viewer_add() */
+            strcpy(buf+offs, "tee");
+            GstElement* tee = gst_element_factory_make ("tee", buf);
+            g_object_set(G_OBJECT(tee), "allow-not-linked", TRUE, NULL);
+            gst_bin_add(GST_BIN(pipeline), tee);
+            if (!gst_element_link(depay, tee) || (stream->hls && !stream_add_hls(stream, pipeline, tee)))
+            {
+               gst_object_unref(pipeline);
+               return NULL;
+            }
+            video_out = tee;
+            g_atomic_pointer_set(&stream->tee, tee);
+         }
+         if (opt_timeshift > 0)
+         {
+            /* depay -> selector (live) and replay -> selector, see timeshift_seek() */
+            strcpy(buf+offs, "selector");
+            stream->selector = gst_element_factory_make ("input-selector", buf);
+            strcpy(buf+offs, "replay");
+            stream->replay = gst_element_factory_make ("appsrc", buf);
+            if (!stream->selector || !stream->replay)
+            {
+               g_warning("Failed to create the timeshift elements!");
+               gst_object_unref(pipeline);
+               return NULL;
+            }
+            g_object_set(G_OBJECT(stream->selector), "sync-streams", FALSE, NULL);
+            g_object_set(G_OBJECT(stream->replay), "is-live", TRUE, "format", GST_FORMAT_TIME, "min-latency", G_GINT64_CONSTANT(0), NULL);
+            g_signal_connect(stream->replay, "need-data", G_CALLBACK(replay_need_data_cb), stream);
+            g_signal_connect(stream->replay, "enough-data", G_CALLBACK(replay_enough_data_cb), stream);
+            gst_bin_add_many(GST_BIN(pipeline), stream->selector, stream->replay, NULL);
+
+            stream->live_pad = gst_element_request_pad_simple(stream->selector, "sink_%u");
+            stream->replay_pad = gst_element_request_pad_simple(stream->selector, "sink_%u");
+            {
+               GstPad* depay_pad = video_out == depay ? gst_element_get_static_pad(depay, "src") : gst_element_request_pad_simple(video_out, "src_%u");
+               GstPad* replay_pad = gst_element_get_static_pad(stream->replay, "src");
+
+               gst_pad_link(depay_pad, stream->live_pad);
+               gst_pad_link(replay_pad, stream->replay_pad);
+               gst_object_unref(depay_pad);
+               gst_object_unref(replay_pad);
+            }
+            g_object_set(G_OBJECT(stream->selector), "active-pad", stream->live_pad, NULL);
+            gst_pad_add_probe(stream->live_pad, GST_PAD_PROBE_TYPE_BUFFER, (GstPadProbeCallback)timeshift_record_probe, stream, NULL);
+            timeshift_init(&stream->timeshift, opt_timeshift);
+         }
+         if (stream->overlay)
+         {
+            /* identity -> overlay -> sink, see overlay_draw_cb() */
+            gst_bin_add(GST_BIN(pipeline), stream->overlay);
+            g_signal_connect(stream->overlay, "draw", G_CALLBACK(overlay_draw_cb), stream);
+            g_signal_connect(stream->overlay, "caps-changed", G_CALLBACK(overlay_caps_changed_cb), stream);
+         }
+         if (gst_element_link(opt_timeshift > 0 ? stream->selector : video_out, decoder) &&
+             (opt_relay_port > 0 ? stream_add_relay(stream, pipeline, decoder, identity) : gst_element_link(decoder, identity)) &&
+             (stream->overlay ? gst_element_link_many(identity, stream->overlay, sink, NULL) : gst_element_link(identity, sink))) 
+         {
+            // https://stackoverflow.com/questions/45079457/gstreamer-buffer-pts#45083086
+            g_signal_connect(identity, "handoff", G_CALLBACK(handoff_cb), stream);
+            stream_add_memory_probes(stream, rtp_source, depay, decoder);
+            if (!is_rtsp && !capture_replay_setup(stream, pipeline, rtp_source))
+            {
+               gst_object_unref(pipeline);
+               return NULL;
+            }
+
+            if (opt_hugepages)
+            {
+               GstPad* pad = gst_element_get_static_pad(decoder, "src");
+               guint width = 0, height = 0;
+
+               stream->frame_allocator = huge_page_allocator_new(opt_hugepages_explicit, opt_mlock);
+               if (sscanf(opt_prealloc_resolution, "%ux%u", &width, &height) == 2)
+               {
+                  huge_page_allocator_prealloc(stream->frame_allocator, width * height * 3 / 2, opt_prealloc_frames);
+               }
+               gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_QUERY_DOWNSTREAM | GST_PAD_PROBE_TYPE_PULL, (GstPadProbeCallback)decoder_allocation_probe, stream, NULL);
+               gst_object_unref(pad);
+            }
+            return pipeline;
+         }
+         g_warning("Failed to link elements!");
+      }
+      else
+      {
+         g_warning("Failed to create one or more elements!");
+      }
+   }
+   return NULL;
+}
+
+/*
+ * --bench-rss: once all streams run and had time to settle, average the RSS
+ * over 10 seconds and report it per stream, relative to the RSS before the
+ * pipelines were created
+ */
+
+#define BENCH_RSS_SAMPLES 10
+
+static gboolean bench_rss_sample(CustomData* app)
+{
+   gsize rss;
+
+   app->rss_sum += read_rss();
+   if (++app->rss_samples < BENCH_RSS_SAMPLES)
+   {
+      return G_SOURCE_CONTINUE;
+   }
+
+   rss = app->rss_sum / BENCH_RSS_SAMPLES;
+   g_print("RSS: %zukB before, %zukB steady state, %zukB per stream\n",
+         app->base_rss / 1024, rss / 1024, (rss - MIN(rss, app->base_rss)) / app->streams->len / 1024);
+   for (guint i = 0; i < app->streams->len; i++)
+   {
+      StreamData* stream = g_ptr_array_index(app->streams, i);
+      GstElement* sink = stream_get_element(stream, "sink");
+      GstPad* pad = gst_element_get_static_pad(sink, "sink");
+      GstCaps* caps = gst_pad_get_current_caps(pad);
+      gint width = 0, height = 0;
+      StreamMemory mem;
+
+      if (caps)
+      {
+         GstStructure* s = gst_caps_get_structure(caps, 0);
+         gst_structure_get_int(s, "width", &width);
+         gst_structure_get_int(s, "height", &height);
+         gst_caps_unref(caps);
+      }
+      gst_object_unref(pad);
+      gst_object_unref(sink);
+      stream_get_memory(stream, &mem);
+      g_print("%s%dx%d, accounted %zukB\n", stream->prefix, width, height, mem.total / 1024);
+   }
+   gtk_main_quit();
+   return G_SOURCE_REMOVE;
+}
+
+static gboolean bench_rss_start(CustomData* app)
+{
+   g_timeout_add_seconds(1, (GSourceFunc)bench_rss_sample, app);
+   return G_SOURCE_REMOVE;
+}
+
+/*
+ * Decode benchmark
  *
- * Credits: https://stackoverflow.com/questions/32233370/
+ * How many streams of a profile can this box decode? --decode-bench=N takes
+ * capture files (see capture_write) and runs the depay ! decoder part of
+ * create_pipeline into a fakesink that doesn't sync, first on 1 pipeline,
+ * then on 2, up to N, all in parallel. Pipeline i decodes file i modulo the
+ * number of files. For each step the aggregate and per stream fps and the
+ * CPU use are printed, the scaling column compares with N times the single
+ * stream fps. No GUI, no jitterbuffer, the packets go in as captured
  */
 
-static void rtsp_pad_added_cb(GstElement* element, GstPad* pad, gpointer data)
+typedef struct
 {
-   gchar* name = gst_pad_get_name(pad);
-   if (!gst_element_link_pads(element, name, GST_ELEMENT(data), "sink"))
+   GstElement*  pipeline;
+   GMappedFile* file;
+   guint        session;
+   gsize        offset;              /* Next record to push */
+   guint64      frames;
+   gint64       end_time;
+}
+BenchStream;
+
+typedef struct
+{
+   GMainLoop*   loop;
+   guint        running;
+}
+BenchRun;
+
+#define BENCH_PUSH_PACKETS 64
+
+static void bench_need_data_cb(GstAppSrc* appsrc, guint length, BenchStream* bench)
+{
+   const gchar* data = g_mapped_file_get_contents(bench->file);
+   gsize size = g_mapped_file_get_length(bench->file);
+   const CaptureRecord* record = NULL;
+   guint pushed = 0;
+
+   while (pushed < BENCH_PUSH_PACKETS && (record = capture_next(data, size, &bench->offset)) != NULL)
+   {
+      if (record->kind == CAPTURE_RTP && record->session == bench->session)
+      {
+         gst_app_src_push_buffer(appsrc, gst_buffer_new_wrapped_full(GST_MEMORY_FLAG_READONLY, (gpointer)(record + 1), record->length, 0, record->length,
+                  g_mapped_file_ref(bench->file), (GDestroyNotify)g_mapped_file_unref));
+         pushed++;
+      }
+   }
+   if (!record)
+   {
+      gst_app_src_end_of_stream(appsrc);
+   }
+}
+
+static GstPadProbeReturn bench_decoder_probe(GstPad* pad, GstPadProbeInfo* info, BenchStream* bench)
+{
+   bench->frames++;
+   return GST_PAD_PROBE_OK;
+}
+
+static gboolean bench_bus_cb(GstBus* bus, GstMessage* msg, BenchRun* run)
+{
+   switch (GST_MESSAGE_TYPE(msg))
    {
-      printf("Failed to link elements\n");
+   case GST_MESSAGE_ERROR:
+      {
+         GError* err = NULL;
+         gst_message_parse_error(msg, &err, NULL);
+         g_printerr("Error from %s: %s\n", GST_OBJECT_NAME(msg->src), err->message);
+         g_error_free(err);
+      }
+      /* fall through */
+   case GST_MESSAGE_EOS:
+      if (--run->running == 0)
+      {
+         g_main_loop_quit(run->loop);
+      }
+      return G_SOURCE_REMOVE;
+   default:
+      return G_SOURCE_CONTINUE;
    }
+}
+
+static GstElement* bench_create_pipeline(guint index, BenchStream* bench, GstCaps* caps)
+{
+   gchar* name = g_strdup_printf("bench%u", index + 1);
+   GstElement* pipeline = gst_pipeline_new(name);
+   GstElement* src = gst_element_factory_make("appsrc", NULL);
+   GstElement* depay = gst_element_factory_make("rtph264depay", NULL);
+   GstElement* decoder = gst_element_factory_make("avdec_h264", NULL);
+   GstElement* sink = gst_element_factory_make("fakesink", NULL);
+   GstPad* pad;
+
    g_free(name);
+   if (!src || !depay || !decoder || !sink)
+   {
+      g_printerr("Failed to create one or more elements!\n");
+      gst_object_unref(pipeline);
+      return NULL;
+   }
+   g_object_set(G_OBJECT(src), "caps", caps, "format", GST_FORMAT_TIME, NULL);
+   g_signal_connect(src, "need-data", G_CALLBACK(bench_need_data_cb), bench);
+   g_object_set(G_OBJECT(sink), "sync", FALSE, NULL);
+   gst_bin_add_many(GST_BIN(pipeline), src, depay, decoder, sink, NULL);
+   gst_element_link_many(src, depay, decoder, sink, NULL);
+
+   pad = gst_element_get_static_pad(decoder, "src");
+   gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, (GstPadProbeCallback)bench_decoder_probe, bench, NULL);
+   gst_object_unref(pad);
+   return pipeline;
 }
 
 /*
- * Create video pipeline and take care of naming all the elements. It replaces
- * 
- * gst_parse_launch("rtspsrc location=<url> user-id=<user> user-pw=<pw> latency=0 ! 
- * rtpjitterbuffer latency=80 ! rtph264depay ! avdec_h264 ! identity ! autovideosink", NULL);
- *
- * and brings the advantage (later on) that we can address each element
- * individually and add the callback to the identity more easily
- *
- * Note that rtspsrc has an rtpjitterbuffer inside so you shouldn't insert it
- * in the pipeline like above
- *
- * https://gstreamer.freedesktop.org/documentation/additional/rtp.html?gi-language=c
- * https://gstreamer.freedesktop.org/documentation/rtsp/rtspsrc.html?gi-language=c#rtspsrc-page
+ * The end time is taken when the message is posted, not when the main loop
+ * gets to it
+ */
+
+static GstBusSyncReply bench_stream_done(GstBus* bus, GstMessage* msg, BenchStream* bench)
+{
+   if (GST_MESSAGE_TYPE(msg) == GST_MESSAGE_EOS || GST_MESSAGE_TYPE(msg) == GST_MESSAGE_ERROR)
+   {
+      bench->end_time = g_get_monotonic_time();
+   }
+   return GST_BUS_PASS;
+}
+
+static int decode_bench(int files, char** filenames)
+{
+   GMappedFile** mapped = g_new0(GMappedFile*, files);
+   GstCaps** caps = g_new0(GstCaps*, files);
+   guint* sessions = g_new0(guint, files);
+   guint cpus = g_get_num_processors();
+   gdouble single_fps = 0;
+   int result = 0;
+
+   for (int i = 0; i < files; i++)
+   {
+      caps[i] = capture_open(filenames[i], &mapped[i], &sessions[i]);
+      if (!caps[i])
+      {
+         g_printerr("%s is no capture file with video\n", filenames[i]);
+         result = -1;
+         goto done;
+      }
+   }
+
+   g_print("Streams  Aggregate fps  Per stream fps (min/avg)  CPU (of %u cores)  Scaling\n", cpus);
+   for (guint n = 1; n <= (guint)opt_decode_bench; n++)
+   {
+      BenchStream* benches = g_new0(BenchStream, n);
+      BenchRun run = { g_main_loop_new(NULL, FALSE), n };
+      gint64 start;
+      gdouble cpu, wall, total_frames = 0, min_fps = G_MAXDOUBLE, fps;
+
+      for (guint i = 0; i < n; i++)
+      {
+         GstBus* bus;
+
+         benches[i].file = mapped[i % files];
+         benches[i].session = sessions[i % files];
+         benches[i].offset = CAPTURE_HEADER_SIZE;
+         benches[i].pipeline = bench_create_pipeline(i, &benches[i], caps[i % files]);
+         if (!benches[i].pipeline)
+         {
+            while (i-- > 0)
+            {
+               gst_object_unref(benches[i].pipeline);
+            }
+            g_main_loop_unref(run.loop);
+            g_free(benches);
+            result = -1;
+            goto done;
+         }
+         bus = gst_element_get_bus(benches[i].pipeline);
+         gst_bus_set_sync_handler(bus, (GstBusSyncHandler)bench_stream_done, &benches[i], NULL);
+         gst_bus_add_watch(bus, (GstBusFunc)bench_bus_cb, &run);
+         gst_object_unref(bus);
+      }
+
+      cpu = process_cpu_seconds();
+      start = g_get_monotonic_time();
+      for (guint i = 0; i < n; i++)
+      {
+         gst_element_set_state(benches[i].pipeline, GST_STATE_PLAYING);
+      }
+      g_main_loop_run(run.loop);
+      wall = (g_get_monotonic_time() - start) / 1e6;
+      cpu = process_cpu_seconds() - cpu;
+
+      for (guint i = 0; i < n; i++)
+      {
+         gdouble stream_wall = (benches[i].end_time - start) / 1e6;
+         fps = stream_wall > 0 ? benches[i].frames / stream_wall : 0;
+         min_fps = MIN(min_fps, fps);
+         total_frames += benches[i].frames;
+         gst_element_set_state(benches[i].pipeline, GST_STATE_NULL);
+         gst_object_unref(benches[i].pipeline);
+      }
+      fps = total_frames / wall;
+      if (n == 1)
+      {
+         single_fps = fps;
+      }
+      g_print("%7u  %13.1f  %11.1f / %-11.1f  %6.0f%% (%5.2f cores)  %6.0f%%\n", n, fps, min_fps, fps / n,
+            100 * cpu / wall / cpus, cpu / wall, single_fps > 0 ? 100 * fps / (n * single_fps) : 0.0);
+
+      g_main_loop_unref(run.loop);
+      g_free(benches);
+   }
+
+done:
+   for (int i = 0; i < files; i++)
+   {
+      if (caps[i])
+      {
+         gst_caps_unref(caps[i]);
+      }
+      if (mapped[i])
+      {
+         g_mapped_file_unref(mapped[i]);
+      }
+   }
+   g_free(mapped);
+   g_free(caps);
+   g_free(sessions);
+   return result;
+}
+
+/*
+ * Startup of all streams
  *
+ * Building a pipeline takes a few ms of CPU (avdec_h264, the hugepage
+ * prefault), so for many cameras they are built on a thread pool. Each
+ * built stream queues for a handshake slot, startup_schedule() hands the
+ * slots out: no more than --max-handshakes RTSP handshakes at the same time
+ * and --max-host-handshakes per host, so an NVR that serves many of the
+ * cameras isn't hit by all of them at once. A slot is held from connect until
+ * the first RTP packet arrives (or the connect fails), then the stream waits
+ * for its first frame. The times of all steps are printed per camera
  */
 
-static GstElement* create_pipeline(const char* pipeline_prefix, const char *url, const char* username, const char* password, void* custom_data)
+static void first_frame_cb(GObject* source, GAsyncResult* result, StreamData* stream);
+static void startup_schedule(CustomData* app);
+
+static void startup_handshake_done(StreamData* stream)
 {
-   char buf[64];
-   int offs = strlen(pipeline_prefix);
+   CustomData* app = stream->app;
+   guint count;
 
-   if (offs < sizeof(buf))
+   if (!stream->handshaking)
    {
-      strcpy(buf, pipeline_prefix);
-      strcpy(buf+offs, "videoplayer");
-      GstElement* pipeline = gst_pipeline_new(buf);
+      return;
+   }
+   stream->handshaking = FALSE;
+   app->handshakes--;
+   count = GPOINTER_TO_UINT(g_hash_table_lookup(app->host_handshakes, stream->host));
+   g_hash_table_insert(app->host_handshakes, stream->host, GUINT_TO_POINTER(count - 1));
+   startup_schedule(app);
+}
 
-      strcpy(buf+offs, "source");
-      GstElement* rtp_source = gst_element_factory_make ("rtspsrc", buf);
-      /*
-       * Setting ntp-time-source=2 removes considerable latency in case of no
-       * timesync. It makes it as nearly fast as Low Latency Viewer, the
-       * latency value for dejitter being the only difference
-       */
-      g_object_set(G_OBJECT(rtp_source), "location", url, "user-id", username, "user-pw", password, "latency", 20, "ntp-time-source", 2, NULL);
+static void first_packet_cb(GObject* source, GAsyncResult* result, StreamData* stream)
+{
+   GError* error = NULL;
 
-      strcpy(buf+offs, "depay");
-      GstElement* depay = gst_element_factory_make ("rtph264depay", buf);
-      strcpy(buf+offs, "decoder");
-      GstElement* decoder = gst_element_factory_make ("avdec_h264", buf);
-      strcpy(buf+offs, "identity");
-      GstElement* identity = gst_element_factory_make ("identity", buf);
-      strcpy(buf+offs, "sink");
-      GstElement* sink = gst_element_factory_make ("xvimagesink", buf);
-      // g_object_set(G_OBJECT(sink), "sync", FALSE, NULL);
-      g_object_set(G_OBJECT(sink), "qos", TRUE, NULL);
-      g_object_set(G_OBJECT(sink), "render-delay", 0, NULL);
+   if (stream_finish(result, &error))
+   {
+      stream->packet_time = g_get_monotonic_time();
+   }
+   else if (!g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+   {
+      g_printerr("%s: no data: %s\n", stream->prefix, error->message);
+   }
+   g_clear_error(&error);
+   startup_handshake_done(stream);
+}
 
-      if (rtp_source && depay && decoder && identity && sink)
+static void connect_cb(GObject* source, GAsyncResult* result, StreamData* stream)
+{
+   GError* error = NULL;
+
+   if (!stream_finish(result, &error))
+   {
+      g_printerr("%s: connect failed: %s\n", stream->prefix, error->message);
+      g_error_free(error);
+      startup_handshake_done(stream);
+      return;
+   }
+   stream_first_frame_async(stream, opt_timeout * 1000, stream->app->cancellable, (GAsyncReadyCallback)first_frame_cb, stream);
+}
+
+static void startup_schedule(CustomData* app)
+{
+   GList* l = app->connect_queue.head;
+
+   while (l)
+   {
+      StreamData* stream = l->data;
+      GList* next = l->next;
+      guint count = GPOINTER_TO_UINT(g_hash_table_lookup(app->host_handshakes, stream->host));
+
+      if (opt_max_handshakes > 0 && app->handshakes >= (guint)opt_max_handshakes)
       {
-         gst_bin_add_many(GST_BIN(pipeline), rtp_source, depay, decoder, identity, sink, NULL);
-         g_signal_connect(rtp_source, "pad-added", G_CALLBACK(rtsp_pad_added_cb), depay);
-         if (gst_element_link_many(depay, decoder, identity, sink, NULL)) 
+         break;
+      }
+      if (opt_max_host_handshakes <= 0 || count < (guint)opt_max_host_handshakes)
+      {
+         g_queue_delete_link(&app->connect_queue, l);
+         stream->handshaking = TRUE;
+         stream->handshake_time = g_get_monotonic_time();
+         app->handshakes++;
+         g_hash_table_insert(app->host_handshakes, stream->host, GUINT_TO_POINTER(count + 1));
+
+         stream_first_packet_async(stream, opt_timeout * 1000, app->cancellable, (GAsyncReadyCallback)first_packet_cb, stream);
+         if (opt_replay_start && !stream->capture_replay)
          {
-            // https://stackoverflow.com/questions/45079457/gstreamer-buffer-pts#45083086
-            g_signal_connect(identity, "handoff", G_CALLBACK(handoff_cb), custom_data);
-            return pipeline;
+            /* rtspsrc is live, so PAUSED is reached right away */
+            gst_element_set_state(stream->pipeline, GST_STATE_PAUSED);
+            stream_replay_seek(stream);
          }
-         g_warning("Failed to link elements!");
+         stream_connect_async(stream, opt_timeout * 1000, app->cancellable, (GAsyncReadyCallback)connect_cb, stream);
       }
-      else
+      l = next;
+   }
+}
+
+/*
+ * The bus watch belongs to the main loop, so it is added here and not on the
+ * build thread
+ */
+
+static gboolean stream_built_idle(StreamData* stream)
+{
+   CustomData* app = stream->app;
+   GstBus *bus;
+
+   stream->built_time = g_get_monotonic_time();
+   stream->pipeline = stream->built_pipeline;
+   stream->built_pipeline = NULL;
+   if (++app->streams_built == app->streams->len)
+   {
+      g_print("All %u pipelines built after %.3fs\n", app->streams->len, (stream->built_time - app->start_time) / 1e6);
+   }
+   if (!stream->pipeline)
+   {
+      g_printerr("%s: error creating pipeline\n", stream->prefix);
+      return G_SOURCE_REMOVE;
+   }
+
+   bus = gst_element_get_bus(stream->pipeline);
+   gst_bus_set_sync_handler(bus, (GstBusSyncHandler) tell_window, stream, NULL);
+   gst_bus_add_signal_watch(bus);
+
+   g_signal_connect (G_OBJECT (bus), "message::error", (GCallback)error_cb, stream);
+   g_signal_connect (G_OBJECT (bus), "message::eos", (GCallback)eos_cb, stream);
+   g_signal_connect (G_OBJECT (bus), "message::state-changed", (GCallback)state_changed_cb, stream);
+   g_signal_connect (G_OBJECT (bus), "message::qos", (GCallback)qos_cb, stream);
+   g_signal_connect (G_OBJECT (bus), "message::latency", (GCallback)latency_cb, stream);
+   g_signal_connect (G_OBJECT (bus), "message::application", (GCallback)application_cb, stream);
+   gst_object_unref (bus);
+
+   g_queue_push_tail(&app->connect_queue, stream);
+   startup_schedule(app);
+   return G_SOURCE_REMOVE;
+}
+
+static void stream_build_func(StreamData* stream, CustomData* app)
+{
+   // data.pipeline = gst_parse_launch ("rtspsrc location=rtsp://192.168.0.33/axis-media/media.amp?resolution=1280x720 user-id=root user-pw=pass latency=40 ! rtph264depay ! avdec_h264 ! identity ! autovideosink", NULL);
+   stream->built_pipeline = create_pipeline(stream->prefix, stream->url, opt_user, opt_password, stream);
+   g_idle_add((GSourceFunc)stream_built_idle, stream);
+}
+
+static void startup_start(CustomData* app)
+{
+   guint threads = opt_build_threads > 0 ? (guint)opt_build_threads : g_get_num_processors();
+
+   app->start_time = g_get_monotonic_time();
+   app->host_handshakes = g_hash_table_new(g_str_hash, g_str_equal);
+   if (opt_metadata)
+   {
+      /* One thread, so the documents of a stream stay in order */
+      app->metadata_pool = g_thread_pool_new((GFunc)metadata_worker, app, 1, FALSE, NULL);
+   }
+   app->build_pool = g_thread_pool_new((GFunc)stream_build_func, app, MIN(threads, app->streams->len), FALSE, NULL);
+   for (guint i = 0; i < app->streams->len; i++)
+   {
+      g_thread_pool_push(app->build_pool, g_ptr_array_index(app->streams, i), NULL);
+   }
+}
+
+static void first_frame_cb(GObject* source, GAsyncResult* result, StreamData* stream)
+{
+   CustomData* app = stream->app;
+   GError* error = NULL;
+
+   if (!stream_finish(result, &error))
+   {
+      g_printerr("%s: no video: %s\n", stream->prefix, error->message);
+      g_error_free(error);
+      return;
+   }
+
+   g_print("%s: first frame after %.3fs (built %.3fs, handshake slot %.3fs, first packet %.3fs)\n", stream->prefix,
+         (g_get_monotonic_time() - app->start_time) / 1e6, (stream->built_time - app->start_time) / 1e6,
+         (stream->handshake_time - app->start_time) / 1e6, stream->packet_time ? (stream->packet_time - app->start_time) / 1e6 : -1.0);
+   if (++app->streams_started == app->streams->len)
+   {
+      g_print("All %u streams showing video after %.3fs, %.0fms after exec\n", app->streams->len, (g_get_monotonic_time() - app->start_time) / 1e6, ms_since_exec());
+      if (opt_exit_when_started)
       {
-         g_warning("Failed to create one or more elements!");
+         gtk_main_quit();
+      }
+      else if (opt_bench_rss > 0)
+      {
+         g_timeout_add_seconds(opt_bench_rss, (GSourceFunc)bench_rss_start, app);
       }
    }
-   return NULL;
 }
 
 int main(int argc, char *argv[]) 
 {
    CustomData data;
+   GOptionContext *context;
+   GError *error = NULL;
+   gdouble main_ms, gst_ms, gtk_ms;
 
-   GstStateChangeReturn ret;
-   GstBus *bus;
-
-   gtk_init (&argc, &argv);
-   gst_init (&argc, &argv);
+   main_ms = ms_since_exec();
    memset(&data, 0, sizeof (data));
    data.duration = GST_CLOCK_TIME_NONE;
 
-   /* Create the GUI (and save the window pointer) */
-   create_ui(&data);
+#ifdef DEMO_STATIC_PLUGINS
+   /* No registry, and none of the GTK modules a kiosk doesn't need */
+   g_setenv("GST_REGISTRY_DISABLE", "yes", TRUE);
+   g_setenv("NO_AT_BRIDGE", "1", TRUE);
+   g_setenv("GTK_IM_MODULE", "gtk-im-context-simple", TRUE);
+   g_unsetenv("GTK_MODULES");
+#endif
 
-   // data.pipeline = gst_parse_launch ("rtspsrc location=rtsp://192.168.0.33/axis-media/media.amp?resolution=1280x720 user-id=root user-pw=pass latency=40 ! rtph264depay ! avdec_h264 ! identity ! autovideosink", NULL);
-   data.pipeline = create_pipeline("input1-", argv[1], "root", "pass", &data);
-   if (!data.pipeline) 
+   /* GTK options are left in argv for gtk_init */
+   context = g_option_context_new("URL [URL...] - low latency live video");
+   g_option_context_add_main_entries(context, opt_entries, NULL);
+   g_option_context_add_group(context, gst_init_get_option_group());
+   g_option_context_set_ignore_unknown_options(context, TRUE);
+   if (!g_option_context_parse(context, &argc, &argv, &error))
    {
-      g_printerr ("Error creating pipeline\n");
+      g_printerr("%s\n", error->message);
       return -1;
    }
+   g_option_context_free(context);
+#ifdef DEMO_STATIC_PLUGINS
+   register_static_plugins();
+#endif
+   gst_ms = ms_since_exec();
 
-   bus = gst_element_get_bus(data.pipeline);
-   gst_bus_set_sync_handler(bus, (GstBusSyncHandler) tell_window, &data, NULL);
-   gst_bus_add_signal_watch(bus);
-
-   g_signal_connect (G_OBJECT (bus), "message::error", (GCallback)error_cb, &data);
-   g_signal_connect (G_OBJECT (bus), "message::eos", (GCallback)eos_cb, &data);
-   g_signal_connect (G_OBJECT (bus), "message::state-changed", (GCallback)state_changed_cb, &data);
-   g_signal_connect (G_OBJECT (bus), "message::qos", (GCallback)qos_cb, &data);
-   gst_object_unref (bus);
-
-   /* Start playing */
-   ret = gst_element_set_state(data.pipeline, GST_STATE_PLAYING);
-   switch (ret)
+   if (opt_decode_bench > 0)
    {
-   case GST_STATE_CHANGE_FAILURE:
+      if (argc < 2)
       {
-         g_printerr ("Unable to set the pipeline to the playing state.\n");
-         gst_object_unref (data.pipeline);
+         g_printerr("Usage: %s --decode-bench=N CAPTURE [CAPTURE...]\n", argv[0]);
          return -1;
       }
-   case GST_STATE_CHANGE_NO_PREROLL:
-      /* Got this from basic-tutorial-12 but it doesn't seem to work */
-      data.is_live = TRUE;
-      break;
-   default:
-      break;
+      return decode_bench(argc - 1, argv + 1);
+   }
+
+   gtk_init (&argc, &argv);
+   gtk_ms = ms_since_exec();
+
+   if (argc < 2)
+   {
+      g_printerr("Usage: %s [OPTION...] URL [URL...]\n", argv[0]);
+      return -1;
+   }
+
+   data.streams = g_ptr_array_new_with_free_func((GDestroyNotify)stream_free);
+   data.cancellable = g_cancellable_new();
+   for (int i = 1; i < argc; i++)
+   {
+      g_ptr_array_add(data.streams, stream_new(&data, i - 1, argv[i]));
    }
 
+   /* Create the GUI (and save the window pointers) */
+   create_ui(&data);
+   data.base_rss = read_rss();
+
+   g_print("Startup: main after %.0fms, gst_init done after %.0fms, gtk_init after %.0fms\n", main_ms, gst_ms, gtk_ms);
+
+   /* Build and start all streams, see startup_schedule() */
+   startup_start(&data);
+   if (opt_hls_port > 0 || opt_whep_port > 0 || opt_whep_test)
+   {
+      http_start(&data);
+   }
+   if (opt_relay_port > 0)
+   {
+      relay_start(&data);
+   }
+   if (opt_stats_file)
+   {
+      stats_file_open(&data);
+   }
+   slo_start(&data);
+
    g_timeout_add_seconds(1, (GSourceFunc)update_timeinfo, &data);
+   if (opt_panel_interval > 0)
+   {
+      g_timeout_add(opt_panel_interval, (GSourceFunc)panel_update, &data);
+   }
 
    gtk_main ();
 
-   gst_element_set_state(data.pipeline, GST_STATE_NULL);
-   gst_object_unref(data.pipeline);
+   http_stop(&data);
+   g_clear_object(&data.relay_server);
+   stats_file_close(&data);
+   slo_stop(&data);
+   g_thread_pool_free(data.build_pool, TRUE, TRUE);
+   /* The streaming threads push to the metadata pool, its jobs use the streams */
+   for (guint i = 0; i < data.streams->len; i++)
+   {
+      stream_stop(g_ptr_array_index(data.streams, i));
+   }
+   if (data.metadata_pool)
+   {
+      g_thread_pool_free(data.metadata_pool, TRUE, TRUE);
+   }
+   g_queue_clear(&data.connect_queue);
+   g_hash_table_destroy(data.host_handshakes);
+   g_ptr_array_free(data.streams, TRUE);
+   g_object_unref(data.cancellable);
    return 0;
 }
 
@@ -0,0 +1,206 @@
+/*
+ * statsdump
+ * =========
+ *
+ * Reads the stats file demo writes with --stats-file, also while demo runs
+ * or after it died, see statsfile.h:
+ *
+ *   statsdump FILE                    CSV of all records, oldest first
+ *   statsdump --stream=N FILE         Idem, only stream N (1 based, input<N>)
+ *   statsdump --last=S FILE           Only the last S seconds
+ *   statsdump --summary FILE          Per stream: time covered and averages
+ *
+ * The CSV plots directly, e.g. with gnuplot:
+ *
+ *   statsdump --stream=1 stats.bin > s.csv
+ *   gnuplot -p -e "set datafile separator ','; plot 's.csv' using 1:4 with lines title 'p95'"
+ *
+ * Build: gcc statsdump.c -o statsdump
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "statsfile.h"
+
+typedef struct
+{
+   uint64_t     records;
+   int64_t      first;
+   int64_t      last;
+   double       latency_p95;
+   double       latency_max;
+   double       cpu;
+   double       bitrate;
+   uint64_t     frames;
+   uint64_t     frames_dropped;
+   uint64_t     packets_lost;
+   uint64_t     corrupted;
+   uint64_t     flushes;
+}
+Summary;
+
+static void print_time(int64_t time)
+{
+   time_t seconds = time / 1000000;
+   struct tm tm;
+   char text[32];
+
+   gmtime_r(&seconds, &tm);
+   strftime(text, sizeof(text), "%Y-%m-%dT%H:%M:%SZ", &tm);
+   printf("%s", text);
+}
+
+static void print_record(const StatsRecord* r)
+{
+   printf("%.3f,%u,%.1f,%.1f,%.1f,%.1f,%.2f,%.1f,%.2f,%u,%u,%u,%u,%u,%u,%d\n",
+         r->time / 1e6, r->stream + 1, r->latency_p50, r->latency_p95, r->latency_p99, r->latency_max, r->jitter, r->cpu, r->skew,
+         r->bitrate, r->frames, r->frames_dropped, r->packets_lost, r->corrupted, r->flushes, (r->flags & STATS_RECORD_PLAYING) != 0);
+}
+
+static void summarize(Summary* s, const StatsRecord* r)
+{
+   if (s->records++ == 0)
+   {
+      s->first = r->time;
+   }
+   s->last = r->time;
+   s->latency_p95 += r->latency_p95;
+   if (r->latency_max > s->latency_max)
+   {
+      s->latency_max = r->latency_max;
+   }
+   s->cpu += r->cpu;
+   s->bitrate += r->bitrate;
+   s->frames += r->frames;
+   s->frames_dropped += r->frames_dropped;
+   s->packets_lost += r->packets_lost;
+   s->corrupted += r->corrupted;
+   s->flushes += r->flushes;
+}
+
+int main(int argc, char* argv[])
+{
+   const char* filename = NULL;
+   int stream = 0, last = 0, summary = 0;
+   Summary summaries[STATS_FILE_MAX_STREAMS];
+   StatsFileHeader* header;
+   struct stat st;
+   uint64_t written, first;
+   int64_t newest = 0;
+   void* map;
+   int fd;
+
+   for (int i = 1; i < argc; i++)
+   {
+      if (strncmp(argv[i], "--stream=", 9) == 0)
+      {
+         stream = atoi(argv[i] + 9);
+      }
+      else if (strncmp(argv[i], "--last=", 7) == 0)
+      {
+         last = atoi(argv[i] + 7);
+      }
+      else if (strcmp(argv[i], "--summary") == 0)
+      {
+         summary = 1;
+      }
+      else
+      {
+         filename = argv[i];
+      }
+   }
+   if (!filename)
+   {
+      fprintf(stderr, "Usage: %s [--stream=N] [--last=S] [--summary] FILE\n", argv[0]);
+      return 2;
+   }
+
+   fd = open(filename, O_RDONLY);
+   if (fd < 0 || fstat(fd, &st) < 0 || (size_t)st.st_size < STATS_FILE_HEADER_SIZE)
+   {
+      perror(filename);
+      return 1;
+   }
+   map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+   close(fd);
+   if (map == MAP_FAILED)
+   {
+      perror(filename);
+      return 1;
+   }
+   header = map;
+   if (header->magic != STATS_FILE_MAGIC || header->version != STATS_FILE_VERSION || header->record_size != sizeof(StatsRecord) ||
+       header->capacity == 0 || (size_t)st.st_size < stats_file_size(header->capacity))
+   {
+      fprintf(stderr, "%s: not a stats file of this version\n", filename);
+      return 1;
+   }
+
+   written = __atomic_load_n(&header->written, __ATOMIC_ACQUIRE);
+   first = written > header->capacity ? written - header->capacity : 0;
+   if (last > 0 && written > 0)
+   {
+      StatsRecord r;
+
+      if (stats_record_read(stats_file_record(map, written - 1), &r))
+      {
+         newest = r.time;
+      }
+   }
+
+   memset(summaries, 0, sizeof(summaries));
+   if (!summary)
+   {
+      printf("time,stream,latency_p50,latency_p95,latency_p99,latency_max,jitter,cpu,skew_ppm,bitrate_kbps,frames,frames_dropped,packets_lost,corrupted,flushes,playing\n");
+   }
+   for (uint64_t n = first; n < written; n++)
+   {
+      StatsRecord r;
+
+      /* The oldest may be overwritten meanwhile, those fail the sequence check */
+      if (!stats_record_read(stats_file_record(map, n), &r) || r.stream >= STATS_FILE_MAX_STREAMS ||
+          (stream > 0 && r.stream + 1 != stream) || (last > 0 && r.time < newest - (int64_t)last * 1000000))
+      {
+         continue;
+      }
+      if (summary)
+      {
+         summarize(&summaries[r.stream], &r);
+      }
+      else
+      {
+         print_record(&r);
+      }
+   }
+
+   if (summary)
+   {
+      for (uint32_t i = 0; i < header->streams && i < STATS_FILE_MAX_STREAMS; i++)
+      {
+         Summary* s = &summaries[i];
+
+         if (s->records == 0)
+         {
+            continue;
+         }
+         printf("input%u %s\n   ", i + 1, header->names[i]);
+         print_time(s->first);
+         printf(" - ");
+         print_time(s->last);
+         printf(", %llu s\n   latency p95 avg %.1fms, max %.1fms, cpu avg %.1f%%, bitrate avg %.0f kbit/s\n"
+               "   %llu frames, %llu dropped, %llu packets lost, %llu corrupted shown, %llu flushes\n",
+               (unsigned long long)s->records, s->latency_p95 / s->records, s->latency_max, s->cpu / s->records, s->bitrate / s->records,
+               (unsigned long long)s->frames, (unsigned long long)s->frames_dropped, (unsigned long long)s->packets_lost,
+               (unsigned long long)s->corrupted, (unsigned long long)s->flushes);
+      }
+   }
+   munmap(map, st.st_size);
+   return 0;
+}
@@ -0,0 +1,106 @@
+/*
+ * Stats time series file
+ * ======================
+ *
+ * Layout of the file demo writes with --stats-file and statsdump reads. A
+ * header page, then a ring of fixed size records: one per stream per second.
+ * The file is created at its full size and memory mapped, so the writer
+ * only stores to memory, and whatever was written survives the process
+ * dying. The kernel writes it back on its own.
+ *
+ * Every record is a seqlock. Its sequence is odd while it's being written
+ * and even once complete, and the reader only takes a copy when it reads the
+ * same even sequence before and after. The header's count of records
+ * written goes up after each complete record. There's one writer, so no
+ * locks and no system calls
+ */
+
+#ifndef STATSFILE_H
+#define STATSFILE_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define STATS_FILE_MAGIC 0x4c4c5331           /* "LLS1" */
+#define STATS_FILE_VERSION 1
+#define STATS_FILE_HEADER_SIZE 4096
+#define STATS_FILE_MAX_STREAMS 32
+#define STATS_FILE_NAME_SIZE 96
+
+typedef struct
+{
+   uint32_t     magic;
+   uint32_t     version;
+   uint32_t     header_size;
+   uint32_t     record_size;
+   uint32_t     capacity;                     /* Records in the ring */
+   uint32_t     streams;
+   int64_t      start_time;                   /* Unix time in us */
+   uint64_t     written;                      /* Records written, record n is at n % capacity */
+   char         names[STATS_FILE_MAX_STREAMS][STATS_FILE_NAME_SIZE]; /* The URLs, no passwords */
+}
+StatsFileHeader;
+
+typedef struct
+{
+   uint32_t     sequence;                     /* Odd while being written */
+   uint16_t     stream;                       /* 0 based, see the header's names */
+   uint16_t     flags;                        /* STATS_RECORD_xxx */
+   int64_t      time;                         /* Unix time in us */
+   float        latency_p50;                  /* ms, arrival until the frame is due, see skew_add_hold() */
+   float        latency_p95;
+   float        latency_p99;
+   float        latency_max;
+   float        jitter;                       /* ms, the jitterbuffer's */
+   float        cpu;                          /* % of one core */
+   float        skew;                         /* ppm */
+   uint32_t     bitrate;                      /* kbit/s received */
+   uint16_t     frames;                       /* Decoded in this second */
+   uint16_t     frames_dropped;               /* Decoder QoS, flushes and held back */
+   uint16_t     packets_lost;                 /* Late or lost, by the jitterbuffer */
+   uint16_t     corrupted;                    /* Corrupted frames shown */
+   uint16_t     flushes;
+   uint16_t     reserved;
+}
+StatsRecord;
+
+#define STATS_RECORD_PLAYING 1                /* The pipeline was at least PAUSED */
+
+static inline size_t stats_file_size(uint32_t capacity)
+{
+   return STATS_FILE_HEADER_SIZE + (size_t)capacity * sizeof(StatsRecord);
+}
+
+static inline StatsRecord* stats_file_record(void* map, uint64_t n)
+{
+   StatsFileHeader* header = map;
+
+   return (StatsRecord*)((char*)map + STATS_FILE_HEADER_SIZE) + n % header->capacity;
+}
+
+static inline void stats_record_write(StatsFileHeader* header, const StatsRecord* record)
+{
+   StatsRecord* slot = stats_file_record(header, header->written);
+   uint32_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_RELAXED);
+
+   __atomic_store_n(&slot->sequence, sequence | 1, __ATOMIC_RELAXED);
+   __atomic_thread_fence(__ATOMIC_RELEASE);
+   memcpy((char*)slot + sizeof(slot->sequence), (const char*)record + sizeof(record->sequence), sizeof(StatsRecord) - sizeof(record->sequence));
+   __atomic_store_n(&slot->sequence, (sequence | 1) + 1, __ATOMIC_RELEASE);
+   __atomic_store_n(&header->written, header->written + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Returns 0 when the record was being written (or never was)
+ */
+
+static inline int stats_record_read(const StatsRecord* slot, StatsRecord* record)
+{
+   uint32_t before = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+
+   memcpy(record, slot, sizeof(StatsRecord));
+   __atomic_thread_fence(__ATOMIC_ACQUIRE);
+   return before != 0 && (before & 1) == 0 && __atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) == before;
+}
+
+#endif